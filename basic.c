@@ -0,0 +1,457 @@
+/*
+ *  basic.c - load TI BASIC programs directly into VDP RAM
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "cpu.h"
+
+// Instead of typing a program in through KSCAN, put it where OLD would:
+// the line number table and the lines at the top of VDP memory, with the
+// BASIC pointers in scratchpad set to match.  Works from the TI BASIC or
+// Extended BASIC command prompt (program in VDP RAM, no 32K in XB).
+//
+// The line number table has 4 byte entries, highest line number first:
+// line number, then the VDP address of the line.  Each line is a length
+// byte followed by tokens and a zero terminator.
+//
+// A PROGRAM file is an 8 byte header and a copy of VDP RAM from the start
+// of the line number table to the top of memory:
+//   check word (start ^ end, negated if list protected)
+//   end of line number table, start of line number table, top of memory
+
+#define STLN   0x8330 // start of line number table
+#define ENLN   0x8332 // end of line number table (last byte)
+#define FREPTR 0x8340 // free space pointer, grows down to the program
+#define MEMTOP 0x8370 // highest VDP address available to BASIC
+
+#define VDP_LOW 0x0A00 // lowest address a program may use
+#define MAX_LINE 254
+
+static const struct {
+	const char *name;
+	u8 token;
+} keywords[] = {
+	{"ELSE", 0x81}, {"IF", 0x84}, {"GO", 0x85},
+	{"GOTO", 0x86}, {"GOSUB", 0x87}, {"RETURN", 0x88}, {"DEF", 0x89},
+	{"DIM", 0x8A}, {"END", 0x8B}, {"FOR", 0x8C}, {"LET", 0x8D},
+	{"BREAK", 0x8E}, {"UNBREAK", 0x8F}, {"TRACE", 0x90}, {"UNTRACE", 0x91},
+	{"INPUT", 0x92}, {"DATA", 0x93}, {"RESTORE", 0x94}, {"RANDOMIZE", 0x95},
+	{"NEXT", 0x96}, {"READ", 0x97}, {"STOP", 0x98}, {"DELETE", 0x99},
+	{"REM", 0x9A}, {"ON", 0x9B}, {"PRINT", 0x9C}, {"CALL", 0x9D},
+	{"OPTION", 0x9E}, {"OPEN", 0x9F}, {"CLOSE", 0xA0}, {"SUB", 0xA1},
+	{"DISPLAY", 0xA2}, {"IMAGE", 0xA3}, {"ACCEPT", 0xA4}, {"ERROR", 0xA5},
+	{"WARNING", 0xA6}, {"SUBEXIT", 0xA7}, {"SUBEND", 0xA8}, {"RUN", 0xA9},
+	{"LINPUT", 0xAA}, {"THEN", 0xB0}, {"TO", 0xB1}, {"STEP", 0xB2},
+	{"OR", 0xBA}, {"AND", 0xBB}, {"XOR", 0xBC}, {"NOT", 0xBD},
+	{"EOF", 0xCA}, {"ABS", 0xCB}, {"ATN", 0xCC}, {"COS", 0xCD},
+	{"EXP", 0xCE}, {"INT", 0xCF}, {"LOG", 0xD0}, {"SGN", 0xD1},
+	{"SIN", 0xD2}, {"SQR", 0xD3}, {"TAN", 0xD4}, {"LEN", 0xD5},
+	{"CHR$", 0xD6}, {"RND", 0xD7}, {"SEG$", 0xD8}, {"POS", 0xD9},
+	{"VAL", 0xDA}, {"STR$", 0xDB}, {"ASC", 0xDC}, {"PI", 0xDD},
+	{"REC", 0xDE}, {"MAX", 0xDF}, {"MIN", 0xE0}, {"RPT$", 0xE1},
+	{"NUMERIC", 0xE8}, {"DIGIT", 0xE9}, {"UALPHA", 0xEA}, {"SIZE", 0xEB},
+	{"ALL", 0xEC}, {"USING", 0xED}, {"BEEP", 0xEE}, {"ERASE", 0xEF},
+	{"AT", 0xF0}, {"BASE", 0xF1}, {"VARIABLE", 0xF3}, {"RELATIVE", 0xF4},
+	{"INTERNAL", 0xF5}, {"SEQUENTIAL", 0xF6}, {"OUTPUT", 0xF7},
+	{"UPDATE", 0xF8}, {"APPEND", 0xF9}, {"FIXED", 0xFA},
+	{"PERMANENT", 0xFB}, {"TAB", 0xFC}, {"VALIDATE", 0xFE},
+};
+
+static const char symbols[] = ",;:)(&=<>+-*/^#";
+static const u8 symbol_tokens[] = {
+	0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xBE, 0xBF,
+	0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xFD };
+
+enum {
+	TOK_XB_SEP  = 0x82, // :: statement separator
+	TOK_XB_REM  = 0x83, // ! tail comment
+	TOK_QUOTED  = 0xC7, // length, characters
+	TOK_STRING  = 0xC8, // unquoted string or number: length, characters
+	TOK_LINENUM = 0xC9, // 2 byte line number
+};
+
+struct line {
+	u16 number;
+	u8 len;
+	u8 tok[MAX_LINE+1];
+};
+
+
+/****************************************
+ * Tokenizer                            *
+ ****************************************/
+
+static int keyword(const char *s, int len)
+{
+	unsigned int i;
+	for (i = 0; i < ARRAY_SIZE(keywords); i++)
+		if (strlen(keywords[i].name) == (size_t)len &&
+		    strncmp(keywords[i].name, s, len) == 0)
+			return keywords[i].token;
+	return -1;
+}
+
+// keywords that can be followed by line numbers
+static int takes_line_number(int tok)
+{
+	switch (tok) {
+	case 0x81: case 0x86: case 0x87: case 0x88: // ELSE GOTO GOSUB RETURN
+	case 0x8E: case 0x8F: case 0x94: case 0xA5: // BREAK UNBREAK RESTORE ERROR
+	case 0xA9: case 0xB0: case 0xED:           // RUN THEN USING
+		return 1;
+	}
+	return 0;
+}
+
+static int emit(struct line *l, u8 b)
+{
+	if (l->len >= MAX_LINE)
+		return -1;
+	l->tok[l->len++] = b;
+	return 0;
+}
+
+static int emit_string(struct line *l, u8 tok, const char *s, int len)
+{
+	int i;
+	if (emit(l, tok) || emit(l, len))
+		return -1;
+	for (i = 0; i < len; i++)
+		if (emit(l, s[i]))
+			return -1;
+	return 0;
+}
+
+// Crunch one line of text like the BASIC line editor does.
+// Returns 0 on success, 1 if not a program line, -1 on error
+static int tokenize(const char *s, struct line *l)
+{
+	int line_ref = 0, data = 0, call = 0;
+	unsigned long n;
+	char *end;
+
+	while (*s == ' ' || *s == '\t') s++;
+	if (!isdigit(*s))
+		return 1;
+	n = strtoul(s, &end, 10);
+	if (n < 1 || n > 32767)
+		return -1;
+	l->number = n;
+	l->len = 0;
+	s = end;
+
+	while (*s && *s != '\n' && *s != '\r') {
+		const char *start = s;
+		char c = toupper(*s);
+		int tok = -1;
+
+		if (c == ' ' || c == '\t') {
+			s++;
+			continue;
+		}
+		if (c == '"') { // quoted string, "" is a quote
+			char buf[MAX_LINE];
+			int len = 0;
+			for (s++; *s && *s != '\n' && *s != '\r'; s++) {
+				if (*s == '"' && *++s != '"')
+					break;
+				if (len < MAX_LINE) buf[len++] = *s;
+			}
+			if (emit_string(l, TOK_QUOTED, buf, len))
+				return -1;
+			line_ref = call = 0;
+			continue;
+		}
+		if (data && c != ',' && !(c == ':' && s[1] == ':')) {
+			// unquoted DATA item, spaces inside are kept
+			while (*s && *s != ',' && *s != '\n' && *s != '\r' &&
+			       !(*s == ':' && s[1] == ':'))
+				s++;
+			while (s > start && s[-1] == ' ') s--;
+			if (emit_string(l, TOK_STRING, start, s - start))
+				return -1;
+			while (*s == ' ') s++;
+			continue;
+		}
+		if (isdigit(c) || c == '.') {
+			while (isdigit(*s) || *s == '.') s++;
+			if (toupper(*s) == 'E' && !line_ref) {
+				const char *e = s + 1;
+				if (*e == '+' || *e == '-') e++;
+				if (isdigit(*e)) {
+					s = e;
+					while (isdigit(*s)) s++;
+				}
+			}
+			if (line_ref) {
+				n = strtoul(start, NULL, 10);
+				if (emit(l, TOK_LINENUM) || emit(l, n >> 8) || emit(l, n & 0xff))
+					return -1;
+			} else if (emit_string(l, TOK_STRING, start, s - start)) {
+				return -1;
+			}
+			continue;
+		}
+		if (isalpha(c) || c == '@' || c == '_') {
+			char name[MAX_LINE];
+			int len = 0;
+			while ((isalnum(*s) || *s == '@' || *s == '_') && len < MAX_LINE-1)
+				name[len++] = toupper(*s++);
+			if (*s == '$')
+				name[len++] = *s++;
+			tok = call ? -1 : keyword(name, len);
+			if (tok < 0) {
+				// subprogram names are unquoted strings, variables are text
+				if (call) {
+					if (emit_string(l, TOK_STRING, name, len))
+						return -1;
+				} else {
+					int i;
+					for (i = 0; i < len; i++)
+						if (emit(l, name[i]))
+							return -1;
+				}
+				line_ref = call = 0;
+				continue;
+			}
+			if (emit(l, tok))
+				return -1;
+			if (tok == 0x9A) { // REM, the rest of the line is text
+				while (*s == ' ') s++;
+				while (*s && *s != '\n' && *s != '\r')
+					if (emit(l, *s++))
+						return -1;
+				break;
+			}
+			call = (tok == 0x9D);
+			data = (tok == 0x93 || tok == 0xA3); // DATA IMAGE
+			if (tok == 0xB1 || tok == 0xA1) // TO SUB after GO
+				line_ref = l->len >= 2 && l->tok[l->len-2] == 0x85;
+			else
+				line_ref = takes_line_number(tok);
+			continue;
+		}
+		if (c == ':' && s[1] == ':') {
+			s += 2;
+			if (emit(l, TOK_XB_SEP))
+				return -1;
+			line_ref = data = call = 0;
+			continue;
+		}
+		if (c == '!') { // Extended BASIC tail comment
+			if (emit(l, TOK_XB_REM))
+				return -1;
+			for (s++; *s && *s != '\n' && *s != '\r'; s++)
+				if (emit(l, *s))
+					return -1;
+			break;
+		}
+		if (strchr(symbols, c)) {
+			tok = symbol_tokens[strchr(symbols, c) - symbols];
+			s++;
+			if (emit(l, tok))
+				return -1;
+			// a comma continues a list of line numbers (ON X GOTO 10,20)
+			if (tok != 0xB3)
+				line_ref = 0;
+			continue;
+		}
+		return -1;
+	}
+	return emit(l, 0);
+}
+
+static int line_cmp(const void *a, const void *b)
+{
+	return ((const struct line*)b)->number - ((const struct line*)a)->number;
+}
+
+
+/****************************************
+ * Loading                              *
+ ****************************************/
+
+static u16 get16(const u8 *p) { return (p[0] << 8) | p[1]; }
+static void put16(u8 *p, u16 v) { p[0] = v >> 8; p[1] = v & 0xff; }
+
+// Set the BASIC pointers for a program at start..top in VDP RAM
+static void set_pointers(u16 start, u16 end)
+{
+	cpu_mem_w(STLN, start);
+	cpu_mem_w(ENLN, end);
+	cpu_mem_w(FREPTR, start - 1);
+}
+
+// Returns the top of VDP memory for the program, or -1 if it can't go there
+static int memtop(void)
+{
+	u16 top = cpu_mem_r(MEMTOP);
+	if (top < VDP_LOW || top >= VDP_RAM_SIZE) {
+		fprintf(stderr, "BASIC: memory top %04X, not at the BASIC prompt?\n", top);
+		return -1;
+	}
+	// Extended BASIC with the 32K expansion keeps the line number table
+	// and lines in CPU RAM, so these point past the end of VDP RAM
+	if (cpu_mem_r(STLN) >= VDP_RAM_SIZE || cpu_mem_r(ENLN) >= VDP_RAM_SIZE) {
+		fprintf(stderr, "BASIC: program is in CPU RAM (Extended BASIC with "
+			"32K?), only loading into VDP RAM is supported\n");
+		return -1;
+	}
+	return top;
+}
+
+// Load a PROGRAM image, relocated to the current top of memory
+static int load_program(const u8 *d, unsigned int size)
+{
+	u16 check, a, b, top, start, end, len, i;
+	int new_top, offset;
+
+	if (size < 8)
+		return 1;
+	check = get16(d);
+	a = get16(d + 2);
+	b = get16(d + 4);
+	top = get16(d + 6);
+	if ((check != (a ^ b) && (u16)-check != (a ^ b)) || a == b)
+		return 1;
+	start = a < b ? a : b;
+	end = a < b ? b : a;
+	len = top - start + 1;
+	if (top < end || (end - start + 1) % 4 || size - 8 < len)
+		return 1;
+
+	if ((new_top = memtop()) < 0)
+		return -1;
+	offset = new_top - top;
+	if (start + offset < VDP_LOW) {
+		fprintf(stderr, "BASIC: program too large (%d bytes)\n", len);
+		return -1;
+	}
+	memcpy(vdp.ram + start + offset, d + 8, len);
+	for (i = start + offset; i < end + offset; i += 4)
+		put16(vdp.ram + i + 2, get16(vdp.ram + i + 2) + offset);
+	set_pointers(start + offset, end + offset);
+	debug_log("BASIC: loaded PROGRAM, %d lines\n", (end - start + 1) / 4);
+	return 0;
+}
+
+// Tokenize a text listing and load it below the top of memory
+static int load_listing_text(const char *text)
+{
+	struct line *lines = NULL;
+	int count = 0, i, j, total = 0, top, addr;
+
+	while (*text) {
+		struct line l;
+		int ret = tokenize(text, &l);
+		if (ret < 0) {
+			fprintf(stderr, "BASIC: can't tokenize: %.*s\n",
+				(int)strcspn(text, "\r\n"), text);
+			free(lines);
+			return -1;
+		}
+		if (ret == 0) {
+			for (i = 0; i < count; i++) // a repeated line replaces the old
+				if (lines[i].number == l.number)
+					break;
+			if (i == count) {
+				lines = realloc(lines, (count + 1) * sizeof(*lines));
+				count++;
+			}
+			lines[i] = l;
+		} else if (count == 0 && *text != '\n' && *text != '\r') {
+			free(lines);
+			return 1; // doesn't start with a line number, not BASIC
+		}
+		text += strcspn(text, "\n");
+		if (*text) text++;
+	}
+	if (count == 0)
+		return 1;
+
+	qsort(lines, count, sizeof(*lines), line_cmp);
+	for (i = 0; i < count; i++)
+		total += 4 + 1 + lines[i].len;
+	if ((top = memtop()) < 0 || top + 1 - total < VDP_LOW) {
+		if (top >= 0)
+			fprintf(stderr, "BASIC: program too large (%d bytes)\n", total);
+		free(lines);
+		return -1;
+	}
+
+	addr = top + 1 - total + 4 * count; // lines follow the table
+	for (i = 0, j = top + 1 - total; i < count; i++, j += 4) {
+		put16(vdp.ram + j, lines[i].number);
+		put16(vdp.ram + j + 2, addr + 1);
+		vdp.ram[addr] = lines[i].len;
+		memcpy(vdp.ram + addr + 1, lines[i].tok, lines[i].len);
+		addr += 1 + lines[i].len;
+	}
+	set_pointers(top + 1 - total, top + 4 * count - total);
+	debug_log("BASIC: tokenized %d lines\n", count);
+	free(lines);
+	return 0;
+}
+
+// Load a BASIC program file: a PROGRAM image (optionally with a TIFILES
+// header) or a text listing.  Returns 0 on success, 1 if the file isn't a
+// BASIC program, -1 on error.
+int basic_load(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	u8 *d;
+	long size;
+	int ret;
+
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size <= 0 || size > 0x10000) {
+		fclose(f);
+		return 1;
+	}
+	d = malloc(size + 1);
+	if (fread(d, 1, size, f) != (size_t)size) {
+		perror(filename);
+		fclose(f);
+		free(d);
+		return -1;
+	}
+	fclose(f);
+	d[size] = 0;
+
+	if (size > 128 && memcmp(d, "\x07TIFILES", 8) == 0)
+		ret = load_program(d + 128, size - 128);
+	else if ((ret = load_program(d, size)) == 1 && !memchr(d, 0, size))
+		ret = load_listing_text((char*)d);
+	free(d);
+	return ret;
+}
@@ -33,10 +33,21 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 
 #include "cpu.h"
 
+#ifdef ENABLE_PERSIST
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+#include "bulwip.h"
 
 #ifdef ENABLE_GIF
 #include "gif/gif.h"
@@ -47,26 +58,47 @@ static GifWriter gif;
 
 
 #ifdef COMPILED_ROMS
-#include "994arom.h"
-#include "994agrom.h"
-#include "mbtest.h"
-//#include "megademo.h"
-
-static const struct {
-	const char *filename;
+// ROM images built into the binary by "make bundle", in memory shared by
+// every process running it.  ROMs are already swapped to u16 at build
+// time, so they are used in place, like a file that was loaded.  The
+// console ROM is the one writable array, for FP HLE to patch.
+struct bundle_rom {
+	const char *filename; // without the directory
 	const void *data;
 	unsigned int len;
-} comp_roms[] = {
-	{"994arom.bin", rom994a, sizeof(rom994a)},
-	{"994agrom.bin", grom994a, sizeof(grom994a)},
-	{"mbtest.bin", mbtest, sizeof(mbtest)},
-//	{"megademo8.bin", megademo, sizeof(megademo)},
 };
+#define ROM_ALIGN __attribute__((aligned(4096))) // see rom_writable()
+#include "bundle.h"
 
+// Returns the built in image for a file name, ignoring the directory
+static const struct bundle_rom *find_compiled(const char *filename)
+{
+	const char *base = strrchr(filename, '/');
+	unsigned int i;
+
+	base = base ? base + 1 : filename;
+	for (i = 0; i < ARRAY_SIZE(comp_roms); i++)
+		if (strcmp(comp_roms[i].filename, base) == 0)
+			return &comp_roms[i];
+	return NULL;
+}
+
+static int is_compiled(const void *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(comp_roms); i++)
+		if ((const u8*)p >= (const u8*)comp_roms[i].data &&
+		    (const u8*)p < (const u8*)comp_roms[i].data + comp_roms[i].len)
+			return 1;
+	return 0;
+}
 #endif
 
 static FILE *log = NULL;
-static FILE *disasmf = NULL;
+#ifndef LIBBULWIP
+static FILE *disasmf = NULL; // see main()
+#endif
 
 int debug_log(const char *fmt, ...)
 {
@@ -79,7 +111,45 @@ int debug_log(const char *fmt, ...)
 }
 
 static void* my_realloc(void *p, size_t size) { return realloc(p, size); }
-static void my_free(void *p) { free(p); }
+static void my_free(void *p)
+{
+#ifdef COMPILED_ROMS
+	if (is_compiled(p))
+		return;
+#endif
+	free(p);
+}
+
+// Resize a loaded ROM, copying it to the heap if it is built in
+static void* rom_realloc(void *p, size_t old_size, size_t size)
+{
+#ifdef COMPILED_ROMS
+	if (is_compiled(p)) {
+		void *copy = malloc(size);
+		if (copy)
+			memcpy(copy, p, old_size < size ? old_size : size);
+		return copy;
+	}
+#endif
+	return realloc(p, size);
+}
+
+// Make a loaded ROM writable for patching.  The built in console ROM
+// already is, and only the pages that get patched stop being shared.
+// Any other built in image is copied.
+static void* rom_writable(void *p, size_t size)
+{
+#ifdef COMPILED_ROMS
+	const struct bundle_rom *console = find_compiled("994arom.bin");
+
+	if (!is_compiled(p) || (console && p == console->data))
+		return p;
+	return rom_realloc(p, size, size);
+#else
+	(void)size;
+	return p;
+#endif
+}
 static char* my_strdup(const char *p)
 {
 #ifdef _WIN32
@@ -103,17 +173,24 @@ static char* my_strdup(const char *p)
 
 
 static u16 tms9901_int_mask = 0; // 9901 interrupt mask
+static int ext_int = 0; // 9901 INT1, from peripheral cards
 
 #ifdef ENABLE_DEBUGGER
 int debug_en = 0;
 int debug_break = DEBUG_RUN;
 #endif
 
-static u16 fast_ram[128] = {}; // 256 bytes at 8000-80ff,repeated at 8100,8200,8300
+#ifdef __linux__
+#define MACHINE_ALIGN (2*1024*1024) // allows a transparent huge page
+#else
+#define MACHINE_ALIGN 4096
+#endif
+struct machine machine __attribute__((aligned(MACHINE_ALIGN)));
 
-static u16 *ram = NULL; // 32k RAM or SAMS (TODO)
-static unsigned int ram_size = 0; // in bytes
-static u16 sams_bank[16] = {
+static u16 *const fast_ram = machine.scratchpad;
+static u16 *const ram = machine.ram; // 32k RAM or SAMS
+static unsigned int ram_size = 0; // in bytes, in use
+static const u16 sams_bank_default[16] = {
 	0x000,0x000, // >0000,>1000
 	0x000,0x100, // >2000,>3000
 	0x000,0x000, // >4000,>5000
@@ -122,6 +199,8 @@ static u16 sams_bank[16] = {
 	0x200,0x300, // >A000,>B000
 	0x400,0x500, // >C000,>D000
 	0x600,0x700};// >E000,>F000
+static u16 sams_bank[16];
+static int sams_transparent = 1;
 
 char *cartridge_name = NULL;
 static u16 *cart_rom = NULL;
@@ -141,38 +220,53 @@ static unsigned int grom_size = 0;
 static u8 grom_latch = 0, grom_last = 0x00;
 static u16 ga; // grom address
 
+static u8 *speech_rom = NULL;
+static unsigned int speech_rom_size = 0;
+static u16 *rs232_rom = NULL;
+static unsigned int rs232_rom_size = 0;
+
 // keyboard and CRU
 u8 keyboard[8] = {0};
+static u8 keyboard_out[16]; // active low column inputs indexed by keyboard_row
 static u8 keyboard_row = 0;
 static u8 timer_mode = 0;
 static u8 alpha_lock = 0;
-static unsigned int total_cycles = 0;
-static volatile unsigned int total_cycles_busy = 0;
+static void keyboard_update(void);
+static u64 total_cycles = 0; // cpu cycles at the end of the current line
+static unsigned int total_cycles_seq = 0; // seqlock, odd while updating
 
 
+#ifdef ENABLE_PERSIST
+static void persist_detach(void);
+#else
+#define persist_detach() do { } while (0)
+#endif
+
 struct state {
 	u16 pc, wp, st;
-	u16 fast_ram[128];
-	u16 ram[32*1024/2];
 	u16 cart_bank;
 	u8 grom_latch, grom_last;
 	u16 ga;
 	u8 keyboard_row;
 	u8 timer_mode;
 	u8 alpha_lock;
-	struct vdp vdp;
 	int cyc;
+	unsigned int ram_size;
+	struct machine m; // last, only ram_size bytes of m.ram are saved
 };
 
+// bytes used by a snapshot
+#define STATE_SIZE(ram_size) (offsetof(struct state, m.ram) + (ram_size))
+
 struct state* save_state(struct state *s)
 {
 	if (!s) s = malloc(sizeof(struct state));
-	memset(s, 0, sizeof(struct state));
+	memset(s, 0, offsetof(struct state, m));
 	s->pc = get_pc();
 	s->wp = get_wp();
 	s->st = get_st();
-	memcpy(s->fast_ram, fast_ram, sizeof(fast_ram));
-	memcpy(s->ram, ram, sizeof(s->ram));
+	s->ram_size = ram_size;
+	memcpy(&s->m, &machine, STATE_SIZE(ram_size) - offsetof(struct state, m));
 	s->cart_bank = cart_bank;
 	s->grom_latch = grom_latch;
 	s->grom_last = grom_last;
@@ -180,7 +274,6 @@ struct state* save_state(struct state *s)
 	s->keyboard_row = keyboard_row;
 	s->timer_mode = timer_mode;
 	s->alpha_lock = alpha_lock;
-	memcpy(&s->vdp, &vdp, sizeof(struct vdp));
 	s->cyc = add_cyc(0);
 	return s;
 }
@@ -197,8 +290,9 @@ void load_state(struct state *s)
 	set_wp(s->wp);
 	set_st(s->st);
 
-	memcpy(fast_ram, s->fast_ram, sizeof(fast_ram));
-	memcpy(ram, s->ram, sizeof(s->ram));
+	persist_detach(); // keep the state out of the SAMS file
+	ram_size = s->ram_size;
+	memcpy(&machine, &s->m, STATE_SIZE(ram_size) - offsetof(struct state, m));
 	cart_bank = s->cart_bank;
 	grom_latch = s->grom_latch;
 	grom_last = s->grom_last;
@@ -206,7 +300,7 @@ void load_state(struct state *s)
 	keyboard_row = s->keyboard_row;
 	timer_mode = s->timer_mode;
 	alpha_lock = s->alpha_lock;
-	memcpy(&vdp, &s->vdp, sizeof(struct vdp));
+	keyboard_update();
 	set_cyc(s->cyc);
 }
 
@@ -215,7 +309,7 @@ void print_state(FILE *f, struct state *s)
 	int i;
 	fprintf(f, "PC = %04X\nWP = %04X\nST = %04X\ncyc = %d\n", s->pc, s->wp, s->st, s->cyc);
 	for (i = 0; i < 256/16; i++) {
-		u16 *p = s->fast_ram+i*8;
+		u16 *p = s->m.scratchpad+i*8;
 		fprintf(f, "%04X: %04x %04x %04x %04x  %04x %04x %04x %04x\n",
 			0x8300+i*16,p[0],p[1],p[2],p[3],p[4],p[5],p[6],p[7]);
 	}
@@ -246,25 +340,25 @@ void print_state(FILE *f, struct state *s)
 		s->keyboard_row,
 		s->timer_mode,
 		s->alpha_lock,
-		s->vdp.a,
-		s->vdp.latch,
-		s->vdp.y,
-		s->vdp.reg[0],
-		s->vdp.reg[1],
-		s->vdp.reg[2],
-		s->vdp.reg[3],
-		s->vdp.reg[4],
-		s->vdp.reg[5],
-		s->vdp.reg[6],
-		s->vdp.reg[7],
-		s->vdp.reg[VDP_ST]);
+		s->m.video.a,
+		s->m.video.latch,
+		s->m.video.y,
+		s->m.video.reg[0],
+		s->m.video.reg[1],
+		s->m.video.reg[2],
+		s->m.video.reg[3],
+		s->m.video.reg[4],
+		s->m.video.reg[5],
+		s->m.video.reg[6],
+		s->m.video.reg[7],
+		s->m.video.reg[VDP_ST]);
 	for (i = 0; i < 16*1024/16; i++) {
-		u8 *p = s->vdp.ram+i*16;
+		u8 *p = s->m.video.ram+i*16;
 		fprintf(f, "V%04X: %02x %02x %02x %02x %02x %02x %02x %02x  %02x %02x %02x %02x %02x %02x %02x %02x\n",
 			i*16,p[0],p[1],p[2],p[3],p[4],p[5],p[6],p[7],p[8],p[9],p[10],p[11],p[12],p[13],p[14],p[15]);
 	}
 	for (i = 0; i < 32*1024; i+=16) {
-		u16 *p = s->ram+(i/2);
+		u16 *p = s->m.ram+(i/2);
 		fprintf(f, "%04X: %04x %04x %04x %04x  %04x %04x %04x %04x\n",
 			(i<8192 ? 0x2000 : 0xa000-8192)+i,p[0],p[1],p[2],p[3],p[4],p[5],p[6],p[7]);
 	}
@@ -303,7 +397,7 @@ int undo_pop(void)
 		case UNDO_ST: set_st(w); break;
 		case UNDO_CYC: set_cyc(w); break;
 		case UNDO_VDPA: vdp.a = w; break;
-		case UNDO_VDPD: /* ??? */ break;
+		case UNDO_VDPD: vdp.buf = w; break;
 		case UNDO_VDPL: vdp.latch = w & 1; break;
 		case UNDO_VDPST: vdp.reg[VDP_ST] = w; break;
 		case UNDO_VDPY: vdp.y = w; break;
@@ -316,6 +410,7 @@ int undo_pop(void)
 		default:
 			if ((v & 0xc000) == UNDO_EXPRAM) {
 				//printf("undo exp a=%x w=%04X\n", v&0x3fff, w);
+				persist_detach();
 				ram[v & 0x3fff] = w;
 			} else if ((v & 0xf000) == UNDO_VDPRAM) {
 				vdp.ram[(u>>8) & 0x3fff] = u & 0xff;
@@ -390,22 +485,35 @@ void undo_fix_cyc(u16 cyc)
 
 #endif
 
-unsigned int get_total_cpu_cycles(void)
+// Machine timebase: 64-bit cpu cycles since power on, never wraps.
+// The total cycles and current cycle count are updated together at the
+// end of each scan line, so other threads (audio) read them under a
+// seqlock and retry if they raced with the update.
+u64 get_total_cpu_cycles(void)
 {
-	// The total cycles and current cycle count are updated independently
-	// at the end of each scan line.  So this could lead to a race condition
-	// where they are temporarily out of sync while both are updated.
-	// The 'busy' variable is set to the correct value during this update sequence and cleared after.
-	if (total_cycles_busy)
-		return total_cycles_busy;
-	unsigned int ret = total_cycles + add_cyc(0);
-	if (ret == 0) {
-		printf("%s: ret=%u total_cycles=%u\n", __func__, ret, total_cycles);
-	}
-	// otherwise combine 'total_cycles' and current cycle counter
+	unsigned int seq;
+	u64 ret;
+
+	do {
+		seq = __atomic_load_n(&total_cycles_seq, __ATOMIC_ACQUIRE);
+		ret = __atomic_load_n(&total_cycles, __ATOMIC_RELAXED) + add_cyc(0);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&total_cycles_seq, __ATOMIC_RELAXED));
 	return ret;
 }
 
+// Give the cpu another scan line of cycles, called from the emulation thread only
+static void total_cycles_add_line(void)
+{
+	unsigned int seq = total_cycles_seq;
+
+	__atomic_store_n(&total_cycles_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&total_cycles, total_cycles + CYCLES_PER_LINE, __ATOMIC_RELAXED);
+	add_cyc(-CYCLES_PER_LINE);
+	__atomic_store_n(&total_cycles_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 
 /******************************************
  * 8000-83FF  fast RAM                    *
@@ -451,15 +559,65 @@ static void sound_8400_w(u16 address, u16 value)
 	if (address == 0x8400) {
 		// sound chip
 		add_cyc(34);
-#ifdef USE_SDL
 		snd_w(value >> 8);
-#endif
 	} else {
 		add_cyc(6); // 2 cycles for memory access + 4 for multiplexer
 	}
 }
 
+#include "player.h" // TMS 9919 sound, for snd_w() and snd_render()
+
+// Sound chip writes are timestamped here, and replayed at that cycle when
+// snd_render() makes the samples, all on the emulation thread.
+void snd_w(unsigned char byte)
+{
+	snd_fifo(byte, 0, get_total_cpu_cycles());
+}
+
+static u64 snd_cycles = 0; // total_cycles at the last snd_render()
+static unsigned int snd_frac = 0; // remainder of cycles*SAMPLE_FREQUENCY
+
+// Render the sound chip and speech from the last call up to the end of
+// the last scanline.  Returns the number of samples, at most len, and any
+// more are dropped.  Call with len=0 to start over from now.
+int snd_render(u8 *buf, int len)
+{
+	u64 n = (total_cycles - snd_cycles) * SAMPLE_FREQUENCY + snd_frac;
+
+	snd_frac = n % CPU_CLK_FREQ;
+	n /= CPU_CLK_FREQ;
+	if (n > (u64)len) n = len;
+	snd_cycles = total_cycles;
+	if (n) {
+		update(buf, 0, n, total_cycles);
+		speech_mix(buf, n, SAMPLE_FREQUENCY, total_cycles);
+	}
+	return n;
+}
+
+
+
+static u64 vdp_last_access = 0; // cpu cycle of the last VRAM access
+static u16 vdp_overrun_pc = 0;
+
+// Report VRAM accesses that come faster than the VDP gives the CPU
+// access slots.  Real hardware would drop or corrupt these.
+static void vdp_check_timing(void)
+{
+	u64 now = get_total_cpu_cycles();
+	u64 gap = now - vdp_last_access;
+
+	vdp_last_access = now;
+	if (gap < (u64)vdp_access_cycles() && get_pc() != vdp_overrun_pc) {
+		vdp_overrun_pc = get_pc();
+		fprintf(stderr, "VDP overrun at PC=%04X: %d cycles since last access on line %d\n",
+			vdp_overrun_pc, (int)gap, vdp.y);
+	}
+}
 
+#define vdp_access() do { if (cfg.vdp_timing) vdp_check_timing(); } while (0)
+#define vdp_record(kind, addr, value) do { \
+	if (cfg.vdp_timeline) vdp_timeline_record(kind, addr, value); } while (0)
 
 static u16 vdp_8800_r(u16 address)
 {
@@ -467,11 +625,16 @@ static u16 vdp_8800_r(u16 address)
 	vdp.latch = 0;
 	if (address == 0x8800) {
 		// 8800   VDP RAM read data register
+		vdp_access();
+		vdp_record(TL_VRAM_R, vdp.a, vdp.buf);
 		undo_push(UNDO_VDPA, vdp.a);
+		undo_push(UNDO_VDPD, vdp.buf);
 		return vdp_read_data() << 8;
 	} else if (address == 0x8802) {
 		// 8802   VDP RAM read status register
-		return vdp_read_status() << 8;
+		u8 value = vdp_read_status();
+		vdp_record(TL_STATUS_R, 0, value);
+		return value << 8;
 	}
 	debug_log("unhandled RAM read %04X at PC=%04X\n", address, get_pc());
 	return 0;
@@ -521,15 +684,25 @@ static void vdp_8c00_w(u16 address, u16 value)
 	if (address == 0x8C00) {
 		// 8C00   VDP RAM write data register
 		//debug_log("VDP write %04X = %02X\n", vdp.a, value >> 8);
+		vdp_access();
+		vdp_record(TL_VRAM_W, vdp.a, value >> 8);
 		undo_push(UNDO_VDPA, vdp.a);
 		undo_push(UNDO_VDPL, vdp.latch);
+		undo_push(UNDO_VDPD, vdp.buf);
 		undo_push(UNDO_VDPRAM, (vdp.a << 8) | vdp.ram[vdp.a]);
 		vdp_write_data(value >> 8);
 		return;
 	} else if (address == 0x8C02) {
 		// 8C02   VDP RAM write address register
+		if (vdp.latch && (value & 0xc000) == 0) {
+			vdp_access(); // read setup prefetches from VRAM
+			vdp_record(TL_VRAM_R, (value & 0x3f00) | (vdp.a & 0xff), 0);
+		} else if (vdp.latch && (value & 0x8000)) {
+			vdp_record(TL_REG_W, (value >> 8) & 0x7f, vdp.a & 0xff);
+		}
 		undo_push(UNDO_VDPA, vdp.a);
 		undo_push(UNDO_VDPL, vdp.latch);
+		undo_push(UNDO_VDPD, vdp.buf);
 		vdp_write_addr(value >> 8);
 		return;
 	}
@@ -539,21 +712,20 @@ static void vdp_8c00_w(u16 address, u16 value)
 static u16 speech_9000_r(u16 address)
 {
 	if (address == 0x9000) {
-		// speech
+		// speech read data/status
 		add_cyc(54);
-		// TODO
-		return 0;
+		return speech_read() << 8;
 	}
 	add_cyc(6); // 2 cycles for memory access + 4 for multiplexer
 	return 0;
 }
 
-static void speech_9000_w(u16 address, u16 value)
+static void speech_9400_w(u16 address, u16 value)
 {
-	if (address == 0x9000) {
-		// speech
+	if (address == 0x9400) {
+		// speech write data/command
 		add_cyc(54);
-		// TODO
+		speech_write(value >> 8);
 		return;
 	}
 	add_cyc(6); // 2 cycles for memory access + 4 for multiplexer
@@ -684,6 +856,15 @@ static void grom_9c00_w(u16 address, u16 value)
 
 			undo_push(UNDO_GD, grom_last);
 			grom_read();
+			if (fp_gpl_active) {
+				int cost = fp_gpl(ga);
+
+				if (cost >= 0) {
+					// done natively, return at once
+					add_cyc(cost);
+					grom_last = 0x00; // GPL RTN
+				}
+			}
 			grom_address_increment();
 
 			//printf("%04X GROM write address %04X %02X\n", get_pc(), ga, value>>8);
@@ -721,20 +902,13 @@ static void rom_w(u16 address, u16 value)
 }
 
 /****************************************
- * 4000-5FFF  DSR ROM (paged by CRU?)   *
+ * 4000-5FFF  DSR ROM (paged by CRU)    *
  ****************************************/
 
-static u16 dsr_rom_r(u16 address)
-{
-	add_cyc(6); // 2 cycles for memory access + 4 for multiplexer
-	// TODO each DSR peripheral may do different things based on CRU
-	return 0;
-}
-
 static void dsr_rom_w(u16 address, u16 value)
 {
 	add_cyc(6); // 2 cycles for memory access + 4 for multiplexer
-	// TODO each DSR peripheral may do different things based on CRU
+	// rom not writable
 }
 
 
@@ -755,7 +929,7 @@ static void set_cart_bank(u16 bank)
 		cart_bank = bank & cart_bank_mask;
 		u16 *base = cart_rom + cart_bank * 4096/*words per 8KB bank*/;
 
-		change_mapping(0x6000 + offset, 0x1000, base + offset);
+		change_mapping(0x6000 + offset, 0x1000, base + offset/2);
 	} else {
 		// 8K banking
 		if (bank > cart_bank_mask && once) {
@@ -806,6 +980,179 @@ static void zero_w(u16 address, u16 value)
 	return;
 }
 
+// Page in a peripheral card's 8K DSR ROM at 4000, or nothing if NULL
+void dsr_select(u16 *rom)
+{
+	if (rom)
+		set_mapping(0x4000, 0x2000, map_r, dsr_rom_w, rom);
+	else
+		set_mapping(0x4000, 0x2000, zero_r, zero_w, NULL);
+}
+
+
+/****************************************
+ * Persistent cartridge RAM and SAMS    *
+ ****************************************/
+
+// With BULWIP_PERSIST=dir, cartridge RAM and SAMS memory are MAP_SHARED
+// mappings of files in dir named by a hash of the cartridge, so they keep
+// their contents across runs without a save step.  The kernel writes dirty
+// pages back when it likes, and instances running the same cartridge share
+// the pages (and each other's writes).  Snapshots don't include cartridge
+// RAM, but they do include SAMS memory, so loading a state or undoing a
+// write first moves SAMS memory to a private copy (see persist_detach).
+
+#ifdef ENABLE_PERSIST
+static char *persist_dir = NULL;
+static u64 persist_key = 0; // of the cartridge ROM and GROM images
+static u16 *persist_cart = NULL; // cart_rom, when mapped
+static u64 persist_cart_key = 0; // of its image
+static int persist_sams = 0; // machine.ram is mapped (1) or a private copy of the file (2)
+
+void persist_init(const char *dir)
+{
+	free(persist_dir);
+	persist_dir = dir && *dir ? strdup(dir) : NULL;
+}
+
+// FNV-1a, continuing from hash
+static u64 persist_hash(u64 hash, const void *data, unsigned int size)
+{
+	const u8 *p = data;
+
+	while (size--)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+	return hash;
+}
+
+// Map size bytes of the file for key with extension ext, at addr if not
+// NULL.  A new (or wrong sized) file starts as a copy of init.
+// Returns NULL on failure.
+static void* persist_map(u64 key, const char *ext, void *addr,
+	unsigned int size, const void *init)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *p;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%016llx.%s", persist_dir, key, ext);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1 || fstat(fd, &st) != 0)
+		goto fail;
+	if (st.st_size != size) {
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 ||
+		    pwrite(fd, init, size, 0) != size)
+			goto fail;
+		printf("Created %s\n", path);
+	}
+	p = mmap(addr, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | (addr ? MAP_FIXED : 0), fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	close(fd);
+	return p;
+fail:
+	perror(path);
+	if (fd != -1)
+		close(fd);
+	return NULL;
+}
+
+// Called before a snapshot or undo overwrites machine.ram.  The SAMS file
+// keeps what the program last wrote, and this run carries on in a private
+// copy until the cartridge changes.
+static void persist_detach(void)
+{
+	u16 *saved;
+
+	if (persist_sams != 1)
+		return;
+	saved = malloc(RAM_MAX);
+	memcpy(saved, ram, RAM_MAX);
+	mmap(ram, RAM_MAX, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	memcpy(ram, saved, RAM_MAX);
+	free(saved);
+	persist_sams = 2;
+	printf("SAMS memory detached from its file\n");
+}
+
+// Switch a RAM mode cartridge image to its file.  ROM halves of the banks
+// always come from the image, RAM halves from the file.
+static u16* persist_cart_map(u16 *image, unsigned int size)
+{
+	u16 *p;
+	unsigned int i;
+
+	if (!persist_dir)
+		return NULL;
+	persist_cart_key = persist_hash(0xcbf29ce484222325ULL, image, size);
+	p = persist_map(persist_cart_key, "ram", NULL, size, image);
+	if (!p)
+		return NULL;
+	for (i = 0; i < size / 2; i += 4096)
+		if (memcmp(p + i, image + i, 4096) != 0)
+			memcpy(p + i, image + i, 4096);
+	persist_cart = p;
+	return p;
+}
+
+static void persist_cart_unmap(void)
+{
+	if (persist_cart && persist_cart == cart_rom) {
+		munmap(cart_rom, cart_rom_size);
+		cart_rom = NULL;
+	}
+	persist_cart = NULL;
+}
+
+// Switch SAMS memory to its file, keeping the 32K in use
+static int persist_sams_map(void)
+{
+	u16 *saved;
+
+	if (!persist_dir || persist_sams)
+		return persist_sams;
+	saved = malloc(0x10000);
+	memcpy(saved, ram, 0x10000);
+	if (persist_map(persist_key, "sams", ram, RAM_MAX, ram) != ram) {
+		free(saved);
+		return 0;
+	}
+	memcpy(ram + 0x2000/2, saved + 0x2000/2, 0x2000);
+	memcpy(ram + 0xa000/2, saved + 0xa000/2, 0x6000);
+	free(saved);
+	persist_sams = 1;
+	return 1;
+}
+
+// Call after loading a cartridge.  A different one gets fresh memory.
+static void persist_cart_loaded(void)
+{
+	u64 key = persist_cart ? persist_cart_key :
+		persist_hash(0xcbf29ce484222325ULL, cart_rom, cart_rom_size);
+
+	key = persist_hash(key, cart_grom, cart_grom_size);
+	if (persist_sams && key != persist_key) {
+		mmap(ram, RAM_MAX, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		persist_sams = 0;
+		ram_size = 32 * 1024;
+		sams_transparent = 1;
+		change_mapping(0x2000, 0x2000, ram);
+		change_mapping(0xa000, 0x6000, ram + 0x2000/2);
+	}
+	persist_key = key;
+}
+#else
+void persist_init(const char *dir) { }
+#define persist_cart_map(image, size) NULL
+#define persist_cart_unmap() do { } while (0)
+#define persist_sams_map() 0
+#define persist_cart_loaded() do { } while (0)
+#endif
+
 
 // SAMS expansion, be sure to read
 // https://www.unige.ch/medecine/nouspikel/ti99/superams.htm
@@ -829,8 +1176,6 @@ static void zero_w(u16 address, u16 value)
 #define SAMS_PAGE(n) ((sams_bank[n]>>8)|((sams_bank[n]&0xf)<<8))
 #endif
 
-
-static int sams_transparent = 1;
 static void sams_map(int n)
 {
 	unsigned int word_offset = SAMS_PAGE(n) * SAMS_PAGE_SIZE / 2;
@@ -867,14 +1212,15 @@ static void sams_init(void)
 
 	// increase to 64K so that transparent mode can work
 	ram_size = 0x10000;
-	ram = my_realloc(ram, ram_size);
 
 	// move the 32K data to keep the same layout in 64K
 	memmove(ram+0xa000/2, ram+0x2000/2, 0x6000);
 	memmove(ram+0x2000/2, ram+0x0000/2, 0x2000);
-	// clear the rest: >0000->1fff, >4000->9ffff
-	memset(ram+0x0000/2, 0, 0x2000);
-	memset(ram+0x4000/2, 0, 0x6000);
+	if (!persist_sams_map()) {
+		// clear the rest: >0000->1fff, >4000->9ffff
+		memset(ram+0x0000/2, 0, 0x2000);
+		memset(ram+0x4000/2, 0, 0x6000);
+	}
 	sams_mode(!sams_transparent); // update mappings
 }
 
@@ -894,12 +1240,8 @@ static void sams_4000_w(u16 address, u16 value)
 		unsigned int page = SAMS_PAGE(n);
 		unsigned int page_end = (page+1) * SAMS_PAGE_SIZE;
 
-		if (page_end > ram_size) {
-			ram_size = page_end;
-			ram = my_realloc(ram, ram_size);
-			//printf("RAM increased to %d bytes %p\n", ram_size, ram);
-			sams_mode(1); // reload register mappings
-		}
+		if (page_end > ram_size)
+			ram_size = page_end; // snapshots include up to here
 
 		//printf("SAMS map >%04X, page >%02X\n", n * SAMS_PAGE_SIZE, page);
 		sams_map(n);
@@ -923,10 +1265,15 @@ static u16 sams_4000_r(u16 address)
  * Initialize memory function table     *
  ****************************************/
 
+// Rebuilds the whole memory map, so it can be called again after a failed start
 static void mem_init(void)
 {
 	ram_size = 32 * 1024; // 32K 
-	ram = malloc(ram_size);
+	sams_transparent = 1;
+	memcpy(sams_bank, sams_bank_default, sizeof(sams_bank));
+#ifdef MADV_HUGEPAGE
+	madvise(&machine, sizeof(machine), MADV_HUGEPAGE);
+#endif
 
 	// system ROM 0000-1fff
 	set_mapping(0x0000, 0x2000, rom_r, rom_w, NULL);
@@ -945,8 +1292,8 @@ static void mem_init(void)
 	set_mapping_safe(0x8400, 0x400, sound_8400_r, zero_r, sound_8400_w, NULL);
 	set_mapping_safe(0x8800, 0x400, vdp_8800_r, vdp_8800_safe_r, vdp_8800_w, NULL);
 	set_mapping_safe(0x8c00, 0x400, vdp_8c00_r, zero_r, vdp_8c00_w, NULL);
-	set_mapping_safe(0x9000, 0x400, speech_9000_r, zero_r, speech_9000_w, NULL);
-	set_mapping(0x9400, 0x400, zero_r, zero_w, NULL);
+	set_mapping_safe(0x9000, 0x400, speech_9000_r, zero_r, zero_w, NULL);
+	set_mapping(0x9400, 0x400, zero_r, speech_9400_w, NULL);
 	set_mapping_safe(0x9800, 0x400, grom_9800_r, safe_grom_9800_r, zero_w, NULL);
 	set_mapping(0x9c00, 0x400, zero_r, grom_9c00_w, NULL);
 
@@ -967,11 +1314,29 @@ void set_key(int key, int val)
 	int row = (key >> 3) & 7, col = key & 7, mask = val << col;
 	keyboard[row] = (keyboard[row] & ~(1 << col)) | mask;
 	//alpha_lock = !!(key & TI_ALPHALOCK); // FIXME
+	keyboard_update();
 }
 
 void reset_ti_keys(void)
 {
 	memset(&keyboard, 0, sizeof(keyboard)); // clear keys
+	keyboard_update();
+}
+
+// Precompute what the 9901 reads on CRU 3-10 for every keyboard_row value,
+// so keyboard scanning is a single lookup
+static void keyboard_update(void)
+{
+	// See: https://forums.atariage.com/topic/365610-keyboardjoystick-conflict/
+	// Joysticks are disabled by keys on the same lines
+	u8 rows = keyboard[0] | keyboard[1] | keyboard[2] |
+		  keyboard[3] | keyboard[4] | keyboard[5];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		keyboard_out[i] = ~(i >= 6 ? keyboard[i] & ~rows : keyboard[i]);
+	// CRU 21 is set ALPHA-LOCK, read on CRU 7
+	memset(keyboard_out + 8, 0xff ^ (alpha_lock << 4), 8);
 }
 
 int ti_key_pressed(void)
@@ -1085,107 +1450,165 @@ int char2key(char ch)
  * CRU read/write                       *
  ****************************************/
 
-static u32 sampled_timer_value = 0;
+// CRU bit address space is 4K bits, dispatched in pages of 32 bits.
+// Handlers take the absolute starting bit and a count of up to 16 bits,
+// and never see a transfer that crosses a page.
+#define CRU_SHIFT 5
+#define CRU_PAGE_SIZE (1 << CRU_SHIFT)
+#define CRU_PAGES (0x1000 >> CRU_SHIFT)
+
+static u16 cru_none_r(u16 bit, int count) { return 0xffff; } // inputs float high
+static void cru_none_w(u16 bit, int count, u16 value) { }
+
+static u16 (*cru_read_func[CRU_PAGES])(u16, int);
+static void (*cru_write_func[CRU_PAGES])(u16, int, u16);
 
-u8 cru_r(u16 bit)
+void set_cru_mapping(u16 base, int count,
+	u16 (*read)(u16, int),
+	void (*write)(u16, int, u16))
 {
+	int i;
+	for (i = base >> CRU_SHIFT; i < (base + count + CRU_PAGE_SIZE - 1) >> CRU_SHIFT; i++) {
+		cru_read_func[i] = read ?: cru_none_r;
+		cru_write_func[i] = write ?: cru_none_w;
+	}
+}
 
-	if (timer_mode && bit >= 1 && bit <= 14) {
+// Read count (1-16) bits starting at bit, first bit in the LSB
+u16 cru_read(u16 bit, int count)
+{
+	u16 value = 0;
+	int shift = 0;
+	while (count > 0) {
+		int n = CRU_PAGE_SIZE - (bit & (CRU_PAGE_SIZE-1));
+		u16 (*read)(u16, int);
+		if (n > count) n = count;
+		bit &= 0xfff;
+		read = cru_read_func[bit >> CRU_SHIFT] ?: cru_none_r;
+		value |= (read(bit, n) & ((1 << n) - 1)) << shift;
+		shift += n;
+		bit += n;
+		count -= n;
+	}
+	return value;
+}
 
-		return (sampled_timer_value >> (14-bit)) & 1;
+// Write count (1-16) bits starting at bit, first bit in the LSB
+void cru_write(u16 bit, int count, u16 value)
+{
+	while (count > 0) {
+		int n = CRU_PAGE_SIZE - (bit & (CRU_PAGE_SIZE-1));
+		void (*write)(u16, int, u16);
+		if (n > count) n = count;
+		bit &= 0xfff;
+		write = cru_write_func[bit >> CRU_SHIFT] ?: cru_none_w;
+		write(bit, n, value & ((1 << n) - 1));
+		value >>= n;
+		bit += n;
+		count -= n;
 	}
-	switch (bit) {
-	case 0: return timer_mode;
-	case 2: //debug_log("VDPST=%02X\n", vdp.reg[VDP_ST]);
-		return !(vdp.reg[VDP_ST] & 0x80);
-		// row 0 1 2 3 4 5 6     7
-	case 3: //     = . , M N / fire1 fire2
-	case 4: // space L K J H ; left  left
-	case 5: // enter O I U Y P right right
-	case 6: //       9 8 7 6 0 down  down
-	case 7: //  fctn 2 3 4 5 1 up    up
-	case 8: // shift S D F G A
-	case 9: //  ctrl W E R T Q
-	case 10://       X C V B Z
-		if (keyboard_row & 8) {
-			// CRU 21 is set ALPHA-LOCK
-			return bit == 7 ? 1^alpha_lock : 1;
-		}
-		if ((keyboard_row & 7) >= 6) {
-			// See: https://forums.atariage.com/topic/365610-keyboardjoystick-conflict/
-			// Joysticks are disabled by keys on the same lines
-			u8 rows = keyboard[0] | keyboard[1] | keyboard[2] |
-				  keyboard[3] | keyboard[4] | keyboard[5];
-			if ((rows >> (bit-3)) & 1)
-				return 1; // not pressed
-		}
+}
+
 
-		return ((keyboard[keyboard_row] >> (bit-3)) & 1)^1; // active low
+static u32 sampled_timer_value = 0;
 
-	default: fprintf(stderr, "TB %d not implemented\n", bit); break;
+// TMS9901 at CRU 0-31
+static u16 tms9901_r(u16 bit, int count)
+{
+	u32 in;
+
+	if (timer_mode) {
+		int i;
+		in = 0xffff8001; // bit 0 is timer mode
+		for (i = 1; i <= 14; i++)
+			in |= ((sampled_timer_value >> (14-i)) & 1) << i;
+	} else {
+		in = 0xfffff800; // unconnected inputs read high
+		// CRU 1 is peripheral card interrupt, active low
+		in |= !ext_int << 1;
+		// CRU 2 is VDP interrupt, active low
+		in |= !(vdp.reg[VDP_ST] & 0x80) << 2;
+		// row 0 1 2 3 4 5 6     7
+		// 3     = . , M N / fire1 fire2
+		// 4 space L K J H ; left  left
+		// 5 enter O I U Y P right right
+		// 6       9 8 7 6 0 down  down
+		// 7  fctn 2 3 4 5 1 up    up
+		// 8 shift S D F G A
+		// 9  ctrl W E R T Q
+		// 10      X C V B Z
+		in |= keyboard_out[keyboard_row] << 3;
 	}
-	return 1;
+	return in >> (bit & (CRU_PAGE_SIZE-1));
 }
 
-void cru_w(u16 bit, u8 value)
+static void tms9901_w(u16 bit, int count, u16 value)
 {
-	switch (bit) {
-	case 0: // 0=normal 1=timer
-		timer_mode = value & 1;
+	u32 mask = ((1 << count) - 1) << (bit & (CRU_PAGE_SIZE-1));
+	u32 out = (u32)value << (bit & (CRU_PAGE_SIZE-1));
+
+	if (mask & 1) { // 0=normal 1=timer
+		timer_mode = out & 1;
 		if (timer_mode) sampled_timer_value = get_total_cpu_cycles() >> 5;
-		debug_log("timer_mode=%d\n", timer_mode);
-		break;
-	case 1:
-	case 2:
-	case 3:
-	case 4:
-	case 5:
-	case 6:
-	case 7:
-	case 8:
-
-	case 12:
-	case 13:
-	case 14:
-	case 15:
-		// set interrupt mask for pins 1-15
-		tms9901_int_mask = (tms9901_int_mask & ~(1<<bit)) | ((value & 1)<<bit);
-		break;
-	case 21:
-		value ^= 1; // Set ALPHA-LOCK (invert it)
-		// fall thru
-	case 18: //keyboard_row = (keyboard_row & ~1) | (value & 1); break;
-	case 19: //keyboard_row = (keyboard_row & ~2) | ((value & 1) << 1); break;
-	case 20: //keyboard_row = (keyboard_row & ~4) | ((value & 1) << 2); break;
+	}
+	if (mask & 0xf1fe) {
+		// set interrupt mask for pins 1-8 and 12-15
+		tms9901_int_mask = (tms9901_int_mask & ~(mask & 0xf1fe)) | (out & mask & 0xf1fe);
+	}
+	if (mask & 0x3c0000) {
+		// keyboard row select on 18-20, ALPHA-LOCK on 21 (inverted)
+		u8 m = (mask >> 18) & 15;
 		undo_push(UNDO_KB, keyboard_row);
-		keyboard_row &= ~(1 << (bit-18));
-		keyboard_row |= (value & 1) << (bit-18);
-		break;
-
-	default:
-		//fprintf(stderr, "%s %d not implemented at pc=%x\n", value ? "SBO" : "SBZ", bit, get_pc());
-		break;
+		keyboard_row = (keyboard_row & ~m) | (((out >> 18) ^ 8) & m);
+	}
+}
 
-	case 0x1e00 >> 1:  // SAMS mapper access value: 0=enable 1=disable
-		value ^= 1;
-		printf("SAMS access %s\n", value ? "disabled" : "enabled");
-		set_mapping(0x4000, 0x1000,
-			value ? zero_r : sams_4000_r,
-			value ? zero_w : sams_4000_w,
-			NULL);
-		break;
-	case 0x1e02 >> 1:  // SAMS mapping mode 1=mapping 0=transparent
-		printf("SAMS mode %s\n", value ? "mapping" : "transparent");
-		if (value && ram_size < 0x10000)
-			sams_init();
-		sams_mode(value);
-		break;
-	case 0x1e04 >> 1:  // SAMS 4MB mode?
-		printf("SAMS 4MB? %d\n", value);
-		break;
+// SAMS card at CRU >1E00
+static void sams_cru_w(u16 bit, int count, u16 value)
+{
+	for (; count > 0; count--, bit++, value >>= 1) {
+		switch (bit) {
+		case 0x1e00 >> 1:  // SAMS mapper access value: 1=enable 0=disable
+			debug_log("SAMS access %s\n", value & 1 ? "enabled" : "disabled");
+			set_mapping(0x4000, 0x1000,
+				value & 1 ? sams_4000_r : zero_r,
+				value & 1 ? sams_4000_w : zero_w,
+				NULL);
+			break;
+		case 0x1e02 >> 1:  // SAMS mapping mode 1=mapping 0=transparent
+			debug_log("SAMS mode %s\n", value & 1 ? "mapping" : "transparent");
+			if ((value & 1) && ram_size < 0x10000)
+				sams_init();
+			sams_mode(value & 1);
+			break;
+		case 0x1e04 >> 1:  // SAMS 4MB mode?
+			debug_log("SAMS 4MB? %d\n", value & 1);
+			break;
+		}
 	}
 }
 
+static void cru_init(void)
+{
+	keyboard_update();
+	set_cru_mapping(0, 0x1000, NULL, NULL);
+	set_cru_mapping(0, 32, tms9901_r, tms9901_w);
+	set_cru_mapping(0x1300 >> 1, 0x60, rs232_cru_r, rs232_cru_w);
+	set_cru_mapping(0x1e00 >> 1, 0x80, NULL, sams_cru_w);
+	rs232_reset();
+}
+
+// Peripheral cards share INT1, level triggered
+static void card_interrupt(int level)
+{
+	if (level && (tms9901_int_mask & 2))
+		interrupt(1);
+	else if (!level && ext_int && !(vdp.reg[VDP_ST] & 0x80))
+		interrupt(-1); // withdrawn, unless the VDP's is pending
+	ext_int = level;
+}
+
+
 
 
 
@@ -1209,11 +1632,19 @@ void unhandled(u16 pc, u16 op)
 
 #ifndef USE_SDL
 
-static uint32_t frame_buffer[320*240];
+#ifdef LIBBULWIP
+#define FRAME_PITCH 640 // room for 80-column text mode
+#else
+#define FRAME_PITCH 320
+#endif
+static uint32_t frame_buffer[FRAME_PITCH*240];
+static int frame_width = 320;
 
 void vdp_lock_texture(int line, int len, void**pixels)
 {
-	*pixels = frame_buffer + line*320;
+	if (len > FRAME_PITCH) len = FRAME_PITCH;
+	frame_width = len;
+	*pixels = frame_buffer + line*FRAME_PITCH;
 }
 void vdp_unlock_texture(void)
 {
@@ -1228,6 +1659,7 @@ void vdp_done(void)
 {
 }
 
+#ifdef TEST
 char **test_argv = NULL;
 int test_argc = 0;
 
@@ -1265,6 +1697,12 @@ int vdp_update(void)
 	frames++;
 	return frames >= 600;
 }
+#else
+int vdp_update(void)
+{
+	return 0;
+}
+#endif
 
 #define unused __attribute__((unused))
 
@@ -1281,6 +1719,10 @@ void vdp_set_fps(unused int mfps /* fps*1000 */)
 {
 }
 
+void vdp_realtime(unused const char *spec)
+{
+}
+
 void mute(unused int en)
 {
 }
@@ -1291,7 +1733,25 @@ int debug_window(void)
 }
 #endif
 
+#ifdef LIBBULWIP
+// ui.c is not linked into the library
+struct config_struct cfg = {
+	.frame_rate = NTSC_FPS,
+};
 
+void load_listing(unused const char *filename, unused int bank)
+{
+}
+
+int main_menu(void)
+{
+	return 0;
+}
+
+void set_ui_key(unused int k)
+{
+}
+#endif
 
 
 
@@ -1312,12 +1772,12 @@ static int load_rom(char *filename, u16 **dest_ptr, unsigned int *size_ptr)
 	unsigned int i, size, buf_size = size_ptr ? *size_ptr : 0;
 
 #ifdef COMPILED_ROMS
-	for (i = 0; i < ARRAY_SIZE(comp_roms); i++) {
-		if (strcmp(comp_roms[i].filename, filename) == 0) {
-			*dest_ptr = (u16*) comp_roms[i].data;
-			*size_ptr = comp_roms[i].len;
-			return 0;
-		}
+	const struct bundle_rom *c = find_compiled(filename);
+	if (c) {
+		if (f) fclose(f);
+		*dest_ptr = (u16*) c->data;
+		*size_ptr = c->len;
+		return 0;
 	}
 #endif
 	if (!f && argv0_dir_name) {
@@ -1347,6 +1807,7 @@ static int load_rom(char *filename, u16 **dest_ptr, unsigned int *size_ptr)
 		buf_size = (size + 0x1fff) & ~0x1fff; // round up to nearest 8k
 		printf("size=%d buf_size=%d\n", size, buf_size);
 		dest = my_realloc(dest, buf_size);
+		memset((u8*)dest + size, 0, buf_size - size);
 		*dest_ptr = dest;
 		if (size_ptr) *size_ptr = buf_size;
 	}
@@ -1370,13 +1831,11 @@ static int load_grom(char *filename, u8 **dest_ptr, unsigned int *size_ptr)
 	unsigned int size = size_ptr ? *size_ptr : 0;
 
 #ifdef COMPILED_ROMS
-	unsigned int i;
-	for (i = 0; i < ARRAY_SIZE(comp_roms); i++) {
-		if (strcmp(comp_roms[i].filename, filename) == 0) {
-			*dest_ptr = (u8*) comp_roms[i].data;
-			*size_ptr = comp_roms[i].len;
-			return 0;
-		}
+	const struct bundle_rom *c = find_compiled(filename);
+	if (c) {
+		*dest_ptr = (u8*) c->data;
+		*size_ptr = c->len;
+		return 0;
 	}
 #endif
 	FILE *f = fopen(filename, "rb");
@@ -1534,10 +1993,30 @@ static struct {
 } *breakpoint;
 static int breakpoint_count = 0;
 static int breakpoint_skip_address = -1; // for resuming after a breakpoint, or single-stepping
+int watch_hit = -1;
+
+// breakpoints only stop the emulator when something will notice
+static int debugger_attached(void)
+{
+#ifdef ENABLE_GDB
+	if (gdb_attached())
+		return 1;
+#endif
+	return debug_en;
+}
+
+#ifdef ENABLE_DEBUGGER
+static int step_line = -1; // DEBUG_SCANLINE_STEP stops after this line, -1 the next
+static u64 step_cycles = 0; // DEBUG_CYCLE_STEP stops at this total cycle count
+#endif
 
 void set_break(int debug_state)
 {
 	debug_break = debug_state;
+#ifdef ENABLE_DEBUGGER
+	if (debug_state != DEBUG_SCANLINE_STEP)
+		step_line = -1; // Shift-F2 is the next line
+#endif
 	if (debug_break != DEBUG_RUN) {
 		// clear the keyboard buffer
 		set_ui_key(0);
@@ -1558,7 +2037,7 @@ int breakpoint_read(u16 address) // called from brk_r() before read
 		breakpoint_skip_address = -1;
 	}
 	// don't break if single-stepping!
-	if (debug_break >= DEBUG_SINGLE_STEP) {
+	if (debug_break == DEBUG_SINGLE_STEP) {
 		return 0;
 	}
 
@@ -1570,15 +2049,15 @@ int breakpoint_read(u16 address) // called from brk_r() before read
 		if (address >= 0x6000 && address < 0x8000 &&
 		    breakpoint[i].bank != -1 && breakpoint[i].bank != cart_bank)
 			continue; // wrong bank
-		if (!breakpoint[i].enabled)
-			continue; // not enabled
+		if (!breakpoint[i].enabled || breakpoint[i].enabled == BREAKPOINT_WATCH)
+			continue; // not enabled, or only for writes
 
 		if (breakpoint[i].enabled == BREAKPOINT_PASTE) {
 			paste_char();
 			return 0;
 		}
 
-		if (debug_en == 0)
+		if (!debugger_attached())
 			continue; // debugger not open, but could paste instead
 
 		// breakpoint hit
@@ -1596,8 +2075,22 @@ int breakpoint_read(u16 address) // called from brk_r() before read
 
 int breakpoint_write(u16 address) // called from brk_w() after write
 {
-	// TODO scan list of breakpoints to see if one is hit
+	int i;
+
+	if (debug_break == DEBUG_SINGLE_STEP || !debugger_attached())
+		return 0;
+	for (i = 0; i < breakpoint_count; i++) {
+		if (breakpoint[i].enabled != BREAKPOINT_WATCH ||
+		    (breakpoint[i].address ^ address) & ~1)
+			continue;
+		if (address >= 0x6000 && address < 0x8000 &&
+		    breakpoint[i].bank != -1 && breakpoint[i].bank != cart_bank)
+			continue; // wrong bank
 
+		set_break(DEBUG_STOP);
+		watch_hit = address & ~1;
+		return 1;
+	}
 	return 0;
 }
 
@@ -1614,13 +2107,26 @@ int breakpoint_index(u16 address, int bank)
 	return -1;
 }
 
+// point the memory pages with enabled breakpoints at brk_r/brk_w
+static void map_breakpoints(void)
+{
+	int i;
+
+	cpu_reset_breakpoints();
+	for (i = 0; i < breakpoint_count; i++) {
+		if (breakpoint[i].enabled)
+			cpu_set_breakpoint(breakpoint[i].address, 2/*bytes*/);
+	}
+}
+
 void remove_breakpoint(u16 address, int bank)
 {
 	int i = breakpoint_index(address, bank);
 	if (i == -1) return;
-	memmove(&breakpoint[i], &breakpoint[i+1], sizeof(*breakpoint)*(breakpoint_count-i));
+	memmove(&breakpoint[i], &breakpoint[i+1], sizeof(*breakpoint)*(breakpoint_count-i-1));
 	breakpoint_count--;
 	// TODO could shrink breakpoint array
+	map_breakpoints();
 }
 
 // set or toggle breakpoint, enable=-1 to toggle, otherwise set to enable
@@ -1638,11 +2144,7 @@ void set_breakpoint(u16 address, int bank, int enable)
 		breakpoint[i].enabled = enable == BREAKPOINT_TOGGLE ? !breakpoint[i].enabled : enable;
 	}
 	//printf("i=%d address=%x bank=%d enabled=%d\n", i, breakpoint[i].address, breakpoint[i].bank, breakpoint[i].enabled);
-	cpu_reset_breakpoints();
-	for (i = 0; i < breakpoint_count; i++) {
-		if (breakpoint[i].enabled)
-			cpu_set_breakpoint(breakpoint[i].address, 2/*bytes*/);
-	}
+	map_breakpoints();
 }
 
 int enum_breakpoint(int index, int *address, int *bank, int *enabled)
@@ -1684,6 +2186,7 @@ int get_cart_bank(void)
 void reset(void)
 {
 	cpu_reset();
+	rs232_reset();
 
 	{
 		static int once = 1;
@@ -1711,6 +2214,7 @@ void reset(void)
 	if (cartridge_name) {
 		unsigned int len = strlen(cartridge_name);
 
+		persist_cart_unmap();
 		my_free(cart_rom);
 		cart_rom = NULL;
 		cart_rom_size = 0;
@@ -1733,10 +2237,10 @@ void reset(void)
 
 				// attempt loading D rom
 				if (load_rom(name, &rom2, &rom2_size) == 0) {
+					cart_rom = rom_realloc(cart_rom, cart_rom_size, 16384);
 					cart_rom_size = 16384;
-					cart_rom = realloc(cart_rom, cart_rom_size);
 					memcpy(cart_rom + 8192/2, rom2, rom2_size < 8192 ? rom2_size : 8192);
-					free(rom2);
+					my_free(rom2);
 				}
 				free(name);
 			}
@@ -1755,6 +2259,15 @@ void reset(void)
 			cart_gram_mode = cart_rom[3] == 'G' || cart_rom[3] == 'X';
 
 			if (cart_ram_mode) {
+				u16 *p = persist_cart_map(cart_rom, cart_rom_size);
+
+				if (p) {
+					my_free(cart_rom);
+					cart_rom = p;
+				} else {
+					// a built in image is copied, so RAM starts fresh every reset
+					cart_rom = rom_realloc(cart_rom, cart_rom_size, cart_rom_size);
+				}
 				set_mapping(0x6000, 0x1000, map_r, cart_rom_w, NULL);
 				set_mapping(0x7000, 0x1000, map_r, map_w, NULL);
 				set_cart_bank(0); // init ROM bank
@@ -1787,6 +2300,7 @@ void reset(void)
 			free(name);
 			//printf("grom=%p size=%u\n", cart_grom, cart_grom_size);
 		}
+		persist_cart_loaded();
 #ifndef TEST
 		// optionally load listing
 		{
@@ -1830,7 +2344,7 @@ int vdp_update_or_menu(void)
 
 #ifdef ENABLE_DEBUGGER
 
-int debug_pattern_type = 0; // 0-2=pattern tables 3=sprite table
+int debug_pattern_type = 0; // 0-2=pattern tables 3=sprite table 4=VDP timeline
 void update_debug_window(void)
 {
 	char reg[53*30] = { [0 ... 53*30-1]=32};
@@ -1879,7 +2393,7 @@ void update_debug_window(void)
 		" VDPST: %02X  R13: %04X\n"
 		"  Y: %-3d    R14: %04X\n"
 		" BANK: %-4d R15: %04X\n"
-		"            \n"
+		" CYC: %-3d\n"
 		" KB: ROW: %d\n"
 		"%02X %02X %02X %02X %02X %02X %02X %02X\n\n",
 		pc,         safe_r(wp),
@@ -1898,6 +2412,7 @@ void update_debug_window(void)
 		vdp.reg[VDP_ST], safe_r(wp+26),
 		vdp.y,	    safe_r(wp+28),
 		cart_bank,  safe_r(wp+30),
+		CYCLES_PER_LINE + add_cyc(0), // into the line
 		keyboard_row,
 		keyboard[0], keyboard[1], keyboard[2], keyboard[3],
 		keyboard[4], keyboard[5], keyboard[6], keyboard[7]);
@@ -1913,8 +2428,11 @@ void update_debug_window(void)
 	reg[n] = 0;
 	vdp_text_window(reg, 53,30, 322,0, -1);
 
-	// draw char patterns 
-	{
+	if (debug_pattern_type == 4) {
+		vdp_timeline_draw(320+32, 16*8);
+		vdp_text_window("T", 1,1, 322+3*6,16*8, -1);
+	} else { // draw char patterns
+		vdp_text_clear(320+32, 16*8, 48, 9, 0); // any timeline
 		u8 scr[32*24];
 #ifdef ENABLE_F18A
 		u8 save_r27 = vdp.reg[27], save_r28 = vdp.reg[28];
@@ -1971,7 +2489,7 @@ void update_debug_window(void)
 #ifdef ENABLE_UNDO
 static void emu_check_undo(void)
 {
-	struct state s0, s1, s2;
+	static struct state s0, s1, s2;
 
 	save_state(&s0);
 	do {
@@ -1981,7 +2499,7 @@ static void emu_check_undo(void)
 		save_state(&s1);
 		undo_pop();
 		save_state(&s2);
-		if (memcmp(&s0, &s2, sizeof(struct state)) != 0) {
+		if (memcmp(&s0, &s2, STATE_SIZE(s0.ram_size)) != 0) {
 			FILE *f;
 			printf("undo failed at pc=%04x\n", save_pc);
 			f = fopen("bulwip_undo0.txt", "w");
@@ -1996,7 +2514,7 @@ static void emu_check_undo(void)
 		}
 		single_step(); // redo
 		save_state(&s0);
-		if (memcmp(&s0, &s1, sizeof(struct state)) != 0) {
+		if (memcmp(&s0, &s1, STATE_SIZE(s0.ram_size)) != 0) {
 			FILE *f;
 			printf("redo failed at pc=%04x\n", save_pc);
 			f = fopen("bulwip_undo0.txt", "w");
@@ -2016,8 +2534,327 @@ static void emu_check_undo(void)
 
 
 
+/****************************************
+ * Console ROMs and frame loop          *
+ ****************************************/
+
+// Load console ROM, GROM and the optional speech ROM
+// Returns 0 on success, -1 if ROM or GROM is missing
+static int load_console_roms(void)
+{
+	rom_size = 8192;
+	load_rom("994arom.bin", &rom, &rom_size);
+	grom_size = 24576;
+	load_grom("994agrom.bin", &grom, &grom_size);
+	speech_rom_size = 0x8000;
+	if (load_grom("spchrom.bin", &speech_rom, &speech_rom_size) == 0)
+		speech_init(speech_rom, speech_rom_size);
+	if (load_rom("rs232.bin", &rs232_rom, &rs232_rom_size) == 0)
+		rs232_set_rom(rs232_rom);
+#ifndef TEST
+	load_listing("994arom.lst", -1);
+#endif
+	if (!rom || !grom) {
+		fprintf(stderr, "Failed to load ROM/GROM files: %s %s\n",
+			rom ? "" : "994arom.bin",
+			grom ? "" : "994agrom.bin");
+		return -1;
+	}
+
+	// Give GROM char patterns for debugger
+	vdp_text_pat(grom + 0x06B4 - 32*7);
+	rom = rom_writable(rom, rom_size); // for FP HLE
+	fp_hle_init(rom, rom_size, grom, grom_size);
+	return 0;
+}
+
+// Render the next scanline and give the CPU its cycles
+static void run_line(void)
+{
+	const int lines_per_frame = 262; // NTSC=262 PAL=313
+
+#ifdef ENABLE_F18A
+	gpu();
+#endif
+
+	// render one scanline
+	if (vdp.y < 240) {
+		undo_push(UNDO_VDPST, vdp.reg[VDP_ST]);
+		vdp_line(vdp.y, vdp.reg, vdp.ram);
+	} else if (vdp.y == 246) {
+		undo_push(UNDO_VDPST, vdp.reg[VDP_ST]);
+		vdp.reg[VDP_ST] |= 0x80;  // set F in VDP status
+		if (vdp.reg[1] & 0x20) // check IE
+			interrupt(1);  // VDP interrupt
+	}
+	undo_push(UNDO_VDPY, vdp.y);
+	if (++vdp.y == lines_per_frame) {
+		vdp.y = 0;
+	}
+	if (vdp.y == 0) // also when the u8 wraps
+		vdp_timeline_frame();
+
+	total_cycles_add_line();
+	speech_run(total_cycles);
+	card_interrupt(rs232_run(total_cycles));
+}
+
+// Run scanlines until the end of the frame, or the debugger stops.
+// Scanline and cycle steps carry on through frames until they are done.
+static void run_frame(void)
+{
+	do {
+		// unless stopped in the debugger mid-line, then finish that line
+		if (add_cyc(0) >= 0) {
+#ifdef ENABLE_DEBUGGER
+			int y = vdp.y;
+#endif
+			run_line();
+#ifdef ENABLE_DEBUGGER
+			if (debug_break == DEBUG_SCANLINE_STEP &&
+			    (step_line < 0 || step_line == y)) {
+				set_break(DEBUG_STOP);
+				break;
+			}
+#endif
+		}
+#ifdef ENABLE_DEBUGGER
+		if (debug_break == DEBUG_SINGLE_STEP) {
+			single_step();
+			set_break(DEBUG_STOP);
+			break;
+		}
+		if (debug_break == DEBUG_CYCLE_STEP) {
+			s64 left = step_cycles - get_total_cpu_cycles();
+
+			if (left <= 0) {
+				set_break(DEBUG_STOP);
+				break;
+			}
+			emu_cycles(left < CYCLES_PER_LINE ? left : CYCLES_PER_LINE);
+			continue;
+		}
+#endif
+		emu(); // emulate until cycle counter goes positive
+		//emu_check_undo();
+		// a breakpoint will change debug_break variable
+
+	} while (vdp.y != 0
+#ifdef ENABLE_DEBUGGER
+		&& (debug_break == DEBUG_RUN || debug_break >= DEBUG_FRAME_STEP)
+#endif
+		);
+}
+
+
+#ifdef ENABLE_DEBUGGER
+// Run one instruction, starting the next scanline first if the CPU is at
+// the end of one.  For the GDB stub, which must not wait for a frame.
+void debug_step(void)
+{
+	if (add_cyc(0) >= 0)
+		run_line();
+	set_break(DEBUG_SINGLE_STEP);
+	single_step();
+	set_break(DEBUG_STOP);
+}
+
+// Run until the VDP has done line (0-255, 246 sets the vblank interrupt),
+// or the next one if -1.  Breakpoints still stop it.
+void debug_run_line(int line)
+{
+	set_break(DEBUG_SCANLINE_STEP);
+	step_line = line;
+}
+
+// Run for at least cycles, to the end of the instruction that crosses them
+void debug_run_cycles(int cycles)
+{
+	step_cycles = get_total_cpu_cycles() + cycles;
+	set_break(DEBUG_CYCLE_STEP);
+}
+#endif
+
+
+/****************************************
+ * Library API, see bulwip.h            *
+ ****************************************/
+
+// Also what main() runs on.  With SDL the frontend draws, plays the sound
+// and reads the keys itself, so frames come back without pixels or audio.
+struct bulwip {
+	struct bulwip_frame frame;
+#ifndef USE_SDL
+	u8 audio[SAMPLE_FREQUENCY / 25]; // two 50Hz frames
+#endif
+};
+
+static struct bulwip *instance = NULL;
+
+struct bulwip *bulwip_create(const struct bulwip_config *config)
+{
+	static int once = 1;
+
+	if (instance)
+		return NULL;
+	if (config) {
+		cfg.unlimited_sprites = config->unlimited_sprites;
+		cfg.vdp_timing = config->vdp_timing;
+		cfg.fp_hle = config->fp_hle;
+		cfg.vdp_timeline = config->vdp_timeline;
+		cfg.gpu_idle_skip = config->gpu_idle_skip;
+		persist_init(config->persist_dir);
+	}
+	if (once) {
+		if (config && config->rom_dir)
+			argv0_dir_name = my_strdup(config->rom_dir);
+		mem_init();
+		cru_init();
+		if (load_console_roms() != 0) {
+			// leave nothing behind, the next call starts over
+			free(argv0_dir_name);
+			argv0_dir_name = NULL;
+			return NULL;
+		}
+		once = 0;
+	}
+	instance = calloc(1, sizeof(struct bulwip));
+	if (!instance)
+		return NULL;
+	instance->frame.height = 240;
+#ifndef USE_SDL
+	instance->frame.pixels = frame_buffer;
+	instance->frame.pitch = FRAME_PITCH;
+	instance->frame.audio = instance->audio;
+	instance->frame.audio_freq = SAMPLE_FREQUENCY;
+#endif
+	reset();
+#ifndef USE_SDL
+	snd_render(NULL, 0);
+#endif
+	return instance;
+}
+
+void bulwip_destroy(struct bulwip *b)
+{
+	if (!b || b != instance)
+		return;
+	free(instance);
+	instance = NULL;
+}
+
+int bulwip_load_cart(struct bulwip *b, const char *filename)
+{
+	if (!b) return -1;
+	set_cart_name((char*)filename);
+	reset();
+	return cart_rom || cart_grom ? 0 : -1;
+}
+
+int bulwip_load_basic(struct bulwip *b, const char *filename)
+{
+	if (!b) return -1;
+	return basic_load(filename) == 0 ? 0 : -1;
+}
+
+void bulwip_reset(struct bulwip *b)
+{
+	if (!b) return;
+	reset();
+}
+
+const struct bulwip_frame *bulwip_run_frame(struct bulwip *b)
+{
+	if (!b) return NULL;
+	run_frame();
+
+#ifndef USE_SDL
+	b->frame.width = frame_width;
+	b->frame.audio_len = snd_render(b->audio, sizeof(b->audio));
+#endif
+	return &b->frame;
+}
+
+long bulwip_run_cycles(struct bulwip *b, long cycles)
+{
+	long done = 0;
+
+	if (!b) return 0;
+	while (done < cycles) {
+		int start, bias = 0;
+
+		if (add_cyc(0) > 0)
+			run_line();
+		start = add_cyc(0);
+		// emu() returns when the counter goes positive, so to stop
+		// before the end of the line offset it, like single_step does
+		if (start + (cycles - done) < 0)
+			bias = -start - (cycles - done);
+		add_cyc(bias);
+		emu();
+		done += add_cyc(-bias) - start;
+	}
+	return done;
+}
+
+void bulwip_set_keys(struct bulwip *b, const unsigned char keys[8])
+{
+	if (!b) return;
+	memcpy(keyboard, keys, sizeof(keyboard));
+	keyboard_update();
+}
+
+size_t bulwip_save_state(struct bulwip *b, void *buf, size_t size)
+{
+	if (b && buf && size >= STATE_SIZE(ram_size))
+		save_state(buf);
+	return STATE_SIZE(ram_size);
+}
+
+int bulwip_load_state(struct bulwip *b, const void *buf, size_t size)
+{
+	const struct state *s = buf;
+
+	if (!b || !buf || size < STATE_SIZE(0) ||
+	    s->ram_size > RAM_MAX || size != STATE_SIZE(s->ram_size))
+		return -1;
+	load_state((struct state*)buf);
+	return 0;
+}
+
+int bulwip_dump_state(const void *buf, size_t size, const char *filename)
+{
+	const struct state *s = buf;
+	FILE *f;
+
+	if (!buf || size < STATE_SIZE(0) || size != STATE_SIZE(s->ram_size))
+		return -1;
+	f = fopen(filename, "w");
+	if (!f)
+		return -1;
+	print_state(f, (struct state*)buf);
+	fclose(f);
+	return 0;
+}
+
+int bulwip_save_vdp_timeline(struct bulwip *b, const char *filename)
+{
+	(void)b;
+	if (!cfg.vdp_timeline)
+		return -1;
+	return vdp_timeline_save(filename);
+}
+
+
+#ifndef LIBBULWIP
+
 int main(int argc, char *argv[])
 {
+	struct bulwip_config config = {};
+	const struct bulwip_frame *frame;
+	struct bulwip *b;
+	char *rom_dir = NULL;
+
 #ifdef LOG_DISASM
 	log = fopen("/tmp/bulwip.log","w");
 #endif
@@ -2026,42 +2863,46 @@ int main(int argc, char *argv[])
 	//if (!log) log = stderr;
 	//if (!log) log = fopen("NUL","w");
 
-	mem_init();
-
 	disasmf = log;
 
 	// Get app dir name for when loading roms
 	char *slash = strrchr(argv[0], '/');
 	if (slash) {
 		int len = slash - argv[0];
-		argv0_dir_name = malloc(len + 1);
-		memcpy(argv0_dir_name, argv[0], len);
-		argv0_dir_name[len] = 0;
-		//fprintf(stderr, "dir_name = %s\n", argv0_dir_name);
+		rom_dir = malloc(len + 1);
+		memcpy(rom_dir, argv[0], len);
+		rom_dir[len] = 0;
+		//fprintf(stderr, "dir_name = %s\n", rom_dir);
 	}
 
-	rom_size = 8192;
-	load_rom("994arom.bin", &rom, &rom_size);
-	grom_size = 24576;
-	load_grom("994agrom.bin", &grom, &grom_size);
-#ifndef TEST
-	load_listing("994arom.lst", -1);
+	//vdp_window_scale(4);
+	vdp_init();
+	rs232_init(getenv("BULWIP_RS232"));
+	vdp_realtime(getenv("BULWIP_RT"));
+#ifdef ENABLE_GDB
+	gdb_init(getenv("BULWIP_GDB"));
 #endif
-	if (!rom || !grom) {
-		fprintf(stderr, "Failed to load ROM/GROM files: %s %s\n",
-			rom ? "" : "994arom.bin",
-			grom ? "" : "994agrom.bin");
-		exit(0);
-	}
 
-	// Give GROM char patterns for debugger
-	vdp_text_pat(grom + 0x06B4 - 32*7);
+	// the settings ui.c starts with
+	config.rom_dir = rom_dir;
+	config.unlimited_sprites = cfg.unlimited_sprites;
+	config.vdp_timing = cfg.vdp_timing;
+	config.fp_hle = cfg.fp_hle;
+	config.vdp_timeline = cfg.vdp_timeline;
+	config.persist_dir = getenv("BULWIP_PERSIST");
+	config.gpu_idle_skip = cfg.gpu_idle_skip;
+	b = bulwip_create(&config);
+	free(rom_dir);
+	if (!b)
+		exit(0);
 
 	if (argc > 1) {
-		set_cart_name(argv[1]); // will get loaded on reset
-		//load_rom(argv[1], &cart_rom, &cart_rom_size);
+		bulwip_load_cart(b, argv[1]);
 		argv++;
 	} else {
+#ifdef BUNDLE_CART
+		bulwip_load_cart(b, BUNDLE_CART); // first of CARTS in "make bundle"
+#endif
 		//load_rom("../phantis/phantisc.bin", &cart_rom, &cart_rom_size);
 		//load_rom("cputestc.bin", &cart_rom, &cart_rom_size);
 		//load_rom("../wordit/wordit8.bin", &cart_rom, &cart_rom_size);
@@ -2069,14 +2910,10 @@ int main(int argc, char *argv[])
 		//load_rom("cputestc.bin", &cart_rom, &cart_rom_size);
 		//load_rom("test/mbtest.bin", &cart_rom, &cart_rom_size);
 		load_rom("mbtest.bin", &cart_rom, &cart_rom_size);
+		bulwip_reset(b);
 #endif
 	}
 
-	//vdp_window_scale(4);
-	vdp_init();
-
-	reset();
-
 	//add_breakpoint(BREAKPOINT, 0x3aa, 0, 0, 0);
 #ifdef TEST
 	//debug_en = 1; debug_break = DEBUG_STOP;
@@ -2094,7 +2931,6 @@ int main(int argc, char *argv[])
 #ifdef ENABLE_GIF
 	GifBegin(&gif, "bulwip.gif", /*width*/320, /*height*/240, /*delay*/2, /*bitDepth*/4, /*dither*/false);
 #endif
-	int lines_per_frame = 262; // NTSC=262 PAL=313
 
 	do {
 #ifdef ENABLE_DEBUGGER
@@ -2102,50 +2938,16 @@ int main(int argc, char *argv[])
 			if (debug_window() == -1) break;
 		}
 #endif
-
-		// render one frame
-		do {
-#ifdef ENABLE_F18A
-			gpu();
+#ifdef ENABLE_GDB
+		if (gdb_poll() == -1) break;
 #endif
 
-			// render one scanline
-			if (vdp.y < 240) {
-				undo_push(UNDO_VDPST, vdp.reg[VDP_ST]);
-				vdp_line(vdp.y, vdp.reg, vdp.ram);
-			} else if (vdp.y == 246) {
-				undo_push(UNDO_VDPST, vdp.reg[VDP_ST]);
-				vdp.reg[VDP_ST] |= 0x80;  // set F in VDP status
-				if (vdp.reg[1] & 0x20) // check IE
-					interrupt(1);  // VDP interrupt
-			}
-			undo_push(UNDO_VDPY, vdp.y);
-			if (++vdp.y == lines_per_frame) {
-				vdp.y = 0;
-			}
-
-			total_cycles_busy = total_cycles + CYCLES_PER_LINE;
-			total_cycles = total_cycles_busy;
-			add_cyc(-CYCLES_PER_LINE);
-			total_cycles_busy = 0;
-#ifdef ENABLE_DEBUGGER
-			if (debug_break == DEBUG_SINGLE_STEP) {
-				single_step();
-				set_break(DEBUG_STOP);
-				break;
-			}
-#endif
-			emu(); // emulate until cycle counter goes positive
-			//emu_check_undo();
-			// a breakpoint will change debug_break variable
-
-		} while (vdp.y != 0
-#ifdef ENABLE_DEBUGGER
-			&& (debug_break == DEBUG_RUN || debug_break == DEBUG_FRAME_STEP)
-#endif
-			);
+		// render one frame
+		frame = bulwip_run_frame(b);
 #ifdef ENABLE_GIF
-		GifWriteFrame(&gif, (u8*)frame_buffer, /*width*/320, /*height*/240, /*delay*/2, /*bitDepth*/4, /*dither*/false);
+		GifWriteFrame(&gif, (u8*)frame->pixels, /*width*/320, /*height*/240, /*delay*/2, /*bitDepth*/4, /*dither*/false);
+#else
+		(void)frame;
 #endif
 	} while (vdp_update_or_menu() == 0);
 
@@ -2157,7 +2959,10 @@ int main(int argc, char *argv[])
 #ifdef TEST
 	print_name_table(vdp.reg, vdp.ram);
 #endif
+	bulwip_destroy(b);
 
 	if (log) fclose(log);
 	if (disasmf && disasmf != log) fclose(disasmf);
 }
+
+#endif // LIBBULWIP
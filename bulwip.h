@@ -0,0 +1,81 @@
+#ifndef BULWIP_H_
+#define BULWIP_H_
+
+// libbulwip - embeddable TI 99/4A emulator
+//
+// Build with "make libbulwip.a" or "make libbulwip.so".  No SDL or window
+// is needed, frames run as fast as the caller asks for them.
+// The emulator core is built on global state, so only one instance can
+// exist at a time.
+
+#include <stddef.h>
+
+struct bulwip_config {
+	const char *rom_dir;   // where to find 994arom.bin etc, NULL=current dir
+	int unlimited_sprites; // 1=draw all sprites on a line, no flicker
+	int vdp_timing;        // 1=report VRAM accesses faster than real hardware
+	int fp_hle;            // 0=ROM floating point, else native with this
+	                       // cycle cost per operation (try 300), only
+	                       // with a console ROM and GROM radix100.c knows
+	int vdp_timeline;      // 1=record VDP port accesses for
+	                       // bulwip_save_vdp_timeline()
+	const char *persist_dir; // keep cartridge RAM and SAMS in files
+	                       // here across runs, NULL=don't
+	int gpu_idle_skip;     // 1=end the F18A GPU's scanline early when it
+	                       // is in an idle loop, faster but not cycle exact
+};
+
+struct bulwip_frame {
+	const unsigned int *pixels; // ARGB8888
+	int width;  // 320, or 640 in 80-column text mode
+	int height; // 240
+	int pitch;  // in pixels
+	const unsigned char *audio; // unsigned 8-bit mono, sound chip and speech
+	int audio_len;  // samples generated this frame
+	int audio_freq; // samples per second
+};
+
+struct bulwip;
+
+// Returns NULL if the console ROM/GROM can't be loaded or an instance exists
+extern struct bulwip *bulwip_create(const struct bulwip_config *config);
+extern void bulwip_destroy(struct bulwip *b);
+
+// Load a cartridge (like "foo8.bin" or "fooC.bin") and reset
+// Returns 0 on success, -1 if no ROM or GROM was found
+extern int bulwip_load_cart(struct bulwip *b, const char *filename);
+extern void bulwip_reset(struct bulwip *b);
+
+// Put a TI BASIC or Extended BASIC program (PROGRAM image or text listing)
+// into VDP RAM, as if typed in or loaded with OLD.  Run frames until BASIC
+// shows its prompt first, then type RUN.  Returns 0 on success, -1 if not
+// a BASIC program or it doesn't fit.
+extern int bulwip_load_basic(struct bulwip *b, const char *filename);
+
+// Run until the next vertical blank.  The frame is valid until the next call
+extern const struct bulwip_frame *bulwip_run_frame(struct bulwip *b);
+
+// Run at least this many CPU cycles, stopping at the end of an instruction,
+// and return the cycles run.  Scanlines are drawn on the way but frame ends
+// are not special.  For stepping finer than a frame, as lockstep.c does.
+extern long bulwip_run_cycles(struct bulwip *b, long cycles);
+
+// Set the whole keyboard/joystick matrix.  Key code k is row k>>3, column k&7
+// (see TI_* in cpu.h), so a key is pressed if keys[k>>3] & (1 << (k&7))
+extern void bulwip_set_keys(struct bulwip *b, const unsigned char keys[8]);
+
+// Returns the size of the snapshot, and writes it if it fits in size
+extern size_t bulwip_save_state(struct bulwip *b, void *buf, size_t size);
+// Returns 0 on success, -1 if the snapshot size doesn't match
+extern int bulwip_load_state(struct bulwip *b, const void *buf, size_t size);
+// Write a snapshot as text (registers and memory dumps) for diffing.
+// Returns 0 on success, -1 if it is not a snapshot or can't be written
+extern int bulwip_dump_state(const void *buf, size_t size, const char *filename);
+
+// Write the VDP port accesses of the last whole frame, with their cycle,
+// scanline and address, and counts per scanline and VRAM table.  The
+// format is described in timeline.c.  Needs vdp_timeline in the config.
+// Returns 0 on success, -1 on error
+extern int bulwip_save_vdp_timeline(struct bulwip *b, const char *filename);
+
+#endif // BULWIP_H_
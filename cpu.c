@@ -78,6 +78,23 @@ void single_step(void)
 	//printf("%s: save=%d cyc=%d\n", __func__, saved_cyc, cyc);
 }
 
+#ifdef ENABLE_DEBUGGER
+// Run until cycles have passed or the scanline ends, whichever is first.
+// Like single_step(), the rest of the line is set aside meanwhile.
+void emu_cycles(int cycles)
+{
+	int saved_cyc = cyc + cycles;
+
+	if (saved_cyc >= 0) {
+		emu(); // the line ends first
+		return;
+	}
+	cyc = -cycles;
+	emu();
+	cyc += saved_cyc;
+}
+#endif
+
 
 
 // forward
@@ -153,12 +170,17 @@ void set_mapping_safe(int base, int size,
 	end = (base + size) >> MAP_SHIFT;
 	base >>= MAP_SHIFT;
 	for (i = base; i < end; i++) {
+#ifdef ENABLE_DEBUGGER
 		if (map_read(i) != brk_r)
 			map_read(i) = read;
-		map_read_orig(i) = read;
-		map_safe_read(i) = safe_read;
 		if (map_write(i) != brk_w)
 			map_write(i) = write;
+#else
+		map_read(i) = read;
+		map_write(i) = write;
+#endif
+		map_read_orig(i) = read;
+		map_safe_read(i) = safe_read;
 		map_write_orig(i) = write;
 		map_mem(i) = mem ? mem + ((i-base) << (MAP_SHIFT-1)) : NULL;
 		//printf("map page=%x address=%p\n", base+i, map[base+i].mem);
@@ -203,6 +225,10 @@ static always_inline void mem_w(u16 address, u16 value)
 	map_write(address >> MAP_SHIFT)(address, value);
 }
 
+// for native code that stands in for CPU code
+u16 cpu_mem_r(u16 address) { return mem_r(address); }
+void cpu_mem_w(u16 address, u16 value) { mem_w(address, value); }
+
 static always_inline u16 reg_r(u16 wp, u8 reg)
 {
 	return mem_r(wp + 2 * reg);
@@ -265,11 +291,11 @@ static u16 brk_r(u16 address)
 {
 	//printf("%s: %04X\n", __func__, address);
 	if (breakpoint_read(address)) {
-		breakpoint_saved_cyc = cyc;
 		if (address == gPC) {
 			debug_break = DEBUG_STOP;
 			return C99_BRK; // instruction decoder will handle this
 		} else {
+			breakpoint_saved_cyc = cyc;
 			cyc = 0; // memory read trigger break: return after current instruction
 		}
 	}
@@ -287,6 +313,14 @@ static void brk_w(u16 address, u16 value)
 	}
 }
 
+// Debugger write, through the device but without breakpoints or cycles
+void debug_w(u16 address, u16 value)
+{
+	int saved_cyc = cyc;
+	map_write_orig(address >> MAP_SHIFT)(address, value);
+	cyc = saved_cyc;
+}
+
 // Reset any breakpoint mappings to the original mappings
 void cpu_reset_breakpoints(void)
 {
@@ -610,6 +644,59 @@ static const struct {
 // This maps instruction opcodes from 16 bits to 7 bits, making switch lookup table more efficient
 #define DECODE(x) ((((x) >> (24-__builtin_clz(x))) & 0x78) | (22-__builtin_clz(x)))
 
+#ifdef FUSION_STATS
+static u32 pair_count[128][128];
+static u16 pair_op[128]; // an example opcode for each decoded index
+static u8 pair_last = 0xff; // 0xff until atexit is registered
+static void fusion_stats(void);
+#define PAIR_COUNT(op) do { \
+	u8 d = DECODE(op); \
+	if (pair_last == 0xff) atexit(fusion_stats); \
+	else pair_count[pair_last][d]++; \
+	pair_op[d] = op; \
+	pair_last = d; } while (0)
+#else
+#define PAIR_COUNT(op) do { } while (0)
+#endif
+
+// Superinstructions: after an instruction that is commonly followed by
+// another specific one (DEC/JNE, CI/JEQ, SRL/ANDI...) fetch the next opcode
+// right here and jump straight to its handler, instead of sharing the one
+// unpredictable switch jump.  Fetching does exactly what start_decoding does
+// (undo, breakpoints, base cycles), and only happens when decode_op would
+// not have returned, so interrupts are taken at the same instruction.
+//
+// FUSE_LAZY is FUSE_FETCH for an instruction that leaves its EQ/LGT/AGT
+// flags until the next opcode is known: a follower that sets them all
+// again (ANDI, DEC) makes them dead, any other path runs "flags" first.
+// The undo log records ST in between, so undo builds always set them.
+// FUSION_STATS shows which pairs are worth it on a given program.
+#ifdef ENABLE_FUSION
+#define FUSE_FETCH() \
+	if (cyc > 0 || cfg.no_fusion) goto decode_op; \
+	gPC = pc; \
+	undo_push(UNDO_PC, pc); \
+	undo_push(UNDO_CYC, (u16)cyc); \
+	undo_push(UNDO_ST, get_st()); \
+	op = mem_r(pc); \
+	pc += 2
+#define FUSE(mask, match, label) \
+	if ((op & (mask)) == (match)) { PAIR_COUNT(op); cyc += 6; goto label; }
+#define FUSE_END() goto execute_op
+#ifdef ENABLE_UNDO
+#define FUSE_LAZY(flags) flags; FUSE_FETCH()
+#else
+#define FUSE_LAZY(flags) \
+	if (cyc > 0 || cfg.no_fusion) { flags; goto decode_op; } \
+	FUSE_FETCH()
+#endif
+#else
+#define FUSE_FETCH() goto decode_op
+#define FUSE_LAZY(flags) flags; goto decode_op
+#define FUSE(mask, match, label)
+#define FUSE_END()
+#endif
+
 // instruction opcode decoding using count-leading-zeroes (clz)
 
 void emu(void)
@@ -659,6 +746,7 @@ start_decoding_skip_undo:
 	// before reading the memory and will return C99_BRK
 	pc += 2;
 execute_op:
+	PAIR_COUNT(op);
 	cyc += 6; // base cycles
 
 	switch (DECODE(op)) {
@@ -666,7 +754,8 @@ execute_op:
 	AI:   case DECODE(0x0220): reg_w(wp, op&15, add(reg_r(wp, op&15), mem_r(pc))); pc += 2; goto decode_op;
 	ANDI: case DECODE(0x0240): reg_w(wp, op&15, status_zero(reg_r(wp, op&15) & mem_r(pc))); pc += 2; goto decode_op;
 	ORI:  case DECODE(0x0260): reg_w(wp, op&15, status_zero(reg_r(wp, op&15) | mem_r(pc))); pc += 2; goto decode_op;
-	CI:   case DECODE(0x0280): status_arith(reg_r(wp, op&15), mem_r(pc)); cyc += 2; pc += 2; goto decode_op;
+	CI:   case DECODE(0x0280): status_arith(reg_r(wp, op&15), mem_r(pc)); cyc += 2; pc += 2;
+		FUSE_FETCH(); FUSE(0xff00, 0x1300, JEQ); FUSE(0xff00, 0x1600, JNE); FUSE_END();
 	STWP: case DECODE(0x02A0): reg_w(wp, op&15, wp); goto decode_op;
 	STST: case DECODE(0x02C0): reg_w(wp, op&15, get_st()); goto decode_op;
 	LWPI: case DECODE(0x02E0): cyc -= 2; undo_push(UNDO_WP, wp); wp = mem_r(pc); cyc += 2; pc += 2; goto decode_op;
@@ -696,8 +785,13 @@ execute_op:
 	INV:  case DECODE(0x0540): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = status_zero(~td.val); mem_w(td.addr, td.val); goto decode_op;
 	INC:  case DECODE(0x0580): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = add(td.val,1); mem_w(td.addr, td.val); goto decode_op;
 	INCT: case DECODE(0x05C0): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = add(td.val,2); mem_w(td.addr, td.val); goto decode_op;
-	DEC:  case DECODE(0x0600): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = sub(td.val,1); mem_w(td.addr, td.val); goto decode_op;
-	DECT: case DECODE(0x0640): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = sub(td.val,2); mem_w(td.addr, td.val); goto decode_op;
+	DEC:  case DECODE(0x0600): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = sub(td.val,1); mem_w(td.addr, td.val);
+		FUSE_FETCH(); FUSE(0xff00, 0x1600, DEC_JNE); FUSE_END();
+	DECT: case DECODE(0x0640): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = sub(td.val,2); mem_w(td.addr, td.val);
+		FUSE_FETCH(); FUSE(0xff00, 0x1600, DEC_JNE); FUSE_END();
+#ifdef ENABLE_FUSION
+	DEC_JNE: if (td.val) goto JMP; goto decode_op; // EQ is the result being zero
+#endif
 	BL:   case DECODE(0x0680): cyc -= 2; td = Td(op, &pc, wp, 2); reg_w(wp, 11, pc); pc = td.addr; goto decode_op;
 	SWPB: case DECODE(0x06C0): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = swpb(td.val); mem_w(td.addr, td.val); goto decode_op;
 	SETO: case DECODE(0x0700): cyc -= 2; td = Td(op, &pc, wp, 2); td.val = 0xffff; mem_w(td.addr, td.val); goto decode_op;
@@ -726,8 +820,10 @@ execute_op:
 		u16 val = reg_r(wp, op & 15);
 		u8 count = shift_count(op, wp);
 		if (val & (1 << (count-1))) set_C(); else clr_C();
-		reg_w(wp, op & 15, status_zero(val >> count));
-		goto decode_op; }
+		val >>= count;
+		reg_w(wp, op & 15, val);
+		// ANDI sets all the flags but C again
+		FUSE_LAZY(status_zero(val)); FUSE(0xfff0, 0x0240, ANDI); status_zero(val); FUSE_END(); }
 	SLA: case DECODE(0x0A00): case DECODE(0x0A80): {
 		u16 val = reg_r(wp, op & 15);
 		u8 count = shift_count(op, wp);
@@ -762,9 +858,9 @@ execute_op:
         JL:  case DECODE(0x1A00): if (tst_L()) goto JMP; goto decode_op;
         JH:  case DECODE(0x1B00): if (tst_H()) goto JMP; goto decode_op;
         JOP: case DECODE(0x1C00): if (tst_OP()) goto JMP; goto decode_op;
-        SBO: case DECODE(0x1D00): cru_w((op & 0xff) + ((reg_r(wp, 12) & 0x1ffe) >> 1), 1); goto decode_op;
-        SBZ: case DECODE(0x1E00): cru_w((op & 0xff) + ((reg_r(wp, 12) & 0x1ffe) >> 1), 0); goto decode_op;
-        TB:  case DECODE(0x1F00): status_equal(cru_r((op & 0xff) + ((reg_r(wp, 12) & 0x1ffe) >> 1)), 1); goto decode_op;
+        SBO: case DECODE(0x1D00): cru_write((op & 0xff) + ((reg_r(wp, 12) & 0x1ffe) >> 1), 1, 1); goto decode_op;
+        SBZ: case DECODE(0x1E00): cru_write((op & 0xff) + ((reg_r(wp, 12) & 0x1ffe) >> 1), 1, 0); goto decode_op;
+        TB:  case DECODE(0x1F00): status_equal(cru_read((op & 0xff) + ((reg_r(wp, 12) & 0x1ffe) >> 1), 1), 1); goto decode_op;
 
 	COC: case DECODE(0x2000): case DECODE(0x2200): {
 		u16 ts = Ts(op, &pc, wp, 2);
@@ -800,7 +896,7 @@ execute_op:
 		goto decode_op_now; } // next instruction cannot be interrupted
 
 	LDCR: case DECODE(0x3000): case DECODE(0x3200): {
-		u8 idx, c = ((op >> 6) & 15) ?: 16;
+		u8 c = ((op >> 6) & 15) ?: 16;
 		u16 ts, reg = (reg_r(wp, 12) & 0x1ffe) >> 1;
 		if (c <= 8) {
 			ts = Ts(op, &pc, wp, 1) >> 8;
@@ -808,30 +904,21 @@ execute_op:
 		} else {
 			ts = Ts(op, &pc, wp, 2);
 		}
-		for (idx = 0; idx < c; idx++)
-			cru_w(reg + idx, (ts >> idx) & 1);
+		cru_write(reg, c, ts);
 		status_zero(ts);
 		goto decode_op; }
 	STCR: case DECODE(0x3400): case DECODE(0x3600): {
-		u8 idx, c = ((op >> 6) & 15) ?: 16;
+		u8 c = ((op >> 6) & 15) ?: 16;
 		u16 reg = (reg_r(wp, 12) & 0x1ffe) >> 1;
 		if (c <= 8) {
 			td = Td(op, &pc, wp, 1);
 			td.val &= (td.addr & 1) ? 0xff00 : 0x00ff;
-			u16 base = (td.addr & 1) ? 1 : 0x100;
-			for (idx = 0; idx < c; idx++) {
-				if (cru_r(reg + idx))
-					td.val |= (base << idx);
-			}
+			td.val |= cru_read(reg, c) << ((td.addr & 1) ? 0 : 8);
 			mem_w(td.addr, td.val);
 			status_parity(status_zero(td.val & 0xff00));
 		} else {
 			td = Td(op, &pc, wp, 2);
-			td.val = 0;
-			for (idx = 0; idx < c; idx++) {
-				if (cru_r(reg + idx))
-					td.val |= (1 << idx);
-			}
+			td.val = cru_read(reg, c);
 			mem_w(td.addr, td.val);
 			status_zero(td.val);
 		}
@@ -890,7 +977,8 @@ execute_op:
 		goto decode_op;
 	C: case DECODE(0x8000): case DECODE(0x8800):
 		word_op(&op, &pc, wp, &ts, &td);
-		status_arith(ts, td.val); cyc+=2; goto decode_op;
+		status_arith(ts, td.val); cyc+=2;
+		FUSE_FETCH(); FUSE(0xff00, 0x1300, JEQ); FUSE(0xff00, 0x1600, JNE); FUSE_END();
 	CB: case DECODE(0x9000): case DECODE(0x9800):
 		byte_op(&op, &pc, wp, &ts, &td);
 		if (td.addr & 1) {
@@ -914,7 +1002,11 @@ execute_op:
 		goto decode_op;
 	MOV: case DECODE(0xC000): case DECODE(0xC800):
 		word_op(&op, &pc, wp, &ts, &td);
-		td.val = status_zero(ts); mem_w(td.addr, td.val); goto decode_op;
+		td.val = ts; mem_w(td.addr, td.val);
+		// copy loops: MOV *R1+,*R2+ / DEC R3 / JNE, and MOV / ANDI
+		FUSE_LAZY(status_zero(ts));
+		FUSE(0xffc0, 0x0600, DEC); FUSE(0xfff0, 0x0240, ANDI);
+		status_zero(ts); FUSE_END();
 	MOVB: case DECODE(0xD000): case DECODE(0xD800):
 		byte_op(&op, &pc, wp, &ts, &td);
 		if (td.addr & 1) {
@@ -940,6 +1032,20 @@ execute_op:
 		goto decode_op;
 
 	default:
+		if (op == HLE_FP) {
+			int saved_cyc = cyc;
+			int cost = fp_hle(pc - 2, &op);
+			cyc = saved_cyc;
+			if (cost >= 0) {
+				cyc += cost;
+				pc = reg_r(wp, 11); // return like B *R11
+				goto decode_op;
+			}
+			if (op != HLE_FP) {
+				cyc -= 6; // declined, run the ROM's own instruction
+				goto execute_op;
+			}
+		}
 		{
 			static int last_pc = -1;
 			if (last_pc != pc-2)
@@ -959,6 +1065,12 @@ execute_op:
 		goto decode_op;
 	}
 done:
+#ifdef ENABLE_DEBUGGER
+	// a memory breakpoint zeroed the counter to stop, put back the
+	// rest of the scanline so resuming is seamless
+	cyc += breakpoint_saved_cyc;
+	breakpoint_saved_cyc = 0;
+#endif
 	gPC = pc;
 	gWP = wp;
 	return;
@@ -979,6 +1091,46 @@ static const char **names[] = {
 };
 
 
+#ifdef FUSION_STATS
+static const char *op_name(u16 op)
+{
+	u8 idx = __builtin_clz(op)-16;
+	const char *name;
+
+	if (idx >= ARRAY_SIZE(names))
+		return "DATA";
+	name = names[idx][(op >> decode[idx].shift) & decode[idx].mask];
+	return name ?: "DATA";
+}
+
+// print the most frequent instruction pairs, to find fusion candidates
+static void fusion_stats(void)
+{
+	u64 total = 0;
+	int i, j, n;
+
+	for (i = 0; i < 128; i++)
+		for (j = 0; j < 128; j++)
+			total += pair_count[i][j];
+	if (!total)
+		return;
+	printf("instruction pairs: %llu\n", total);
+	for (n = 0; n < 30; n++) {
+		int bi = 0, bj = 0;
+		for (i = 0; i < 128; i++)
+			for (j = 0; j < 128; j++)
+				if (pair_count[i][j] > pair_count[bi][bj])
+					bi = i, bj = j;
+		if (!pair_count[bi][bj])
+			break;
+		printf("%5.2f%%  %-5s %-5s\n", 100.0 * pair_count[bi][bj] / total,
+			op_name(pair_op[bi]), op_name(pair_op[bj]));
+		pair_count[bi][bj] = 0;
+	}
+}
+#endif
+
+
 static char reg_text[64] = {};
 char asm_text[256] = {};
 
@@ -1225,8 +1377,8 @@ int debug_log(const char *fmt, ...)
 	va_end(ap);
 	return ret;
 }
-u8 cru_r(u16 bit) { return 1; }
-void cru_w(u16 bit, u8 value) {}
+u16 cru_read(u16 bit, int count) { return 0xffff & ((1 << count) - 1); }
+void cru_write(u16 bit, int count, u16 value) {}
 void unhandled(u16 pc, u16 op) {}
 int get_cart_bank(void) { return 0; }
 #ifdef ENABLE_DEBUGGER
@@ -7,9 +7,18 @@
 //#define ENABLE_UNDO
 //#define LOG_DISASM
 #define USE_SDL
+//#define ENABLE_FUSION // dispatch common instruction pairs directly, off until
+			// FUSION_STATS pair counts from real cartridges back it
+//#define FUSION_STATS // print instruction pair counts at exit
+//#define GPU_PROFILE // print F18A GPU hot spots and busy time at exit
+#define ENABLE_GDB // remote debugging stub, set BULWIP_GDB=port to use, see gdb.c
+#define ENABLE_PERSIST // file backed cartridge RAM and SAMS, set BULWIP_PERSIST=dir to use
+#define ENABLE_REALTIME // locked memory, RT priority and precise frame pacing, set BULWIP_RT=on to use
 
 
 
+typedef unsigned long long u64;
+typedef signed long long s64;
 typedef unsigned int u32;
 typedef unsigned short u16;
 typedef signed short s16;
@@ -37,8 +46,35 @@ typedef signed char s8;
 #undef ENABLE_UNDO
 #endif
 
+#ifdef LIBBULWIP
+// embeddable library build, see bulwip.h
+#undef USE_SDL
+#undef ENABLE_DEBUGGER
+#undef ENABLE_UNDO
+#endif
+
+#if !defined(ENABLE_DEBUGGER) || defined(_WIN32)
+// needs the breakpoint machinery, and POSIX sockets, so not in libbulwip
+#undef ENABLE_GDB
+#endif
+
+#ifdef _WIN32
+// needs mmap
+#undef ENABLE_PERSIST
+#endif
+
+#ifndef __linux__
+// needs clock_nanosleep, pthread affinity and mlockall
+#undef ENABLE_REALTIME
+#endif
+
+#ifdef LOG_DISASM
+// every instruction must pass through decode_op to be logged
+#undef ENABLE_FUSION
+#endif
+
+// COMPILED_ROMS builds in bundle.h, set by "make bundle"
 // none of these are used yet
-//#define COMPILED_ROMS
 //#define TRACE_GROM
 //#define TRACE_VDP
 //#define TRACE_CPU
@@ -48,6 +84,7 @@ typedef signed char s8;
 extern void cpu_reset(void);
 extern void emu(void);
 extern void single_step(void);
+extern void emu_cycles(int cycles); // debugger, stops at the end of the scanline too
 extern int disasm(u16 pc, int cycles);
 extern char asm_text[256]; // output from disasm()
 extern int disasm_cyc; // cpu.c
@@ -76,7 +113,11 @@ extern void set_mapping(int base, int size,
 extern u16 safe_r(u16 address);
 extern u16 map_r(u16 address);
 extern void map_w(u16 address, u16 value);
+// Accesses through the read/write functions, like the CPU does
+extern u16 cpu_mem_r(u16 address);
+extern void cpu_mem_w(u16 address, u16 value);
 
+extern void debug_w(u16 address, u16 value); // no breakpoints or cycles
 extern void cpu_reset_breakpoints(void); // clear all
 extern void cpu_set_breakpoint(u16 base, u16 size);
 
@@ -92,12 +133,19 @@ enum {
 	FILTER_SMOOTH,
 	FILTER_PIXELATED,
 	FILTER_CRT,
+	FILTER_SCALE2X,
+	FILTER_SCALE3X,
+	FILTER_XBR,
+	FILTER_SHARP, // sharp bilinear
 };
 extern void vdp_set_fps(int mfps /* fps*1000 */);
-extern void snd_w(unsigned char byte);
+extern void snd_w(unsigned char byte); // bulwip.c
+extern int snd_render(u8 *buf, int len); // bulwip.c
+#define SAMPLE_FREQUENCY 48000 // audio output
 extern void vdp_init(void);
 extern void vdp_done(void);
 extern int vdp_update(void);
+extern int vdp_update_idle(int timeout_ms); // sleeps until input, for menus
 //extern void vdp_line(unsigned int y, u8* restrict reg, u8* restrict ram);
 extern void vdp_lock_texture(int line, int len, void**pixels);
 extern void vdp_unlock_texture(void);
@@ -109,6 +157,29 @@ extern void mute(int en);
 extern void vdp_window_scale(int scale);
 extern void vdp_text_clear(int x, int y, int w, int h, unsigned int color);
 extern void vdp_set_filter(void);
+extern void vdp_realtime(const char *spec); // BULWIP_RT options, see sdl.c
+
+// speech.c
+extern void speech_init(const u8 *rom, unsigned int size);
+extern u8 speech_read(void);
+extern void speech_write(u8 value);
+extern void speech_run(u64 now);
+extern void speech_mix(unsigned char *buffer, int len, int freq, u64 current_cpu_cycles);
+
+// rs232.c
+extern void rs232_init(const char *where); // "pty" or UNIX socket path, comma separated per port
+extern void rs232_set_rom(u16 *rom);
+extern void rs232_reset(void);
+extern u16 rs232_cru_r(u16 bit, int count);
+extern void rs232_cru_w(u16 bit, int count, u16 value);
+extern int rs232_run(u64 now); // returns the interrupt line
+
+// scale.c, widths must be a multiple of 4, pitches are in pixels
+extern void scale2x(const u32 *src, int src_pitch, int w, int h, u32 *dst, int dst_pitch);
+extern void scale3x(const u32 *src, int src_pitch, int w, int h, u32 *dst, int dst_pitch);
+extern void xbr2x(const u32 *src, int src_pitch, int w, int h, u32 *dst, int dst_pitch);
+extern void scale_nearest(const u32 *src, int src_pitch, int w, int h,
+	u32 *dst, int dst_pitch, int nx, int ny);
 
 // ui.c
 extern void load_listing(const char *filename, int bank);
@@ -117,10 +188,54 @@ extern int debug_window(void);
 extern void set_ui_key(int);
 
 extern struct config_struct {
-	int crt_filter;  // 0=smooth 1=pixelated 2=crt
+	int crt_filter;  // 0=smooth 1=pixelated 2=crt 3=scale2x 4=scale3x 5=xbr 6=sharp bilinear
 	int frame_rate;  // 59940=NTSC 50000=PAL etc
+	int vdp_timing;  // 1=report VRAM accesses faster than real hardware
+	int unlimited_sprites; // 1=draw all sprites on a line, no flicker
+	int fp_hle;      // 0=ROM floating point, else native with this cycle cost
+	int no_fusion;   // 1=plain dispatch even with ENABLE_FUSION, see lockstep.c
+	int vdp_timeline; // 1=record VDP port accesses, see timeline.c
+	int gpu_idle_skip; // 1=end the F18A GPU's scanline early in an idle loop
 } cfg;
 
+#define FP_HLE_CYCLES 300 // default cost of a native floating point operation
+
+// basic.c
+extern int basic_load(const char *filename);
+
+// timeline.c
+enum timeline_kind {
+	TL_VRAM_W,
+	TL_VRAM_R,
+	TL_REG_W,    // addr is the register number
+	TL_STATUS_R,
+};
+enum timeline_column { // VRAM tables, then the other kinds of access
+	TL_NAME,
+	TL_PATTERN,
+	TL_COLOR,
+	TL_SAT,
+	TL_SPRITE,   // sprite patterns
+	TL_OTHER,
+	TL_REG,
+	TL_STATUS,
+	TL_COLUMNS
+};
+extern void vdp_timeline_record(int kind, u16 addr, u8 value);
+extern void vdp_timeline_frame(void);
+extern int vdp_timeline_save(const char *filename);
+extern void vdp_timeline_draw(int x, int y);
+
+// radix100.c
+extern void fp_hle_init(u16 *console_rom, unsigned int size,
+	const u8 *console_grom, unsigned int grom_size);
+extern void fp_hle_update(void);
+extern int fp_hle(u16 pc, u16 *op);
+extern int fp_gpl(u16 addr);
+extern long fp_gpl_check(int on);
+extern int fp_hle_unchecked; // patch entries not checked for this ROM too
+extern int fp_gpl_active; // call fp_gpl on GROM address writes
+
 
 
  // bulwip.c
@@ -132,8 +247,11 @@ enum {
 	DEBUG_SINGLE_STEP = 2,
 	DEBUG_FRAME_STEP = 3,
 	DEBUG_SCANLINE_STEP = 4,
+	DEBUG_CYCLE_STEP = 5,
 };
-extern int debug_break; // 0=running 1=pause 2=single step 3=frame step
+extern int debug_break; // 0=running 1=pause 2=single step 3=frame step 4=scanline step 5=cycle step
+extern void debug_run_line(int line); // stop after the VDP does line, -1 for the next one
+extern void debug_run_cycles(int cycles);
 extern void set_break(int debug_state); // this also clears ui_key in ui.c
 extern int debug_log(const char *fmt, ...);
 //extern int config_crt_filter;  // 0=smooth 1=pixelated 2=crt
@@ -150,11 +268,19 @@ enum {
 	BREAKPOINT_DISABLE = 0,
 	BREAKPOINT_ENABLE = 1,
 	BREAKPOINT_PASTE = 2,
+	BREAKPOINT_WATCH = 3, // stop after a write
 };
+extern int watch_hit; // address of the last write that stopped, or -1
+extern void debug_step(void); // single step without waiting for a frame
 
 // external CRU functions
-extern u8 cru_r(u16 bit);
-extern void cru_w(u16 bit, u8 value);
+extern u16 cru_read(u16 bit, int count); // count 1-16, first bit in LSB
+extern void cru_write(u16 bit, int count, u16 value);
+extern void set_cru_mapping(u16 base, int count,
+	u16 (*read)(u16, int),
+	void (*write)(u16, int, u16));
+extern void dsr_select(u16 *rom); // 8K DSR ROM at 4000, or NULL
+extern void persist_init(const char *dir); // for cartridge RAM and SAMS files
 extern void set_key(int k, int val); // called from vdp_update()
 
 // things needed by ui.c
@@ -167,7 +293,7 @@ extern int vdp_update_or_menu(void);
 extern void set_cart_name(char *name);
 extern int get_cart_bank(void);
 extern void paste_text(char *text, int old_fps);
-extern unsigned int get_total_cpu_cycles(void);
+extern u64 get_total_cpu_cycles(void); // safe to call from any thread
 
 /* more compact undo encoding:
   Program counter: <PC_Words:2> 0=<PC:16> 1-3=go back N words
@@ -303,35 +429,54 @@ enum {
 	C99_DBG  = 0x0120,    // debug printf +register number
 };
 
+// Patched over console ROM entry points that are emulated natively
+enum {
+	HLE_FP   = 0x0130,    // floating point, see radix100.c
+};
+
 // gpu.c
 #define ENABLE_F18A
 
 #ifdef ENABLE_F18A
 #define VDP_RAM_SIZE (18*1024)
 #define VDP_ST 64
-extern struct vdp {
+struct vdp_state {
 	u8 ram[VDP_RAM_SIZE];
 	u16 a; // address
 	u8 latch;
+	u8 buf; // read-ahead buffer
 	u8 reg[VDP_ST+16]; // normal regs + status regs
 	u8 y;
 	u8 pal[128]; // 64 palette words 0000rrrr_ggggbbbb
 	u8 locked; // 0=unlocked 1=locked 2=half-unlocked
-} vdp;
+};
 
 #else
 
 #define VDP_RAM_SIZE (16*1024)
 #define VDP_ST 8
-extern struct vdp {
+struct vdp_state {
 	u8 ram[VDP_RAM_SIZE];
 	u16 a; // address
 	u8 latch;
+	u8 buf; // read-ahead buffer
 	u8 reg[VDP_ST+1]; // vdp status is [8]
 	u8 y; // scanline counter
-} vdp;
+};
 #endif
 
+// All mutable machine memory is in one page aligned block (bulwip.c) that
+// never moves, so a snapshot is one memcpy.  Small hot things first, and
+// RAM last so a snapshot can stop at the RAM in use.  RAM is page aligned
+// too, so a file can be mapped over it.
+#define RAM_MAX (1024*1024) // 32K expansion, or SAMS up to 1MB
+extern struct machine {
+	u16 scratchpad[128]; // 256 bytes at 8000-80ff, repeated to 83ff
+	struct vdp_state video;
+	u16 ram[RAM_MAX/2] __attribute__((aligned(4096)));
+} machine;
+#define vdp (machine.video)
+
 enum {
 	MODE_1_STANDARD = 0,
 	MODE_2_BITMAP = 2,
@@ -347,9 +492,10 @@ extern u8 vdp_read_data(void);
 extern u8 vdp_read_status(void);
 extern u8 vdp_read_data_safe(void);
 extern u8 vdp_read_status_safe(void);
+extern int vdp_access_cycles(void); // min CPU cycles between VRAM accesses on this line
 
 extern void vdp_reset(void);
-extern void vdp_redraw(void);
+extern void vdp_redraw(void); // re-render from VRAM, leaves VDP status alone
 
 extern u32 pal_rgb(int idx);
 extern void vdp_line(unsigned int line,
@@ -373,6 +519,22 @@ extern void draw_char_patterns(
 
 #ifdef ENABLE_F18A
 extern void gpu(void); // execute on the GPU
+// for the GDB stub
+enum { GPU_REG_PC = 16, GPU_REG_ST = 17 }; // after R0-R15
+extern u16 gpu_get_reg(int n);
+extern void gpu_set_reg(int n, u16 value);
+extern u16 gpu_mem_r(u16 address);
+extern void gpu_mem_w(u16 address, u16 value);
+extern int gpu_step(void); // returns -1 if the GPU is idle
+extern void gpu_set_breakpoint(u16 address, int enable);
+extern int gpu_break_hit(void); // returns 1 once after a GPU breakpoint stop
+#endif
+
+// gdb.c
+#ifdef ENABLE_GDB
+extern void gdb_init(const char *where); // port number or UNIX socket path
+extern int gdb_poll(void); // returns -1 to quit
+extern int gdb_attached(void);
 #endif
 
 
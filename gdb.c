@@ -0,0 +1,591 @@
+/*
+ *  gdb.c - GDB remote serial protocol stub
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#ifdef ENABLE_GDB
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Lets GDB, or any tool speaking its remote protocol, debug the emulator
+// without the debugger window.  Start with BULWIP_GDB=1234 to listen on
+// localhost port 1234, or BULWIP_GDB=/tmp/bulwip.sock for a UNIX socket.
+// The emulator stops when a client connects and runs at full speed
+// between stops.  While stopped nothing is drawn, except after memory
+// writes, so stepping and reading memory cost only what they do.
+//
+// Only the SDL frontend has it: it needs the debugger's breakpoints,
+// which the library build leaves out, and main() calls gdb_poll() before
+// each frame.  While the client has the emulator stopped, gdb_poll()
+// blocks that loop waiting for packets, so the window doesn't take input
+// or repaint until the client continues or disconnects.
+//
+// Thread 1 is the TMS9900, thread 2 the F18A GPU with VDP RAM as its
+// memory.  Registers are R0-R15, PC, WP, ST as 16-bit big-endian, with
+// R0-R15 in the CPU's workspace (the GPU has no WP, it reads as 0).
+// Z0/Z1 are breakpoints, Z3 breaks on reads of a word (including
+// instruction fetch), Z2 stops after a write.  The GPU has breakpoints
+// but no watchpoints.
+
+#define PACKET_SIZE 4096
+#define REGS 19 // R0-R15 PC WP ST
+
+enum { REG_PC = 16, REG_WP, REG_ST };
+enum { THREAD_CPU = 1, THREAD_GPU };
+#ifdef ENABLE_F18A
+#define THREADS 2
+#else
+#define THREADS 1
+#endif
+
+// cpu.c (undo access only!)
+extern void set_pc(u16);
+extern void set_wp(u16);
+extern void set_st(u16);
+
+static int listen_fd = -1, client = -1;
+static int no_ack = 0;
+static int running = 0;
+static int thread = THREAD_CPU; // for registers and memory (Hg)
+static char in_buf[PACKET_SIZE];
+static int in_len = 0, in_pos = 0;
+
+
+/****************************************
+ * Packets                              *
+ ****************************************/
+
+// Returns the next byte from the client, -1 if it went away.
+// With wait=0, returns -2 if nothing has arrived.
+static int get_byte(int wait)
+{
+	if (in_pos == in_len) {
+		ssize_t n;
+
+		if (!wait) {
+			struct pollfd p = { client, POLLIN, 0 };
+			if (poll(&p, 1, 0) <= 0)
+				return -2;
+		}
+		n = recv(client, in_buf, sizeof(in_buf), 0);
+		if (n <= 0)
+			return -1;
+		in_len = n;
+		in_pos = 0;
+	}
+	return (u8)in_buf[in_pos++];
+}
+
+static int hex_digit(int c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Read a packet into buf, acking it.  Returns its length or -1.
+static int get_packet(char *buf)
+{
+	for (;;) {
+		int c, len = 0;
+		u8 sum = 0;
+
+		do {
+			c = get_byte(1);
+			if (c < 0)
+				return -1;
+		} while (c != '$'); // skip acks and stray interrupts
+		while ((c = get_byte(1)) != '#') {
+			if (c < 0)
+				return -1;
+			if (len < PACKET_SIZE - 1)
+				buf[len++] = c;
+			sum += c;
+		}
+		buf[len] = 0;
+		c = hex_digit(get_byte(1)) << 4;
+		c |= hex_digit(get_byte(1));
+		if (no_ack)
+			return len;
+		if (c == sum) {
+			send(client, "+", 1, 0);
+			return len;
+		}
+		send(client, "-", 1, 0);
+	}
+}
+
+static void put_packet(const char *data)
+{
+	static char out[PACKET_SIZE + 4];
+	int len = strlen(data), c;
+	u8 sum = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		sum += (u8)data[i];
+	len = snprintf(out, sizeof(out), "$%s#%02x", data, sum);
+	do {
+		send(client, out, len, 0);
+		if (no_ack)
+			return;
+		c = get_byte(1);
+	} while (c == '-');
+}
+
+static const char *parse_hex(const char *p, u32 *value)
+{
+	int d;
+
+	*value = 0;
+	while ((d = hex_digit(*p)) >= 0) {
+		*value = (*value << 4) | d;
+		p++;
+	}
+	return p;
+}
+
+
+/****************************************
+ * Target access                        *
+ ****************************************/
+
+static u16 reg_get(int n)
+{
+#ifdef ENABLE_F18A
+	if (thread == THREAD_GPU)
+		return n < 16 ? gpu_get_reg(n) :
+			n == REG_PC ? gpu_get_reg(GPU_REG_PC) :
+			n == REG_ST ? gpu_get_reg(GPU_REG_ST) : 0;
+#endif
+	switch (n) {
+	case REG_PC: return get_pc();
+	case REG_WP: return get_wp();
+	case REG_ST: return get_st();
+	}
+	return safe_r(get_wp() + 2 * n);
+}
+
+static void reg_set(int n, u16 value)
+{
+#ifdef ENABLE_F18A
+	if (thread == THREAD_GPU) {
+		if (n < 16)
+			gpu_set_reg(n, value);
+		else if (n == REG_PC)
+			gpu_set_reg(GPU_REG_PC, value);
+		else if (n == REG_ST)
+			gpu_set_reg(GPU_REG_ST, value);
+		return;
+	}
+#endif
+	switch (n) {
+	case REG_PC: set_pc(value); break;
+	case REG_WP: set_wp(value); break;
+	case REG_ST: set_st(value); break;
+	default: debug_w(get_wp() + 2 * n, value); break;
+	}
+}
+
+static u16 word_get(u16 address)
+{
+#ifdef ENABLE_F18A
+	if (thread == THREAD_GPU)
+		return gpu_mem_r(address);
+#endif
+	return safe_r(address);
+}
+
+static void word_set(u16 address, u16 value)
+{
+#ifdef ENABLE_F18A
+	if (thread == THREAD_GPU) {
+		gpu_mem_w(address, value);
+		return;
+	}
+#endif
+	debug_w(address, value);
+}
+
+static u8 byte_get(u16 address)
+{
+	u16 w = word_get(address & ~1);
+	return address & 1 ? w & 0xff : w >> 8;
+}
+
+static void byte_set(u16 address, u8 value)
+{
+	u16 w = word_get(address & ~1);
+
+	w = address & 1 ? (w & 0xff00) | value : (w & 0x00ff) | (value << 8);
+	word_set(address & ~1, w);
+}
+
+// Z/z packets, returns 0 if handled
+static int set_break_watch(int type, u32 address, u32 len, int enable)
+{
+	u32 a;
+
+	if (type > 3 || len == 0 || len > 0x10000)
+		return -1;
+#ifdef ENABLE_F18A
+	if (thread == THREAD_GPU) {
+		if (type > 1)
+			return -1;
+		gpu_set_breakpoint(address, enable);
+		return 0;
+	}
+#endif
+	if (type <= 1) // a breakpoint covers its word
+		len = 1;
+	for (a = address & ~1; a < address + len; a += 2) {
+		if (enable)
+			set_breakpoint(a, -1, type == 2 ? BREAKPOINT_WATCH : BREAKPOINT_ENABLE);
+		else
+			remove_breakpoint(a, -1);
+	}
+	return 0;
+}
+
+static void stop_reply(void)
+{
+	char buf[64];
+	int t = THREAD_CPU;
+
+#ifdef ENABLE_F18A
+	if (gpu_break_hit())
+		t = THREAD_GPU;
+#endif
+	if (watch_hit != -1)
+		snprintf(buf, sizeof(buf), "T05watch:%x;thread:%02x;", watch_hit, t);
+	else
+		snprintf(buf, sizeof(buf), "T05thread:%02x;", t);
+	watch_hit = -1;
+	thread = t;
+	put_packet(buf);
+}
+
+static void step(int t)
+{
+#ifdef ENABLE_F18A
+	if (t == THREAD_GPU) {
+		gpu_step();
+		return;
+	}
+#endif
+	debug_step();
+}
+
+
+/****************************************
+ * Commands                             *
+ ****************************************/
+
+// Handle one packet while stopped.  Returns 1 to resume, -1 to quit.
+static int command(char *p)
+{
+	static char out[PACKET_SIZE];
+	u32 a, len, v;
+	char cmd;
+	int i;
+
+	out[0] = 0;
+	cmd = *p++;
+	switch (cmd) {
+	case '?':
+		stop_reply();
+		return 0;
+	case 'q':
+		if (strncmp(p, "Supported", 9) == 0)
+			snprintf(out, sizeof(out), "PacketSize=%x;QStartNoAckMode+", PACKET_SIZE);
+		else if (strcmp(p, "Attached") == 0)
+			strcpy(out, "1");
+		else if (strcmp(p, "C") == 0)
+			snprintf(out, sizeof(out), "QC%02x", thread);
+		else if (strcmp(p, "fThreadInfo") == 0)
+			strcpy(out, THREADS == 2 ? "m01,02" : "m01");
+		else if (strcmp(p, "sThreadInfo") == 0)
+			strcpy(out, "l");
+		break;
+	case 'Q':
+		if (strcmp(p, "StartNoAckMode") == 0) {
+			put_packet("OK");
+			no_ack = 1;
+			return 0;
+		}
+		break;
+	case 'H': // select thread, 0 and -1 mean any
+		if (*p == 'g' || *p == 'c') {
+			parse_hex(p + 1, &v);
+			if (*p == 'g' && v >= THREAD_CPU && v <= THREADS)
+				thread = v;
+			strcpy(out, "OK");
+		}
+		break;
+	case 'T':
+		parse_hex(p, &v);
+		strcpy(out, v >= THREAD_CPU && v <= THREADS ? "OK" : "E01");
+		break;
+	case 'g':
+		for (i = 0; i < REGS; i++)
+			sprintf(out + i * 4, "%04x", reg_get(i));
+		break;
+	case 'G':
+		for (i = 0; i < REGS && strlen(p) >= 4 * (i + 1); i++) {
+			char w[5] = {};
+			memcpy(w, p + i * 4, 4);
+			parse_hex(w, &v);
+			reg_set(i, v);
+		}
+		strcpy(out, "OK");
+		break;
+	case 'p':
+		parse_hex(p, &a);
+		if (a < REGS)
+			sprintf(out, "%04x", reg_get(a));
+		else
+			strcpy(out, "E01");
+		break;
+	case 'P':
+		p = (char*)parse_hex(p, &a);
+		parse_hex(p + 1, &v);
+		if (*p == '=' && a < REGS) {
+			reg_set(a, v);
+			strcpy(out, "OK");
+		} else {
+			strcpy(out, "E01");
+		}
+		break;
+	case 'm':
+		p = (char*)parse_hex(p, &a);
+		parse_hex(p + 1, &len);
+		if (len > sizeof(out) / 2 - 1)
+			len = sizeof(out) / 2 - 1;
+		for (i = 0; i < (int)len; i++)
+			sprintf(out + i * 2, "%02x", byte_get(a + i));
+		break;
+	case 'M':
+		p = (char*)parse_hex(p, &a);
+		p = (char*)parse_hex(p + 1, &len);
+		if (*p++ != ':' || strlen(p) < len * 2) {
+			strcpy(out, "E01");
+			break;
+		}
+		for (i = 0; i < (int)len; i++)
+			byte_set(a + i, (hex_digit(p[i*2]) << 4) | hex_digit(p[i*2+1]));
+		// show what the write did to VRAM or the VDP registers
+		vdp_redraw();
+		if (vdp_update_idle(0) == -1)
+			return -1;
+		strcpy(out, "OK");
+		break;
+	case 'c':
+		if (*p) {
+			parse_hex(p, &a);
+			reg_set(REG_PC, a);
+		}
+		return 1;
+	case 's':
+		if (*p) {
+			parse_hex(p, &a);
+			reg_set(REG_PC, a);
+		}
+		step(thread);
+		stop_reply();
+		return 0;
+	case 'v':
+		if (strcmp(p, "Cont?") == 0) {
+			strcpy(out, "vCont;c;C;s;S");
+		} else if (strncmp(p, "Cont;", 5) == 0) {
+			// only the first action matters, the rest is "continue"
+			const char *q = p + 6;
+
+			if (p[5] != 's' && p[5] != 'S')
+				return 1;
+			if (p[5] == 'S')
+				q = parse_hex(q, &v); // signal, ignored
+			v = thread;
+			if (*q == ':')
+				parse_hex(q + 1, &v);
+			step(v);
+			stop_reply();
+			return 0;
+		}
+		break;
+	case 'Z':
+	case 'z':
+		v = *p - '0';
+		p = (char*)parse_hex(p + 2, &a);
+		parse_hex(p + 1, &len);
+		if (set_break_watch(v, a, len, cmd == 'Z') == 0)
+			strcpy(out, "OK");
+		break;
+	case 'D':
+		put_packet("OK");
+		return -2;
+	case 'k':
+		return -1;
+	}
+	put_packet(out);
+	return 0;
+}
+
+
+/****************************************
+ * Connection                           *
+ ****************************************/
+
+void gdb_init(const char *where)
+{
+	int port;
+
+	if (!where || !*where)
+		return;
+	port = atoi(where);
+	if (port > 0) {
+		struct sockaddr_in sa = {};
+		int one = 1;
+
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+			goto fail;
+	} else {
+		struct sockaddr_un sa = {};
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sa.sun_family = AF_UNIX;
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", where);
+		unlink(where);
+		if (bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+			goto fail;
+	}
+	if (listen(listen_fd, 1) != 0)
+		goto fail;
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+	fprintf(stderr, "GDB stub listening on %s\n", where);
+	return;
+fail:
+	perror("gdb stub");
+	close(listen_fd);
+	listen_fd = -1;
+}
+
+int gdb_attached(void)
+{
+	return client != -1;
+}
+
+static void disconnect(void)
+{
+#ifdef ENABLE_F18A
+	int i;
+#endif
+
+	close(client);
+	client = -1;
+	running = 0;
+	// CPU breakpoints do nothing without a debugger, GPU ones would
+#ifdef ENABLE_F18A
+	for (i = 0; i < 0x10000; i += 2)
+		gpu_set_breakpoint(i, 0);
+#endif
+	set_break(DEBUG_RUN);
+}
+
+// Called before each frame.  While the client has the emulator stopped,
+// serves it until it continues.  Returns -1 to quit.
+int gdb_poll(void)
+{
+	static char packet[PACKET_SIZE];
+
+	if (listen_fd == -1)
+		return 0;
+	if (client == -1) {
+		int one = 1;
+
+		client = accept(listen_fd, NULL, NULL);
+		if (client == -1)
+			return 0;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		in_len = in_pos = 0;
+		no_ack = 0;
+		thread = THREAD_CPU;
+		watch_hit = -1;
+		set_break(DEBUG_STOP);
+	} else if (running) {
+		if (debug_break == DEBUG_RUN) {
+			int c = get_byte(0);
+			if (c == -2)
+				return 0; // keep running
+			if (c != 3) { // only ^C is expected while running
+				if (c == -1)
+					disconnect();
+				return 0;
+			}
+			set_break(DEBUG_STOP);
+		}
+		running = 0;
+		stop_reply();
+	}
+
+	while (!running) {
+		int r;
+
+		if (get_packet(packet) < 0) {
+			disconnect();
+			return 0;
+		}
+		r = command(packet);
+		if (r == -1)
+			return -1;
+		if (r == -2) {
+			disconnect();
+			return 0;
+		}
+		if (r == 1) {
+			running = 1;
+			set_break(DEBUG_RUN);
+		}
+	}
+	return 0;
+}
+
+#endif // ENABLE_GDB
@@ -34,13 +34,13 @@
 
 
 // TODO maybe move this and drawing code to vdp.c
-struct vdp vdp;
+// (vdp itself is in the machine memory block, see cpu.h)
 
 #ifdef ENABLE_F18A
 // F18A Major/Minor version
 #define F18A_VER 0x19
 
-static const struct vdp f18a_defaults = {
+static const struct vdp_state f18a_defaults = {
 	.ram = {},
 	.a = 0,
 	.latch = 0,
@@ -129,7 +129,7 @@ static int f18a_unlocked(void)
 	return !vdp.locked;
 }
 #else
-const struct vdp vdp_defaults = {
+const struct vdp_state vdp_defaults = {
 	.ram = {},
 	.a = 0,
 	.latch = 0,
@@ -277,8 +277,6 @@ unsigned int palette[16] = {
 #define ATTR_TRANS 0x10
 #endif
 
-static int config_sprites_per_line = SPRITES_PER_LINE;
-
 
 u32 pal_rgb(int idx)
 {
@@ -653,6 +651,29 @@ void draw_multicolor_mode(u8* restrict buf,
 }
 #endif
 
+// Spread 8 pattern bits into 16 for magnified sprites
+static inline u16 sprite_mag_bits(u8 b)
+{
+	u32 x = b;
+	x = (x | (x << 4)) & 0x0f0f;
+	x = (x | (x << 2)) & 0x3333;
+	x = (x | (x << 1)) & 0x5555;
+	return x | (x << 1);
+}
+
+// Sprite coincidence is tracked with one bit per pixel, MSB is leftmost.
+// Returns the bits of the 32 pixels at x that were already set, and sets m.
+static inline u32 sprite_coinc(u32 *occ, unsigned int x, u32 m)
+{
+	unsigned int i = x >> 5, sh = x & 31;
+	u32 old = (u32)((((unsigned long long)occ[i] << 32) | occ[i+1]) << sh >> 32);
+
+	occ[i] |= m >> sh;
+	if (sh)
+		occ[i+1] |= m << (32 - sh);
+	return old & m;
+}
+
 void draw_sprites(u8* restrict buf, 
 		unsigned int sy,
 		u8* restrict reg,
@@ -662,19 +683,14 @@ void draw_sprites(u8* restrict buf,
 	u8 sp_mag = sp_size << (reg[1] & 1); // magnified sprite size
 	u8 *sl = ram + (reg[5] & 0x7f) * 0x80; // sprite list
 	u8 *sp = ram + (reg[6] & 0x7) * 0x800; // sprite pattern table
-	u8 coinc[256];
-	
+	int sprites_per_line = cfg.unlimited_sprites ? 32 : SPRITES_PER_LINE;
+	u32 occ[256/32 + 1] = {0}; // pixels touched by a sprite, for coincidence
 
-	// draw sprites  (TODO limit 4 sprites per line, and higher priority sprites)
 	struct {
 		u8 *p;  // Sprite pattern data
 		u8 x;   // X-coordinate
 		u8 f;   // Color and early clock bit
-#ifdef ENABLE_F18A
-		u8 size; // 8 or 16
-		u8 mag; // 8 or 16 (unmagnified) 16 or 32 (magnified)
-#endif
-	} sprites[32]; // TODO Sprite limit hardcoded at 4
+	} sprites[32];
 	int sprite_count = 0;
 
 	for (u8 i = 0; i < 32; i++) {
@@ -683,9 +699,6 @@ void draw_sprites(u8* restrict buf,
 		u8 x = *sl++; // X-coordinate
 		u8 s = *sl++; // Sprite pattern index
 		u8 f = *sl++; // Flags and color
-#ifdef ENABLE_F18A
-		
-#endif
 
 		if (y == 0xD0) // Sprite List terminator
 			break;
@@ -696,39 +709,21 @@ void draw_sprites(u8* restrict buf,
 		if (sp_size == 16)
 			s &= 0xfc; // mask sprite index
 
-		//if (f & 15)
-		//	printf("%d %x %d %d %d %02x %02x\n", sy, (reg[5]&0x7f)*0x80, sprite_count, y, x, s, f);
+		// The 5th sprite is reported as the real chip would,
+		// even when more sprites are drawn
 		if ((reg[VDP_ST] & FIFTH_SPRITE) == 0) {
 			if (sprite_count == SPRITES_PER_LINE) {
 				reg[VDP_ST] &= (INTERRUPT | SPRITE_COINC); // clear existing 5th sprite number
 				reg[VDP_ST] |= FIFTH_SPRITE + i;
 			}
 		}
-		if (sprite_count >= config_sprites_per_line)
+		if (sprite_count >= sprites_per_line)
 			break;
 
 		sprites[sprite_count].p = sp + (s * 8) + ((dy - (y+1)) >> (reg[1]&1));
 		sprites[sprite_count].x = x;
 		sprites[sprite_count].f = f;
 		sprite_count++;
-
-		// clear coinc bytes for this sprite
-		{
-			int n = sp_size;
-			if (f & EARLY_CLOCK_BIT) {
-				x -= 32;
-				if (x < 0) {
-					n += x;
-					x = 0;
-				}
-			}
-			if (x + n > 256) {
-				n = 256 - x;
-			}
-			if (n > 0) {
-				memset(coinc + x, 0, n);
-			}
-		}
 	}
 	if ((reg[VDP_ST] & FIFTH_SPRITE) == 0) {
 		reg[VDP_ST] &= (INTERRUPT | SPRITE_COINC); // clear existing counter
@@ -743,14 +738,18 @@ void draw_sprites(u8* restrict buf,
 		int x = sprites[sprite_count].x;
 		u8 f = sprites[sprite_count].f; // flags and color
 		u8 c = f & 15;
-		unsigned int mask = (p[0] << 8) | p[16]; // bit mask of solid pixels
-		int count = sp_mag; // number of pixels to draw
-		int inc_mask = (reg[1] & 1) ? 1 : 0xff; // only odd pixels : all pixels
+		u32 m; // pixel mask, MSB is leftmost pixel
+		// sprites past the ones the real chip shows are drawn, but
+		// don't touch status
+		int real = sprite_count < SPRITES_PER_LINE;
 
 		//printf("%d %d %d %04x\n", sprite_count, x, f, mask);
 #ifdef ENABLE_F18A
 		if (f18a_unlocked()) {
+			unsigned int mask = (p[0] << 8) | p[16]; // bit mask of solid pixels
 			unsigned int mask2 = 0, mask3 = 0;
+			int count = sp_mag; // number of pixels to draw
+			int inc_mask = (reg[1] & 1) ? 1 : 0xff; // only odd pixels : all pixels
 			u8 sps = reg[24] & 0x30; // Sprite Palette Select two-MSBs in normal mode
 			int spgs = 2048 >> ((reg[29] & 0xc0) >> 6); // Sprite pattern generator offset size
 			u8 v_flip = 0; // TODO
@@ -772,8 +771,8 @@ void draw_sprites(u8* restrict buf,
 						((mask3 >> shift) & 4);
 					if (c && (buf[x] & ATTR_PRI) == 0) {
 						buf[x] = sps | c;
-						reg[VDP_ST] |= coinc[x];
-						coinc[x] = SPRITE_COINC;
+						if (real && sprite_coinc(occ, x, 0x80000000))
+							reg[VDP_ST] |= SPRITE_COINC;
 					}
 					if (count & inc_mask)
 						shift--;
@@ -788,31 +787,43 @@ void draw_sprites(u8* restrict buf,
 			}
 		}
 #endif
+		// pre-expand the pattern into a left-aligned mask of sp_mag pixels
+		if (reg[1] & 1) {
+			m = (u32)sprite_mag_bits(p[0]) << 16;
+			if (sp_size == 16)
+				m |= sprite_mag_bits(p[16]);
+		} else {
+			m = (u32)p[0] << 24;
+			if (sp_size == 16)
+				m |= (u32)p[16] << 16;
+		}
+
 		if (f & EARLY_CLOCK_BIT) {
 			x -= 32;
-			while (count > 0 && x < 0) {
-				if (count & inc_mask)
-					mask <<= 1;
-				++x;
-				count--;
+			if (x <= -32)
+				continue;
+			if (x < 0) {
+				m <<= -x;
+				x = 0;
 			}
 		}
-		while (count > 0) {
-			if (mask & 0x8000) {
-				if (f != 0)  // don't draw transparent color
-					buf[x] = c;
-
-				// The first sprite to touch this x-coord will OR
-				// a zero in the status reg, but the next sprite to
-				// touch the same x-coord will OR the COINC flag.
-				reg[VDP_ST] |= coinc[x];
-				coinc[x] = SPRITE_COINC;
-			}
-			if (count & inc_mask)
-				mask <<= 1;
-			if (++x >= 256)
-				break;
-			count--;
+		if (x > 256 - 32)
+			m &= ~0u << (x - (256 - 32)); // clip at right edge
+		if (!m)
+			continue;
+
+		// The first sprite to touch this x-coord will set a bit
+		// in occ, and the next sprite to touch it sets the COINC flag.
+		if (real && sprite_coinc(occ, x, m))
+			reg[VDP_ST] |= SPRITE_COINC;
+
+		if (f & 15) { // don't draw transparent color
+			u8 *b = buf + x;
+			do {
+				int i = __builtin_clz(m);
+				b[i] = c;
+				m &= ~(0x80000000u >> i);
+			} while (m);
 		}
 	}
 }
@@ -1025,11 +1036,16 @@ void vdp_line(unsigned int line,
 	}
 }
 
+// Redraw the whole screen from VRAM without touching VDP status,
+// since draw_sprites() updates 5th sprite and coincidence bits
 void vdp_redraw(void)
 {
+	u8 reg[sizeof(vdp.reg)];
 	int y;
+
+	memcpy(reg, vdp.reg, sizeof(reg));
 	for (y = 0; y < 240; y++) {
-		vdp_line(y, vdp.reg, vdp.ram);
+		vdp_line(y, reg, vdp.ram);
 	}
 }
 
@@ -1115,8 +1131,9 @@ void vdp_write_data(u8 value)
 {
 #ifdef ENABLE_F18A
 	if (!f18a_unlocked()) {
-		// original ram write
+		// original ram write, also loads the read-ahead buffer
 		vdp.ram[vdp.a] = value;
+		vdp.buf = value;
 		vdp.a = (vdp.a + 1) & 0x3fff; // wraps at 16K
 		vdp.latch = 0;
 
@@ -1124,6 +1141,7 @@ void vdp_write_data(u8 value)
 		// f18a ram write - use increment
 		signed char inc = vdp.reg[48];
 		vdp.ram[vdp.a] = value;
+		vdp.buf = value;
 		vdp.a = (vdp.a + inc) & 0x3fff; // wraps at 16K
 		vdp.latch = 0;
 
@@ -1148,6 +1166,7 @@ void vdp_write_data(u8 value)
 	}
 #else
 	vdp.ram[vdp.a] = value;
+	vdp.buf = value;
 	vdp.a = (vdp.a + 1) & 0x3fff; // wraps at 16K
 	vdp.latch = 0;
 #endif
@@ -1287,9 +1306,10 @@ void vdp_write_addr(u8 value)
 		vdp.a |= (value & 0x3f) << 8;
 		//debug_log("VDP address for write %04X\n", vdp.a);
 	} else {
-		// set address for data read
+		// set address for data read, and prefetch into read-ahead buffer
 		vdp.a |= (value & 0x3f) << 8;
-		// FIXME: this should start reading the data and increment the address
+		vdp.buf = vdp.ram[vdp.a];
+		vdp.a = (vdp.a + 1) & 0x3fff;
 		//debug_log("VDP address for read %04X at PC=%04X\n", vdp.a, get_pc());
 	}
 }
@@ -1346,15 +1366,30 @@ u8 vdp_read_status_safe(void) // no clearing flags
 #endif
 }
 
+// returns the read-ahead buffer, then refills it and increments the address
 u8 vdp_read_data(void)
 {
-	return vdp.ram[vdp.a++ & 0x3fff];
-	//vdp.a = (vdp.a+1) & 0x3fff;
+	u8 value = vdp.buf;
+	vdp.buf = vdp.ram[vdp.a];
+	vdp.a = (vdp.a + 1) & 0x3fff;
+	return value;
+}
+
+u8 vdp_read_data_safe(void) // no prefetch
+{
+	return vdp.buf;
 }
 
-u8 vdp_read_data_safe(void) // no post_increment
+// Minimum CPU cycles between VRAM accesses at the current scanline,
+// from the 9918A access windows: 2us in blanking, 8us during active
+// graphics/multicolor display, 6us during active text mode
+int vdp_access_cycles(void)
 {
-	return vdp.ram[vdp.a & 0x3fff];
+	if (vdp.y < TOPBORD || vdp.y >= TOPBORD+24*8 || (vdp.reg[1] & 0x40) == 0)
+		return 6;
+	if (vdp.reg[1] & 0x10)
+		return 18; // text mode
+	return 24;
 }
 
 
@@ -1369,6 +1404,52 @@ u8 vdp_read_data_safe(void) // no post_increment
 // 9551.536269093521 gpu cycles per line
 #define CYCLES_PER_LINE 9552
 
+// Idle loops: a backward jump that gets back to the same loop head with the
+// same registers and flags as last time, and no memory written in between,
+// would keep doing that until the next scanline, since nothing else changes
+// what the GPU can read during gpu().  Such loops jump straight to the end
+// of the line instead, ending up at the loop head.
+static u16 loop_pc = 1; // odd, never a jump target
+static u16 loop_regs[16], loop_st;
+static int loop_wrote = 0; // memory written since arriving at loop_pc
+
+#ifdef GPU_PROFILE
+enum {
+	POLL_SCANLINE = 1, // >7000 current scanline and blanking
+	POLL_STATUS = 2,   // >B000 status registers
+};
+static u32 prof_hits[0x8000]; // per word address
+static u64 prof_cycles[0x8000];
+static u64 prof_idle[0x8000]; // cycles skipped at each idle loop head
+static u8 prof_poll[0x8000]; // POLL_* read by each idle loop
+static u8 loop_poll = 0; // POLL_* since arriving at loop_pc
+static u16 prof_pc;
+static int prof_cyc, prof_timing = 0;
+static u64 frame_used, frame_idle; // cycles this frame
+static u64 total_used, total_idle, total_lines, frames;
+static int frame_lines; // gpu() calls this frame, running or not
+static u32 frame_busy_hist[11]; // frames by busy percent, in 10% steps
+static void gpu_profile(void);
+
+// charge the cycles since the last instruction started to it
+#define PROFILE_INSN(pc) do { \
+	if (prof_timing) prof_cycles[prof_pc >> 1] += cyc - prof_cyc; \
+	prof_hits[(pc) >> 1]++; \
+	prof_pc = (pc); prof_cyc = cyc; prof_timing = 1; } while (0)
+#define PROFILE_END() do { \
+	if (prof_timing) prof_cycles[prof_pc >> 1] += cyc - prof_cyc; \
+	prof_timing = 0; } while (0)
+#define PROFILE_POLL(kind) (loop_poll |= (kind))
+#define PROFILE_IDLE(pc, n) do { \
+	prof_idle[(pc) >> 1] += (n); prof_poll[(pc) >> 1] |= loop_poll; \
+	frame_idle += (n); prof_cyc += (n); } while (0)
+#else
+#define PROFILE_INSN(pc) do { } while (0)
+#define PROFILE_END() do { } while (0)
+#define PROFILE_POLL(kind) do { } while (0)
+#define PROFILE_IDLE(pc, n) do { } while (0)
+#endif
+
 
 /*
 New or modified instructions for the F18A 9900-based GPU
@@ -1439,11 +1520,13 @@ static u16 mem_r(u16 address)
 	case 6: // VREG
 		address &= 0x3f; return (vdp.reg[address] << 8) | vdp.reg[address+1];
 	case 7: // 0=current scanline 1=blanking
+		PROFILE_POLL(POLL_SCANLINE);
 		if (vdp.y < 192) return vdp.y << 8; // scanline=y blanking=0
 		return 1; // scanline=0 blanking=1
 	case 0xa: // F18A version
 		return F18A_VER;
 	case 0xb: // GPU status
+		PROFILE_POLL(POLL_STATUS);
 		address &= 0x0f;
 		return (vdp_read_status_reg(address) << 8) |
 			vdp_read_status_reg(address+1);
@@ -1458,6 +1541,7 @@ static void mem_w(u16 address, u16 value)
 {
 	u8 hi = value >> 8, lo = value & 0xff;
 	//printf("vdp_mem_w: %04x %04x\n", address, value);
+	loop_wrote = 1;
 	address &= ~1; // word aligned
 	if (address <= 0x47FF) { // VRAM
 		vdp.ram[address] = hi;
@@ -1780,7 +1864,7 @@ static always_inline void Td_post_increment(u16 op, struct val_addr va, int byte
 
 static always_inline void mem_w_Td(u16 op, struct val_addr va)
 {
-	if ((op >> 3) == 0)
+	if (((op >> 4) & 3) == 0) // Rx
 		reg_w(op & 15, va.val);
 	else
 		mem_w(va.addr, va.val);
@@ -1789,7 +1873,7 @@ static always_inline void mem_w_Td(u16 op, struct val_addr va)
 
 static always_inline void mem_w_TdB(u16 op, struct val_addr va)
 {
-	if ((op >> 3) == 0)
+	if (((op >> 4) & 3) == 0) // Rx
 		reg_w(op & 15, va.val);
 	else
 		mem_w(va.addr, va.val);
@@ -1824,28 +1908,56 @@ static always_inline void word_op(u16 *op, u16 *pc, u16 *ts, struct val_addr *td
 static int gpu_disasm(u16 pc);
 static char gpu_text[256];
 
-void gpu(void)
+#ifdef ENABLE_DEBUGGER
+static u8 gpu_brk[0x10000 / 16]; // one bit per word
+static int gpu_brk_count = 0;
+static int gpu_brk_skip = -1; // resuming from the breakpoint here
+static int gpu_brk_stop = 0;
+#endif
+
+// Called on backward jumps with cfg.gpu_idle_skip, returns 1 if the GPU is
+// in an idle loop.  Skipping the rest of the scanline is not cycle exact:
+// the GPU resumes at the loop head, not partway into an iteration, so code
+// that counts cycles after the loop exits can see a different phase.
+static int gpu_idle_loop(u16 pc)
+{
+	if (pc == loop_pc && !loop_wrote && loop_st == get_g_st() &&
+	    memcmp(loop_regs, wp_regs, sizeof(wp_regs)) == 0)
+		return 1;
+	loop_pc = pc;
+	memcpy(loop_regs, wp_regs, sizeof(wp_regs));
+	loop_st = get_g_st();
+	loop_wrote = 0;
+#ifdef GPU_PROFILE
+	loop_poll = 0;
+#endif
+	return 0;
+}
+
+// Run until the cycle counter goes positive
+static void gpu_run(void)
 {
 	u16 op, pc = gPC;
 	u16 ts;
 	struct val_addr td;
 
-	if (gpu_paused()) { // GPU not executing
-		if ((vdp.reg[50] & 0x40) && vdp.y < 240 ) // GPU_HTRIG
-			gpu_trigger();
-		else if ((vdp.reg[50] & 0x20) && vdp.y == 246) // GPU_VTRIG
-			gpu_trigger();
-		else
-			return;  // GPU not executing
-	}
-
-	cyc = -CYCLES_PER_LINE;
-
 decode_op:
 	// when cycle counter rolls positive, go out and render a scanline
 	if (cyc > 0)
 		goto done;
 decode_op_now:
+#ifdef ENABLE_DEBUGGER
+	if (gpu_brk_count && (gpu_brk[pc >> 4] & (1 << ((pc >> 1) & 7)))) {
+		if (pc != gpu_brk_skip) {
+			gpu_brk_skip = pc;
+			gpu_brk_stop = 1;
+			set_break(DEBUG_STOP);
+			goto done;
+		}
+		gpu_brk_skip = -1;
+	}
+#endif
+	PROFILE_INSN(pc);
 
 	op = mem_r(pc);
 	// if this mem read triggers a breakpoint, it will save the cycles
@@ -2001,7 +2113,13 @@ execute_op:
 
 
 
-        JMP: case DECODE(0x1000): cyc += 2; pc += 2 * (s8)(op & 0xff); goto decode_op;
+        JMP: case DECODE(0x1000): cyc += 2; pc += 2 * (s8)(op & 0xff);
+		if ((s8)op < 0 && cfg.gpu_idle_skip && gpu_idle_loop(pc)) {
+			PROFILE_IDLE(pc, 1 - cyc);
+			cyc = 1;
+			goto done;
+		}
+		goto decode_op;
         JLT: case DECODE(0x1100): if (tst_LT()) goto JMP; goto decode_op;
         JLE: case DECODE(0x1200): if (tst_LE()) goto JMP; goto decode_op;
         JEQ: case DECODE(0x1300): if (tst_EQ()) goto JMP; goto decode_op;
@@ -2158,10 +2276,162 @@ execute_op:
 		goto decode_op;
 	}
 done:
+	PROFILE_END();
 	gPC = pc;
 	return;
 }
 
+#ifdef GPU_PROFILE
+static void profile_frame(void)
+{
+	static int once = 1;
+	u64 busy = frame_used - frame_idle;
+
+	if (once) { // nothing to count before the first frame
+		atexit(gpu_profile);
+		once = 0;
+		frame_used = frame_idle = frame_lines = 0;
+		return;
+	}
+	if (frame_lines)
+		frame_busy_hist[busy * 10 / ((u64)frame_lines * CYCLES_PER_LINE)]++;
+	total_used += frame_used;
+	total_idle += frame_idle;
+	total_lines += frame_lines;
+	frames++;
+	frame_used = frame_idle = frame_lines = 0;
+}
+
+// print where the GPU spends its time, like FUSION_STATS does for pairs
+static void gpu_profile(void)
+{
+	u64 total = total_lines * CYCLES_PER_LINE; // counted, vdp.y wraps at 256
+	u64 busy = total_used - total_idle;
+	int i, n;
+
+	if (!total_used)
+		return;
+	printf("GPU: %llu frames, busy %.1f%%, idle loops %.1f%%, halted %.1f%%\n",
+		frames, 100.0 * busy / total, 100.0 * total_idle / total,
+		100.0 * (total - total_used) / total);
+	printf("frames by busy time:");
+	for (i = 0; i < 11; i++)
+		if (frame_busy_hist[i])
+			printf(" %d%%:%u", i * 10, frame_busy_hist[i]);
+	printf("\n");
+
+	printf("GPU hot spots:\n     PC       hits     cycles\n");
+	for (n = 0; n < 20; n++) {
+		int best = 0;
+		for (i = 0; i < 0x8000; i++)
+			if (prof_cycles[i] > prof_cycles[best])
+				best = i;
+		if (!prof_cycles[best])
+			break;
+		printf("  >%04X %10u %10llu %5.1f%%\n", best * 2, prof_hits[best],
+			prof_cycles[best], 100.0 * prof_cycles[best] / busy);
+		prof_cycles[best] = 0;
+	}
+
+	printf("GPU idle loops:\n     PC    skipped  polling\n");
+	for (n = 0; n < 10; n++) {
+		int best = 0;
+		for (i = 0; i < 0x8000; i++)
+			if (prof_idle[i] > prof_idle[best])
+				best = i;
+		if (!prof_idle[best])
+			break;
+		printf("  >%04X %10llu  %s%s\n", best * 2, prof_idle[best],
+			prof_poll[best] & POLL_SCANLINE ? "scanline " : "",
+			prof_poll[best] & POLL_STATUS ? "status" : "");
+		prof_idle[best] = 0;
+	}
+}
+#endif
+
+void gpu(void)
+{
+#ifdef GPU_PROFILE
+	if (vdp.y == 0)
+		profile_frame();
+	frame_lines++;
+#endif
+	if (gpu_paused()) { // GPU not executing
+		if ((vdp.reg[50] & 0x40) && vdp.y < 240 ) // GPU_HTRIG
+			gpu_trigger();
+		else if ((vdp.reg[50] & 0x20) && vdp.y == 246) // GPU_VTRIG
+			gpu_trigger();
+		else
+			return;  // GPU not executing
+	}
+
+	cyc = -CYCLES_PER_LINE;
+	loop_pc = 1; // the scanline has changed
+	gpu_run();
+#ifdef GPU_PROFILE
+	frame_used += cyc + CYCLES_PER_LINE;
+#endif
+}
+
+
+#ifdef ENABLE_DEBUGGER
+/******************************************
+ * Debugger access, for gdb.c             *
+ ******************************************/
+
+// n = 0-15 for R0-R15, or GPU_REG_PC, GPU_REG_ST
+u16 gpu_get_reg(int n)
+{
+	if (n < 16)
+		return wp_regs[n];
+	return n == GPU_REG_PC ? gPC : get_g_st();
+}
+
+void gpu_set_reg(int n, u16 value)
+{
+	if (n < 16)
+		wp_regs[n] = value;
+	else if (n == GPU_REG_PC)
+		gPC = value;
+	else
+		set_g_st(value);
+}
+
+// the GPU's view of memory, reads have no side effects
+u16 gpu_mem_r(u16 address) { return mem_r(address); }
+void gpu_mem_w(u16 address, u16 value) { mem_w(address, value); }
+
+int gpu_step(void)
+{
+	if (gpu_paused())
+		return -1;
+	cyc = 0; // returns after one instruction
+	loop_pc = 1;
+	gpu_run();
+	return 0;
+}
+
+void gpu_set_breakpoint(u16 address, int enable)
+{
+	u8 *p = &gpu_brk[address >> 4], bit = 1 << ((address >> 1) & 7);
+
+	if (enable && !(*p & bit)) {
+		*p |= bit;
+		gpu_brk_count++;
+	} else if (!enable && (*p & bit)) {
+		*p &= ~bit;
+		gpu_brk_count--;
+	}
+}
+
+int gpu_break_hit(void)
+{
+	int hit = gpu_brk_stop;
+	gpu_brk_stop = 0;
+	return hit;
+}
+#endif // ENABLE_DEBUGGER
+
 
 
 static const char **names[] = {
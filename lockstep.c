@@ -0,0 +1,711 @@
+/*
+ *  lockstep.c - run the fast paths against the reference interpreter
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE // sched_setaffinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include "cpu.h"
+#include "bulwip.h"
+
+// Runs the reference interpreter and each optimized engine side by side,
+// each in its own process pinned to its own core, starting from the same
+// snapshot.  Every interval their state hashes are compared, and on a
+// mismatch it bisects on CPU cycles down to the first instruction whose
+// result differs, and writes each engine's state there as text.
+//
+// Build with "make lockstep".  Engines must be cycle exact, since all the
+// state is compared.  The floating point HLE (cfg.fp_hle) is not, it takes
+// fewer cycles by design, so it has its own check with -F instead.
+
+static const struct engine {
+	const char *name;
+	int no_fusion;
+} engines[] = {
+	{"ref", 1},    // plain instruction dispatch, the reference
+	{"fusion", 0}, // instruction pairs dispatched directly (ENABLE_FUSION)
+};
+
+#define ENGINES ARRAY_SIZE(engines)
+
+struct result {
+	u64 hash;
+	size_t size; // of the snapshot
+	long cycles; // actually run
+};
+
+static struct bulwip *b;
+static long cycles_per_frame; // see frame_cycles()
+static int ncpu = 1;
+static unsigned int key_seed = 0; // 0=no keys pressed
+
+
+static u64 hash(const void *buf, size_t size)
+{
+	const u8 *p = buf;
+	u64 h = 14695981039346656037ULL; // FNV-1a
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = read(fd, buf, size);
+		if (n <= 0)
+			return -1;
+		buf = (u8*)buf + n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n <= 0)
+			return -1;
+		buf = (const u8*)buf + n;
+		size -= n;
+	}
+	return 0;
+}
+
+// Same keys for every engine: one random key or none, changing each
+// interval, so that games get past their title screens
+static void set_keys(unsigned int seg)
+{
+	unsigned char keys[8] = {0};
+	u32 r = (key_seed + seg) * 2654435761u;
+
+	r ^= r >> 15;
+	if (key_seed && (r & 1)) {
+		int k = 8 + (r >> 1) % (TI_UP1 - 8 + 1); // no FCTN/SHIFT/CTRL
+		keys[k >> 3] |= 1 << (k & 7);
+	}
+	bulwip_set_keys(b, keys);
+}
+
+// In a child process: switch to engine e on its own core
+static void engine_start(unsigned int e, int slot)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(slot % ncpu, &set);
+	sched_setaffinity(0, sizeof(set), &set); // only a hint
+	cfg.no_fusion = engines[e].no_fusion;
+}
+
+// Fork a child with a pipe back to the parent, returns its pid
+static pid_t spawn(int *fd)
+{
+	int p[2];
+	pid_t pid;
+
+	if (pipe(p) != 0) {
+		perror("pipe");
+		exit(2);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(2);
+	}
+	if (pid == 0) {
+		close(p[0]);
+		*fd = p[1];
+	} else {
+		close(p[1]);
+		*fd = p[0];
+	}
+	return pid;
+}
+
+static void save(void **buf, size_t *size)
+{
+	*size = bulwip_save_state(b, NULL, 0);
+	*buf = realloc(*buf, *size);
+	bulwip_save_state(b, *buf, *size);
+}
+
+// Cycles given to the CPU up to the current line, without how far into
+// (or past) the line it has run
+static u64 line_cycles(void)
+{
+	return get_total_cpu_cycles() - add_cyc(0);
+}
+
+// Frames are whatever run_line makes them, which is 256 lines while vdp.y
+// is a u8, not the 262 of NTSC.  So measure one, and put the state back.
+static long frame_cycles(void)
+{
+	void *state = NULL;
+	size_t size;
+	u64 start;
+
+	save(&state, &size);
+	bulwip_run_frame(b); // to the start of a frame
+	start = line_cycles();
+	bulwip_run_frame(b);
+	start = line_cycles() - start;
+	bulwip_load_state(b, state, size);
+	free(state);
+	return start;
+}
+
+
+/****************************************
+ * Bisect                               *
+ ****************************************/
+
+// Run every engine from the snapshot for each of n cycle counts at once,
+// one process per core.  Returns the index of the first count where any
+// engine disagrees with the reference, or n if they all agree.
+// With dump set, writes lockstep_<engine>.txt for each engine.
+static int probe(const void *state, size_t size, unsigned int seg,
+		const long *cycles, int n, int dump)
+{
+	struct result res[n][ENGINES];
+	int fd[n][ENGINES];
+	pid_t pid[n][ENGINES];
+	int i, bad = n;
+	unsigned int e;
+
+	for (i = 0; i < n; i++) {
+		for (e = 0; e < ENGINES; e++) {
+			pid[i][e] = spawn(&fd[i][e]);
+			if (pid[i][e] == 0) {
+				void *buf = NULL;
+				struct result r;
+				char name[64];
+
+				engine_start(e, i * ENGINES + e);
+				bulwip_load_state(b, state, size);
+				set_keys(seg);
+				r.cycles = bulwip_run_cycles(b, cycles[i]);
+				save(&buf, &r.size);
+				r.hash = hash(buf, r.size);
+				if (dump) {
+					snprintf(name, sizeof(name), "lockstep_%s.txt", engines[e].name);
+					bulwip_dump_state(buf, r.size, name);
+				}
+				write_all(fd[i][e], &r, sizeof(r));
+				_exit(0);
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		for (e = 0; e < ENGINES; e++) {
+			if (read_all(fd[i][e], &res[i][e], sizeof(struct result)) != 0) {
+				fprintf(stderr, "%s engine died at cycle %ld of interval %u\n",
+					engines[e].name, cycles[i], seg);
+				exit(2);
+			}
+			close(fd[i][e]);
+			waitpid(pid[i][e], NULL, 0);
+			if (i < bad && res[i][e].hash != res[i][0].hash)
+				bad = i;
+		}
+	}
+	return bad;
+}
+
+// The engines agree at the snapshot and disagree after hi cycles.
+// Narrow down to the first instruction that makes the difference.
+// That needs the difference to show again when run from the snapshot,
+// it may not if it depends on something the snapshot doesn't hold.
+static void bisect(const void *state, size_t size, unsigned int seg, long hi)
+{
+	int n = ncpu / ENGINES > 1 ? ncpu / ENGINES : 1;
+	long lo = 0, cycles[n];
+	int i, k;
+
+	if (probe(state, size, seg, &hi, 1, 0) == 1) {
+		printf("could not locate it: the engines agree when interval %u "
+			"is run again from its snapshot\n", seg);
+		return;
+	}
+	while (hi - lo > 1) {
+		k = hi - lo - 1 < n ? hi - lo - 1 : n;
+		for (i = 0; i < k; i++)
+			cycles[i] = lo + (hi - lo) * (i + 1) / (k + 1);
+		i = probe(state, size, seg, cycles, k, 0);
+		if (i < k)
+			hi = cycles[i];
+		if (i > 0)
+			lo = cycles[i - 1];
+	}
+
+	// show the instruction from the last state that agrees
+	bulwip_load_state(b, state, size);
+	set_keys(seg);
+	cfg.no_fusion = engines[0].no_fusion;
+	bulwip_run_cycles(b, lo);
+	disasm(get_pc(), 0);
+	printf("first difference after %ld cycles into interval %u, at:\n%s",
+		lo, seg, asm_text);
+
+	if (probe(state, size, seg, &hi, 1, 1) == 1) {
+		printf("could not locate it: the engines agree at that "
+			"instruction when run again\n");
+		return;
+	}
+	printf("states after it written to");
+	for (i = 0; i < (int)ENGINES; i++)
+		printf(" lockstep_%s.txt", engines[i].name);
+	printf("\n");
+}
+
+
+/****************************************
+ * Floating point                       *
+ ****************************************/
+
+// With -F: call each console ROM floating point routine and its native
+// version in radix100.c on the same random operands, and compare FAC,
+// the error code, the value stack pointer and the VDP port state.  CSN
+// gets random number strings.  Then the GPL routines (CNS, SQR, EXP and
+// the rest) are checked as the ROM runs them for a TI BASIC program, see
+// fp_gpl_check.
+
+#define FAC     0x834A
+#define ARG     0x835C
+#define FAC12   0x8356 // CSN string address
+#define ERRCOD  0x8354
+#define VSPTR   0x836E
+#define GPL_WS  0x83E0 // the routines run in the GPL interpreter's workspace
+#define XML_TABLES 0x0CFA
+#define FP_STACK 0x0F00 // VDP address to pop ARG from
+#define FP_STEPS 100000 // instructions before giving up on a routine
+
+extern void set_pc(u16 pc); // cpu.c
+extern void set_wp(u16 wp);
+extern void set_st(u16 st);
+
+static const struct {
+	u8 xml;
+	u8 stack; // ARG is popped from the VDP value stack
+	const char *name;
+} fp_ops[] = {
+	{0x06, 0, "FADD"}, {0x07, 0, "FSUB"}, {0x08, 0, "FMUL"}, {0x09, 0, "FDIV"},
+	{0x0B, 1, "SADD"}, {0x0C, 1, "SSUB"}, {0x0D, 1, "SMUL"}, {0x0E, 1, "SDIV"},
+	{0x10, 0, "CSN"},
+};
+
+struct fp_result {
+	u8 fac[8];
+	u8 err;
+	u16 vsptr;
+	u16 fac12;
+	u16 vdp_a;
+	u8 vdp_buf, vdp_latch;
+	u8 returned;
+};
+
+static u32 fp_rand(u32 *r)
+{
+	*r ^= *r << 13; // xorshift32
+	*r ^= *r >> 17;
+	*r ^= *r << 5;
+	return *r;
+}
+
+// A random number: sometimes zero, mostly near 1 so sums interact,
+// sometimes near overflow or underflow
+static void fp_random(u8 *v, u32 *r)
+{
+	int i;
+
+	memset(v, 0, 8);
+	if (fp_rand(r) % 16 == 0)
+		return;
+	v[0] = fp_rand(r) % 4 ? 64 - 10 + fp_rand(r) % 21 : fp_rand(r) % 128;
+	v[1] = 1 + fp_rand(r) % 99;
+	for (i = 2; i < 8; i++)
+		v[i] = fp_rand(r) % 100;
+	if (fp_rand(r) & 1) {
+		u16 w = -((v[0] << 8) | v[1]);
+		v[0] = w >> 8;
+		v[1] = w & 0xff;
+	}
+}
+
+// A number as BASIC stores it, with up to 16 digits so some need
+// rounding, followed by the end of the line or a token
+static void fp_random_string(char *s, u32 *r)
+{
+	int i, n = 1 + fp_rand(r) % 16, point = fp_rand(r) % (n + 2);
+	char *p = s;
+
+	if (fp_rand(r) % 4 == 0)
+		*p++ = fp_rand(r) & 1 ? '-' : '+';
+	for (i = 0; i < n; i++) {
+		if (i == point)
+			*p++ = '.';
+		*p++ = '0' + (i == 0 && fp_rand(r) % 2 ? 0 : fp_rand(r) % 10);
+	}
+	if (fp_rand(r) % 3 == 0)
+		p += sprintf(p, "E%s%d", fp_rand(r) & 1 ? "-" : "",
+			(int)(fp_rand(r) % 140));
+	*p++ = fp_rand(r) & 1 ? 0 : 0xB3; // or a comma token
+	*p = 0;
+}
+
+// Call the routine at entry like XML does, and return through R11 to 0
+static void fp_call(const void *state, size_t size, u16 entry, int stack,
+		const u8 *arg, const u8 *fac, const char *str,
+		struct fp_result *res)
+{
+	int i;
+
+	memset(res, 0, sizeof(*res)); // compared with memcmp
+	bulwip_load_state(b, state, size);
+	fp_hle_update();
+	for (i = 0; i < 8; i += 2) {
+		cpu_mem_w(FAC + i, (fac[i] << 8) | fac[i+1]);
+		if (!stack)
+			cpu_mem_w(ARG + i, (arg[i] << 8) | arg[i+1]);
+	}
+	if (stack) {
+		memcpy(vdp.ram + FP_STACK, arg, 8);
+		cpu_mem_w(VSPTR, FP_STACK);
+	}
+	if (str) {
+		memcpy(vdp.ram + FP_STACK, str, strlen(str) + 1);
+		cpu_mem_w(FAC12, FP_STACK);
+	}
+	cpu_mem_w(ERRCOD, cpu_mem_r(ERRCOD) & 0x00ff);
+	set_wp(GPL_WS);
+	cpu_mem_w(GPL_WS + 2*11, 0);
+	set_st(get_st() & ~0xf); // no interrupts
+	set_pc(entry);
+	for (i = 0; i < FP_STEPS && get_pc() != 0; i++)
+		single_step();
+
+	res->returned = get_pc() == 0;
+	for (i = 0; i < 8; i += 2) {
+		u16 w = safe_r(FAC + i);
+		res->fac[i] = w >> 8;
+		res->fac[i+1] = w & 0xff;
+	}
+	res->err = safe_r(ERRCOD) >> 8;
+	res->vsptr = safe_r(VSPTR);
+	res->fac12 = safe_r(FAC12);
+	res->vdp_a = vdp.a;
+	res->vdp_buf = vdp.buf;
+	res->vdp_latch = vdp.latch;
+}
+
+static void fp_print(const char *name, const u8 *v)
+{
+	int i;
+
+	printf(" %s ", name);
+	for (i = 0; i < 8; i++)
+		printf("%02X", v[i]);
+}
+
+// Returns the number of mismatches
+static long fp_test(long count)
+{
+	void *state = NULL;
+	size_t size;
+	u32 r = 1;
+	long i, bad = 0;
+	unsigned int op;
+
+	save(&state, &size);
+	for (op = 0; op < ARRAY_SIZE(fp_ops); op++) {
+		u16 table = safe_r(XML_TABLES);
+		u16 entry = safe_r(table + 2 * fp_ops[op].xml);
+		long n = 0;
+
+		cfg.fp_hle = FP_HLE_CYCLES;
+		fp_hle_unchecked = 1; // every group, checked or not
+		fp_hle_update();
+		if (safe_r(entry) != HLE_FP) {
+			fprintf(stderr, "the console ROM and GROM are not ones radix100.c knows\n");
+			cfg.fp_hle = 0;
+			fp_hle_unchecked = 0;
+			fp_hle_update();
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			struct fp_result rom, native;
+			u8 arg[8], fac[8];
+			char str[32], *s = NULL;
+
+			fp_random(arg, &r);
+			fp_random(fac, &r);
+			if (fp_ops[op].xml == 0x10)
+				fp_random_string(s = str, &r);
+			cfg.fp_hle = 0;
+			fp_call(state, size, entry, fp_ops[op].stack, arg, fac, s, &rom);
+			cfg.fp_hle = FP_HLE_CYCLES;
+			fp_call(state, size, entry, fp_ops[op].stack, arg, fac, s, &native);
+			if (!memcmp(&rom, &native, sizeof(rom)))
+				continue;
+			if (n++ < 10) {
+				printf("%s", fp_ops[op].name);
+				if (s)
+					printf(" \"%.*s\"", (int)strcspn(s, "\xb3"), s);
+				fp_print("ARG", arg);
+				fp_print("FAC", fac);
+				fp_print("ROM", rom.fac);
+				fp_print("native", native.fac);
+				printf(" err %02X/%02X vsptr %04X/%04X fac12 %04X/%04X vdp %04X,%02X,%d/%04X,%02X,%d%s\n",
+					rom.err, native.err, rom.vsptr, native.vsptr,
+					rom.fac12, native.fac12,
+					rom.vdp_a, rom.vdp_buf, rom.vdp_latch,
+					native.vdp_a, native.vdp_buf, native.vdp_latch,
+					rom.returned ? "" : " (ROM routine didn't return)");
+			}
+		}
+		printf("%s: %ld of %ld differ\n", fp_ops[op].name, n, count);
+		bad += n;
+	}
+	cfg.fp_hle = 0;
+	fp_hle_update();
+	bulwip_load_state(b, state, size);
+	free(state);
+	return bad;
+}
+
+// Every GPL routine, with arguments from about .001 to 5000
+static const char fp_program[] =
+	"100 RANDOMIZE 1\n"
+	"110 X=(RND-.5)*10^INT(RND*8-2)\n"
+	"120 A=SQR(ABS(X))\n"
+	"130 A=EXP(X/1000)\n"
+	"140 A=LOG(ABS(X)+.001)\n"
+	"150 A=COS(X)+SIN(X)+TAN(X)+ATN(X)\n"
+	"160 PRINT X;A\n"
+	"170 GOTO 110\n";
+
+static void press(int key)
+{
+	unsigned char keys[8] = {0};
+	int i;
+
+	keys[key >> 3] = 1 << (key & 7);
+	bulwip_set_keys(b, keys);
+	for (i = 0; i < 4; i++)
+		bulwip_run_frame(b);
+	memset(keys, 0, sizeof(keys));
+	bulwip_set_keys(b, keys);
+	for (i = 0; i < 4; i++)
+		bulwip_run_frame(b);
+}
+
+// Run fp_program in TI BASIC for frames with the GPL routines checked.
+// Returns the number of mismatches.
+static long fp_basic_test(long frames)
+{
+	char name[] = "/tmp/lockstepXXXXXX";
+	int fd = mkstemp(name), ok;
+	long i, bad;
+
+	if (fd == -1 || write(fd, fp_program, sizeof(fp_program) - 1) < 0) {
+		perror(name);
+		return -1;
+	}
+	close(fd);
+	press(TI_SPACE); // title screen
+	for (i = 0; i < 60; i++)
+		bulwip_run_frame(b);
+	press(TI_1); // TI BASIC
+	for (i = 0; i < 120; i++)
+		bulwip_run_frame(b);
+	ok = bulwip_load_basic(b, name) == 0;
+	unlink(name);
+	if (!ok) {
+		fprintf(stderr, "can't load the BASIC program\n");
+		return -1;
+	}
+	press(TI_R);
+	press(TI_U);
+	press(TI_N);
+	fp_hle_unchecked = 1;
+	fp_gpl_check(1);
+	press(TI_ENTER);
+	for (i = 0; i < frames; i++)
+		bulwip_run_frame(b);
+	bad = fp_gpl_check(0);
+	fp_hle_unchecked = 0;
+	fp_hle_update();
+	return bad;
+}
+
+
+/****************************************
+ * Main                                 *
+ ****************************************/
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: lockstep [-f frames] [-i interval] [-k seed] [-r rom_dir] [cart.bin]\n"
+		"       lockstep -F count [-r rom_dir]\n"
+		"  -f  frames to run (default 600)\n"
+		"  -i  frames between comparisons (default 1)\n"
+		"  -k  press random keys, same for every engine\n"
+		"  -r  directory with 994arom.bin etc\n"
+		"  -F  compare the native floating point with the ROM's on count\n"
+		"      random operands per routine, then for the GROM routines\n"
+		"      while TI BASIC runs count frames, instead of the engines\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bulwip_config config = {};
+	long frames = 600, interval = 1, segs, seg, fp_count = 0;
+	void *state = NULL, *next = NULL;
+	size_t size;
+	int fd[ENGINES];
+	pid_t pid[ENGINES];
+	unsigned int e;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:i:k:r:F:")) != -1) {
+		switch (opt) {
+		case 'F': fp_count = atol(optarg); break;
+		case 'f': frames = atol(optarg); break;
+		case 'i': interval = atol(optarg); break;
+		case 'k': key_seed = atoi(optarg); break;
+		case 'r': config.rom_dir = optarg; break;
+		default: usage();
+		}
+	}
+	if (frames < 1 || interval < 1 || optind < argc - 1)
+		usage();
+#ifndef ENABLE_FUSION
+	fprintf(stderr, "built without ENABLE_FUSION, the engines are the same\n");
+#endif
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+
+	b = bulwip_create(&config);
+	if (!b)
+		return 2;
+	if (optind < argc && bulwip_load_cart(b, argv[optind]) != 0) {
+		fprintf(stderr, "can't load %s\n", argv[optind]);
+		return 2;
+	}
+	if (fp_count > 0) {
+		long bad;
+
+		// let the GPL interpreter set up its workspace first
+		for (seg = 0; seg < 60; seg++)
+			bulwip_run_frame(b);
+		bad = fp_test(fp_count);
+		if (bad >= 0) {
+			long gpl = fp_basic_test(fp_count);
+
+			bad = gpl < 0 ? gpl : bad + gpl;
+		}
+		if (bad < 0)
+			return 2;
+		printf(bad ? "%ld results differ\n" : "all results match\n", bad);
+		return bad != 0;
+	}
+	cycles_per_frame = frame_cycles();
+	save(&state, &size);
+	segs = (frames + interval - 1) / interval;
+	interval *= cycles_per_frame;
+
+	// each engine runs ahead on its own, the reference also sends its
+	// snapshots so there is one to bisect from
+	for (e = 0; e < ENGINES; e++) {
+		pid[e] = spawn(&fd[e]);
+		if (pid[e] == 0) {
+			struct result r;
+			void *buf = NULL;
+
+			engine_start(e, e);
+			for (seg = 0; seg < segs; seg++) {
+				set_keys(seg);
+				r.cycles = bulwip_run_cycles(b, interval);
+				save(&buf, &r.size);
+				r.hash = hash(buf, r.size);
+				if (write_all(fd[e], &r, sizeof(r)) != 0 ||
+				    (e == 0 && write_all(fd[e], buf, r.size) != 0))
+					break;
+			}
+			_exit(0);
+		}
+	}
+
+	for (seg = 0; seg < segs; seg++) {
+		struct result res[ENGINES];
+		void *t;
+		int bad = 0;
+
+		for (e = 0; e < ENGINES; e++) {
+			if (read_all(fd[e], &res[e], sizeof(res[e])) != 0) {
+				fprintf(stderr, "%s engine died in interval %ld\n",
+					engines[e].name, seg);
+				return 2;
+			}
+			if (res[e].hash != res[0].hash)
+				bad = 1;
+		}
+		next = realloc(next, res[0].size);
+		if (read_all(fd[0], next, res[0].size) != 0)
+			return 2;
+		if (bad) {
+			for (e = 0; e < ENGINES; e++)
+				kill(pid[e], SIGKILL);
+			printf("engines differ in frames %ld-%ld:",
+				seg * interval / cycles_per_frame,
+				(seg + 1) * interval / cycles_per_frame);
+			for (e = 1; e < ENGINES; e++)
+				if (res[e].hash != res[0].hash)
+					printf(" %s", engines[e].name);
+			printf("\n");
+			bisect(state, size, seg, interval);
+			return 1;
+		}
+		t = state;
+		state = next;
+		next = t;
+		size = res[0].size;
+	}
+	for (e = 0; e < ENGINES; e++)
+		waitpid(pid[e], NULL, 0);
+	printf("%ld frames, all %d engines agree\n", frames, (int)ENGINES);
+	return 0;
+}
@@ -29,14 +29,13 @@
 #define NO_ANTIALIAS -2147483648
 #define CLOCK_3_58MHZ 3579545
 //#define SAMPLE_FREQUENCY 44100
-#define SAMPLE_FREQUENCY 48000
+// SAMPLE_FREQUENCY is in cpu.h
 #define PERIODIC_NOISE_CYCLE 15
 #define CPU_CLK_FREQ 3000000
 
 static int reg[] = {1,0xf,1,0xf,1,0xf,1,0xf};
 static int regLatch = 0;
 static int freqCounter[] = {0,0,0,0};
-static int freqPos[] = {NO_ANTIALIAS,NO_ANTIALIAS,NO_ANTIALIAS};
 static int noiseFreq = 0x10;
 static int noiseShiftReg = SHIFT_RESET;
 static int freqPolarity[] = {1,1,1,1};
@@ -44,25 +43,20 @@ static int freqPolarity[] = {1,1,1,1};
 static double PSG_VOLUME[] = {25, 19.858206, 15.773934, 12.529681,
 	9.952679, 7.905694, 6.279716, 4.988156, 3.962233, 3.147314,
 	2.500000, 1.985821, 1.577393, 1.252968, 0.995268, 0};
-static int audioIn = 0; // from the CRU 
-
-static int clk = (CLOCK_3_58MHZ << SCALE) / 16 / SAMPLE_FREQUENCY;
-static int clkFrac = 0;
 
 static int dump_soundlist = 0;
 static unsigned char row[32];
 static int row_len = 0;
-static int duration = 0;
 
 // this determines the max number of bytes writable to the sound chip
 // during the duration of a audio frame (1024 samples or approx 21 ms at 48kHz)
 #define FIFO_SIZE 1024
 static unsigned char fifo_data[FIFO_SIZE] = {};
 static unsigned char fifo_gate[FIFO_SIZE] = {}; // 0=9199 1=audio gate
-static unsigned int fifo_timestamp[FIFO_SIZE] = {};
+static unsigned long long fifo_timestamp[FIFO_SIZE] = {}; // cpu cycles
 static unsigned int fifo_count = 0; // current fullness of the fifo
 
-static void snd_fifo(unsigned char value, unsigned char gate, unsigned int timestamp)
+static void snd_fifo(unsigned char value, unsigned char gate, unsigned long long timestamp)
 {
 	if (fifo_count >= FIFO_SIZE) return;
 	fifo_data[fifo_count] = value;
@@ -141,15 +135,15 @@ static void play_fifo(void)
 
 // get the next timestamp from the fifo and scale it from cpu cycles to sound chip cycles
 static void next_fifo(unsigned int *next,
-		unsigned int last_cpu_cycles, unsigned int current_cpu_cycles,
+		unsigned long long last_cpu_cycles, unsigned long long current_cpu_cycles,
 		unsigned int ticks)
 {
 	*next = 0;
 	while (fifo_count > 0 && current_cpu_cycles != last_cpu_cycles) {
-		unsigned int ts = fifo_timestamp[0];
+		unsigned long long ts = fifo_timestamp[0];
 		int rel = (int)(ts - last_cpu_cycles);
 		if (rel > 0) {
-			*next = rel * ticks / (current_cpu_cycles - last_cpu_cycles);
+			*next = rel * ticks / (unsigned int)(current_cpu_cycles - last_cpu_cycles);
 			break;
 		}
 		play_fifo();
@@ -158,12 +152,12 @@ static void next_fifo(unsigned int *next,
 
 
 #if 1
-static void update(unsigned char *buffer, int offset, int samplesToGenerate, unsigned int current_cpu_cycles)
+static void update(unsigned char *buffer, int offset, int samplesToGenerate, unsigned long long current_cpu_cycles)
 {
-	int sample = 0, i = 0;
+	int i = 0;
 	static double d = 0.0, v = 0.0;
 	static int enable = 0xf;
-	static unsigned int last_cpu_cycles = 0;
+	static unsigned long long last_cpu_cycles = 0;
 	unsigned int ticks = (unsigned int)samplesToGenerate * CLOCK_3_58MHZ / (SAMPLE_FREQUENCY * 16);
 	unsigned int next = 0;
 	unsigned int n = 0;
@@ -264,6 +258,10 @@ static void update(unsigned char *buffer, int offset, int samplesToGenerate, uns
 }
 
 #else
+static int freqPos[] = {NO_ANTIALIAS,NO_ANTIALIAS,NO_ANTIALIAS};
+static int clk = (CLOCK_3_58MHZ << SCALE) / 16 / SAMPLE_FREQUENCY;
+static int clkFrac = 0;
+
 static void update(signed char *buffer, int offset, int samplesToGenerate)
 {
 	int sample, i;
@@ -348,6 +346,10 @@ static void update(signed char *buffer, int offset, int samplesToGenerate)
 #endif
 
 
+#if 0
+// soundlist and WAV dumping, from the standalone player
+static int duration = 0;
+
 static void vsync()
 {
 	static int i = 0;
@@ -416,5 +418,6 @@ static void terminate_soundlist()
 	if (dump_soundlist)
 		putchar(0); // terminator
 }
+#endif
 
 
@@ -0,0 +1,873 @@
+/*
+ *  radix100.c - native floating point for the console ROM
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "cpu.h"
+
+// TI BASIC does its math with the console ROM floating point package,
+// reached through the GPL XML instruction, and with GPL routines in GROM 0
+// called through the vectors at its start.  Each FMUL or FDIV is thousands
+// of cycles of 9900 code, a SIN or LOG far more, so when cfg.fp_hle is set
+// the entry points are replaced and the operation is done here instead,
+// charging cfg.fp_hle cycles.
+//
+// XML entries come from the ROM's own XML table and are patched with
+// HLE_FP: FADD to SDIV, and CSN (>10, string to number).  CFI (>12) is
+// left to the ROM.  GPL entries are the GROM 0 vectors for CNS (number to
+// string) and SQR, EXP, LOG, COS, SIN, TAN and ATN.  Those are caught when
+// the interpreter sets the GROM address to the vector (fp_gpl), and it is
+// handed a GPL RTN instead of the vector's branch.
+//
+// Only console ROM and GROM pairs listed in known[] are patched, and only
+// the groups of entries lockstep -F has shown to match the ROM for that
+// pair.  A native routine can also decline (an error case, or a result it
+// can't round the same way), and then the ROM routine runs as usual.
+//
+// Numbers are 8 bytes: an excess-64 exponent byte and 7 base-100 digits,
+// value = d0.d1d2d3d4d5d6 * 100^(exp-64).  Negative numbers have the first
+// word negated, and zero has a zero first word.
+
+#define FAC    0x834A // floating point accumulator
+#define ARG    0x835C // second operand
+#define ERRCOD 0x8354 // error code, high byte
+#define FAC11  0x8355 // CNS: 0 for free format, then the string length
+#define FAC12  0x8356 // CSN: VDP address of the string, CNS: its address
+#define VSPTR  0x836E // VDP value stack pointer
+#define SUBSTK 0x8373 // GPL subroutine stack pointer, low byte
+#define VDPRD  0x8800 // VDP read data port
+#define VDPWA  0x8C02 // VDP write address port
+
+#define XML_TABLES 0x0CFA // ROM pointers to XML tables, table 0 is the ROM's
+#define GPL_RTN 0x00 // GPL return opcode
+
+#define ERR_OVERFLOW 0x01 // "NUMBER TOO BIG", also for division by zero
+
+#define MANT_MIN 1000000000000ULL // 7 digits, d0 != 0
+#define MANT_MAX 100000000000000ULL
+
+typedef unsigned __int128 u128;
+
+enum {
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_CSN,
+	OP_CNS, OP_SQR, OP_EXP, OP_LOG, OP_COS, OP_SIN, OP_TAN, OP_ATN };
+
+// groups of entries, enabled per ROM and GROM pair in known[]
+enum { FP_ARITH = 1, FP_CSN = 2, FP_CNS = 4, FP_FUNC = 8, FP_ALL = 15 };
+
+static const struct {
+	u8 xml;    // XML opcode, entry in table 0
+	u8 op;
+	u8 stack;  // ARG is popped from the VDP value stack
+	u8 group;
+} entries[] = {
+	{0x06, OP_ADD, 0, FP_ARITH}, // FADD  FAC = ARG + FAC
+	{0x07, OP_SUB, 0, FP_ARITH}, // FSUB  FAC = ARG - FAC
+	{0x08, OP_MUL, 0, FP_ARITH}, // FMUL  FAC = ARG * FAC
+	{0x09, OP_DIV, 0, FP_ARITH}, // FDIV  FAC = ARG / FAC
+	{0x0B, OP_ADD, 1, FP_ARITH}, // SADD
+	{0x0C, OP_SUB, 1, FP_ARITH}, // SSUB
+	{0x0D, OP_MUL, 1, FP_ARITH}, // SMUL
+	{0x0E, OP_DIV, 1, FP_ARITH}, // SDIV
+	{0x10, OP_CSN, 0, FP_CSN},   // CSN   FAC = the number at FAC12
+};
+
+static const struct {
+	u8 vector; // GROM 0 address
+	u8 op;
+	u8 group;
+	const char *name;
+} gpl_entries[] = {
+	{0x14, OP_CNS, FP_CNS, "CNS"}, // string for FAC at FAC12, length FAC11
+	{0x24, OP_SQR, FP_FUNC, "SQR"}, // FAC = f(FAC)
+	{0x26, OP_EXP, FP_FUNC, "EXP"},
+	{0x28, OP_LOG, FP_FUNC, "LOG"},
+	{0x2A, OP_COS, FP_FUNC, "COS"},
+	{0x2C, OP_SIN, FP_FUNC, "SIN"},
+	{0x2E, OP_TAN, FP_FUNC, "TAN"},
+	{0x30, OP_ATN, FP_FUNC, "ATN"},
+};
+
+// Console ROM and GROM dumps whose routines these match, by the CRC-32 of
+// the dumps as usually distributed (ROM as big-endian words), with the
+// groups checked with "lockstep -F".  Any other pair is left alone.  To
+// add one, list its CRCs (logged) and run lockstep -F, which tries every
+// group (fp_hle_unchecked).
+static const struct {
+	u32 rom, grom;
+	u8 groups;
+} known[] = {
+	{0xdb8f33e5, 0xaf5c2449, FP_ARITH}, // TI-99/4A
+};
+
+int fp_hle_unchecked = 0; // patch every group, for lockstep -F
+int fp_gpl_active = 0; // bulwip.c calls fp_gpl on GROM address writes
+
+static u16 *rom = NULL;
+static const u8 *grom = NULL;
+static int groups = 0; // checked for this ROM and GROM
+static u16 entry_addr[ARRAY_SIZE(entries)];
+static u16 entry_orig[ARRAY_SIZE(entries)];
+static int patched = 0; // groups patched
+
+struct fp {
+	int neg;
+	int exp; // of the first digit, -64..63
+	u64 mant; // 7 digits as an integer, 0 for zero
+};
+
+
+/****************************************
+ * Pack and unpack                      *
+ ****************************************/
+
+static struct fp fp_get(const u8 *b)
+{
+	struct fp f = {};
+	u16 w = (b[0] << 8) | b[1];
+	int i;
+
+	if (w == 0)
+		return f;
+	if (w & 0x8000) {
+		f.neg = 1;
+		w = -w;
+	}
+	f.exp = (w >> 8) - 64;
+	f.mant = w & 0xff;
+	for (i = 2; i < 8; i++)
+		f.mant = f.mant * 100 + b[i];
+	return f;
+}
+
+static void fp_put(u8 *b, struct fp f)
+{
+	u16 w;
+	int i;
+
+	memset(b, 0, 8);
+	if (f.mant == 0)
+		return;
+	for (i = 7; i >= 1; i--) {
+		b[i] = f.mant % 100;
+		f.mant /= 100;
+	}
+	w = ((f.exp + 64) << 8) | b[1];
+	if (f.neg)
+		w = -w;
+	b[0] = w >> 8;
+	b[1] = w & 0xff;
+}
+
+static void read_bytes(u16 addr, u8 *b, int len)
+{
+	int i;
+	for (i = 0; i < len; i += 2) {
+		u16 w = cpu_mem_r(addr + i);
+		b[i] = w >> 8;
+		b[i+1] = w & 0xff;
+	}
+}
+
+static void write_bytes(u16 addr, const u8 *b, int len)
+{
+	int i;
+	for (i = 0; i < len; i += 2)
+		cpu_mem_w(addr + i, (b[i] << 8) | b[i+1]);
+}
+
+
+/****************************************
+ * Arithmetic                           *
+ ****************************************/
+
+// Round a result r * 100^low to 7 digits.  Only the first digit past the
+// seventh counts, like the ROM's ROUND which adds 50 to the guard digit.
+static int fp_round(struct fp *f, u128 r, int low)
+{
+	u128 hi = (u128)MANT_MAX * 100;
+	u64 guard;
+
+	f->mant = 0;
+	if (r == 0)
+		return 0;
+	while (r >= hi) {
+		r /= 100;
+		low++;
+	}
+	while (r < hi / 100) {
+		r *= 100;
+		low--;
+	}
+	guard = r % 100;
+	f->mant = r / 100;
+	low++;
+	if (guard >= 50 && ++f->mant == MANT_MAX) {
+		f->mant = MANT_MIN;
+		low++;
+	}
+	f->exp = low + 6;
+
+	if (f->exp > 63) { // largest number with the right sign
+		f->exp = 63;
+		f->mant = MANT_MAX - 1;
+		return ERR_OVERFLOW;
+	}
+	if (f->exp < -64) // underflow is zero without an error
+		f->mant = 0;
+	return 0;
+}
+
+// Returns an error code, or 0
+static int fp_add(struct fp *res, struct fp a, struct fp b)
+{
+	struct fp t;
+	u128 ma, mb;
+	int k;
+
+	if (b.mant == 0) { *res = a; return 0; }
+	if (a.mant == 0) { *res = b; return 0; }
+	if (b.exp > a.exp || (b.exp == a.exp && b.mant > a.mant)) {
+		t = a; a = b; b = t;
+	}
+	k = a.exp - b.exp;
+	if (k > 7) { // too small to change the larger
+		*res = a;
+		return 0;
+	}
+	// one guard digit, b shifted right and truncated like the ROM does
+	ma = (u128)a.mant * 100;
+	mb = (u128)b.mant * 100;
+	while (k--)
+		mb /= 100;
+	res->neg = a.neg;
+	return fp_round(res, a.neg == b.neg ? ma + mb : ma - mb, a.exp - 7);
+}
+
+static int fp_mul(struct fp *res, struct fp a, struct fp b)
+{
+	res->neg = a.neg ^ b.neg;
+	if (a.mant == 0 || b.mant == 0) {
+		res->mant = 0;
+		return 0;
+	}
+	return fp_round(res, (u128)a.mant * b.mant, a.exp + b.exp - 12);
+}
+
+static int fp_div(struct fp *res, struct fp a, struct fp b)
+{
+	u128 q;
+	int i;
+
+	res->neg = a.neg ^ b.neg;
+	if (b.mant == 0) {
+		res->exp = 63;
+		res->mant = MANT_MAX - 1;
+		return ERR_OVERFLOW;
+	}
+	if (a.mant == 0) {
+		res->mant = 0;
+		return 0;
+	}
+	// 8 or 9 digits of quotient, the rest truncated
+	q = a.mant;
+	for (i = 0; i < 8; i++)
+		q *= 100;
+	return fp_round(res, q / b.mant, a.exp - b.exp - 8);
+}
+
+
+/****************************************
+ * Functions                            *
+ ****************************************/
+
+// Past these the ROM's argument reduction and error rules decide
+#define EXP_MAX 290.0L // e^290 is about 10^126, near the largest number
+#define TRIG_MAX 1e5L
+
+static long double fp_to_ld(struct fp f)
+{
+	long double v = (long double)f.mant * powl(100.0L, f.exp - 6);
+
+	return f.neg ? -v : v;
+}
+
+// Round v to 7 digits like fp_round.  Returns -1 if it is out of range.
+static int fp_from_ld(struct fp *f, long double v)
+{
+	long double m;
+	int e;
+
+	f->neg = v < 0;
+	v = fabsl(v);
+	f->mant = 0;
+	if (v == 0)
+		return 0;
+	e = (int)floorl(log10l(v) / 2); // of the first digit
+	m = v / powl(100.0L, e - 7);    // 8 digits, the last one the guard
+	while (m >= 1e16L) {
+		m /= 100;
+		e++;
+	}
+	while (m < 1e14L) {
+		m *= 100;
+		e--;
+	}
+	if (fp_round(f, (u128)m, e - 7) != 0 || f->mant == 0)
+		return -1;
+	return 0;
+}
+
+// Returns -1 for an argument the ROM reports an error for, or near one
+static int fp_func(int op, struct fp *res, struct fp x)
+{
+	long double v = fp_to_ld(x), r;
+
+	switch (op) {
+	case OP_SQR:
+		if (x.neg)
+			return -1;
+		r = sqrtl(v);
+		break;
+	case OP_EXP:
+		if (fabsl(v) > EXP_MAX)
+			return -1;
+		r = expl(v);
+		break;
+	case OP_LOG:
+		if (x.neg || x.mant == 0)
+			return -1;
+		r = logl(v);
+		break;
+	case OP_ATN:
+		r = atanl(v);
+		break;
+	default:
+		if (fabsl(v) >= TRIG_MAX)
+			return -1;
+		r = op == OP_COS ? cosl(v) : op == OP_SIN ? sinl(v) : tanl(v);
+		break;
+	}
+	return fp_from_ld(res, r);
+}
+
+
+/****************************************
+ * Strings                              *
+ ****************************************/
+
+#define VDP_CH(p) (vdp.ram[(p) & 0x3fff])
+
+// Convert the number at VDP address p, as BASIC stores them: an optional
+// sign, digits with an optional point, and an optional E exponent.  Returns
+// its length, or 0 to leave it to the ROM: not a number, a character after
+// it the ROM might take differently, or more digits than fit unrounded.
+static int fp_csn(struct fp *f, u16 p)
+{
+	u64 d = 0;
+	int len = 0, n = 0, seen = 0, point = 0, frac = 0, dexp = 0, e, low;
+
+	f->neg = 0;
+	f->mant = 0;
+	if (VDP_CH(p) == '+' || VDP_CH(p) == '-')
+		f->neg = VDP_CH(p + len++) == '-';
+	for (;; len++) {
+		u8 c = VDP_CH(p + len);
+
+		if (c >= '0' && c <= '9') {
+			seen++;
+			frac += point;
+			if (d == 0 && c == '0')
+				continue; // leading zero
+			if (++n > 14)
+				return 0;
+			d = d * 10 + c - '0';
+		} else if (c == '.' && !point) {
+			point = 1;
+		} else {
+			break;
+		}
+	}
+	if (!seen)
+		return 0;
+	if (VDP_CH(p + len) == 'E') {
+		int i = len + 1, neg = 0, digits = 0;
+
+		if (VDP_CH(p + i) == '+' || VDP_CH(p + i) == '-')
+			neg = VDP_CH(p + i++) == '-';
+		for (; VDP_CH(p + i) >= '0' && VDP_CH(p + i) <= '9'; i++, digits++)
+			if (dexp < 1000)
+				dexp = dexp * 10 + VDP_CH(p + i) - '0';
+		if (!digits)
+			return 0;
+		if (neg)
+			dexp = -dexp;
+		len = i;
+	}
+	// tokens, the end of a line or a space
+	if (VDP_CH(p + len) != 0 && VDP_CH(p + len) != ' ' && VDP_CH(p + len) < 0x80)
+		return 0;
+	if (d == 0)
+		return len;
+
+	// d * 10^low, its first digit at 10^(low + n - 1) is in base-100
+	// digit e, whose 7 digits end at 10^(2e - 12)
+	low = dexp - frac;
+	e = low + n - 1;
+	e = e >= 0 ? e / 2 : -((1 - e) / 2);
+	if (e < -64 || e > 63 || low < 2 * e - 12)
+		return 0;
+	for (low -= 2 * e - 12; low > 0; low--)
+		d *= 10;
+	f->exp = e;
+	f->mant = d;
+	return len;
+}
+
+// Round the n digits in d (d[0] != 0, value d0.d1d2.. * 10^*e10) to keep
+// digits, half up.  Returns the number left without trailing zeros.
+static int round_digits(char *d, int n, int keep, int *e10)
+{
+	int i;
+
+	if (n > keep) {
+		if (d[keep] >= 5) {
+			for (i = keep - 1; i >= 0 && ++d[i] == 10; i--)
+				d[i] = 0;
+			if (i < 0) { // 99.. carried to 100..
+				d[0] = 1;
+				++*e10;
+			}
+		}
+		n = keep;
+	}
+	while (n > 1 && d[n - 1] == 0)
+		n--;
+	return n;
+}
+
+// TI BASIC's free format, as PRINT shows numbers: a sign or space, then up
+// to 10 significant digits without leading or trailing zeros, or if that
+// doesn't fit, up to 6 and a two digit exponent (** past 99).
+// Returns the length of the string in s.
+static int fp_cns(char *s, struct fp f)
+{
+	char d[14], d6[14];
+	u64 m = f.mant;
+	int e10 = 2 * f.exp + 1, e6, n, n6, i, len = 0;
+
+	s[len++] = f.neg ? '-' : ' ';
+	if (m == 0) {
+		s[len++] = '0';
+		return len;
+	}
+	for (i = 13; i >= 0; i--, m /= 10)
+		d[i] = m % 10;
+	n = 14;
+	if (d[0] == 0) {
+		memmove(d, d + 1, --n);
+		e10--;
+	}
+	memcpy(d6, d, n);
+	e6 = e10;
+	n6 = round_digits(d6, n, 6, &e6);
+	n = round_digits(d, n, 10, &e10);
+
+	if (e10 >= 0 && e10 < 10) {
+		for (i = 0; i <= e10; i++)
+			s[len++] = '0' + (i < n ? d[i] : 0);
+		if (n > e10 + 1)
+			s[len++] = '.';
+		for (; i < n; i++)
+			s[len++] = '0' + d[i];
+	} else if (e10 < 0 && n - e10 - 1 <= 10) {
+		s[len++] = '.';
+		for (i = e10 + 1; i < 0; i++)
+			s[len++] = '0';
+		for (i = 0; i < n; i++)
+			s[len++] = '0' + d[i];
+	} else {
+		s[len++] = '0' + d6[0];
+		s[len++] = '.';
+		for (i = 1; i < n6; i++)
+			s[len++] = '0' + d6[i];
+		s[len++] = 'E';
+		s[len++] = e6 < 0 ? '-' : '+';
+		e6 = e6 < 0 ? -e6 : e6;
+		s[len++] = e6 > 99 ? '*' : '0' + e6 / 10;
+		s[len++] = e6 > 99 ? '*' : '0' + e6 % 10;
+	}
+	return len;
+}
+
+
+/****************************************
+ * Entry points                         *
+ ****************************************/
+
+static u16 gpl_target[ARRAY_SIZE(gpl_entries)]; // where the vector goes, 0 if not a branch
+static int checking = 0; // see fp_gpl_check
+
+static void fp_patch(int en)
+{
+	int want = en && rom ? groups | (fp_hle_unchecked ? FP_ALL : 0) : 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].group & (want ^ patched))
+			rom[entry_addr[i] >> 1] = want & entries[i].group ?
+				HLE_FP : entry_orig[i];
+	patched = want;
+	fp_gpl_active = checking || (patched & (FP_CNS | FP_FUNC));
+}
+
+static u32 crc32(u32 crc, const void *data, unsigned int size, int swap)
+{
+	const u8 *p = data;
+	unsigned int i;
+
+	crc = ~crc;
+	for (i = 0; i < size; i++) {
+		int bit;
+
+		crc ^= p[swap ? i ^ 1 : i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+// Find the entry points in the console ROM and GROM, and patch them if
+// enabled and the pair is a known one
+void fp_hle_init(u16 *console_rom, unsigned int size,
+	const u8 *console_grom, unsigned int grom_size)
+{
+	u32 hash, ghash;
+	u16 table;
+	unsigned int i;
+
+	fp_patch(0);
+	rom = NULL;
+	grom = NULL;
+	if (!console_rom || size < 0x2000 || !console_grom || grom_size < 0x6000)
+		return;
+	// ROM words are in host order, the CRC is of the big-endian dump
+	hash = crc32(0, console_rom, size,
+		__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+	ghash = crc32(0, console_grom, 0x6000, 0);
+	for (i = 0; i < ARRAY_SIZE(known); i++)
+		if (known[i].rom == hash && known[i].grom == ghash)
+			break;
+	if (i == ARRAY_SIZE(known)) {
+		debug_log("FP HLE: unknown ROM %08X GROM %08X, not patched\n",
+			hash, ghash);
+		return;
+	}
+	groups = known[i].groups;
+
+	table = console_rom[XML_TABLES >> 1];
+	if ((table & 1) || table >= size - 32) {
+		debug_log("FP HLE: no XML table in ROM %08X\n", hash);
+		return;
+	}
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		u16 addr = console_rom[(table >> 1) + entries[i].xml];
+		unsigned int j;
+
+		for (j = 0; j < i; j++) // each must be a different routine
+			if (entry_addr[j] == addr)
+				addr = 1;
+		// below 0x100 are the reset, interrupt and XOP vectors
+		if ((addr & 1) || addr < 0x100 || addr >= size ||
+		    console_rom[addr >> 1] == HLE_FP) {
+			debug_log("FP HLE: bad XML %02X entry %04X in ROM %08X\n",
+				entries[i].xml, addr, hash);
+			return;
+		}
+		entry_addr[i] = addr;
+		entry_orig[i] = console_rom[addr >> 1];
+	}
+	for (i = 0; i < ARRAY_SIZE(gpl_entries); i++) {
+		const u8 *v = console_grom + gpl_entries[i].vector;
+
+		// B (>05 address) or BR (>40 | address in this GROM)
+		if (v[0] == 0x05)
+			gpl_target[i] = (v[1] << 8) | v[2];
+		else if ((v[0] & 0xe0) == 0x40)
+			gpl_target[i] = ((v[0] & 0x1f) << 8) | v[1];
+		else
+			gpl_target[i] = 0;
+		if (!gpl_target[i])
+			debug_log("FP HLE: no %s vector in GROM %08X\n",
+				gpl_entries[i].name, ghash);
+	}
+	debug_log("FP HLE: ROM %08X GROM %08X FADD=%04X FMUL=%04X FDIV=%04X CSN=%04X SQR=G%04X\n",
+		hash, ghash, entry_addr[0], entry_addr[2], entry_addr[3],
+		entry_addr[8], gpl_target[1]);
+	rom = console_rom;
+	grom = console_grom;
+	fp_patch(cfg.fp_hle != 0);
+}
+
+// Call when cfg.fp_hle or fp_hle_unchecked changes
+void fp_hle_update(void)
+{
+	fp_patch(cfg.fp_hle != 0);
+}
+
+// Called by the CPU on an HLE_FP opcode at pc.  Does the operation and
+// returns the cycles to charge, the caller returns to R11.
+// Returns -1 to run *op instead: the ROM's own instruction if the native
+// routine declined, or HLE_FP unchanged if pc is not a patched entry point.
+int fp_hle(u16 pc, u16 *op)
+{
+	struct fp a, b, res = {};
+	u8 buf[8];
+	unsigned int i, e;
+	int err = 0;
+
+	if (!patched)
+		return -1;
+	for (e = 0; e < ARRAY_SIZE(entries); e++)
+		if (entry_addr[e] == pc)
+			break;
+	if (e == ARRAY_SIZE(entries) || !(patched & entries[e].group))
+		return -1;
+
+	if (entries[e].op == OP_CSN) {
+		u16 p = cpu_mem_r(FAC12);
+		int len = fp_csn(&res, p);
+
+		if (len == 0) {
+			*op = entry_orig[e];
+			return -1;
+		}
+		// read it through the ports like the ROM, one past the end
+		cpu_mem_w(VDPWA, p << 8);
+		cpu_mem_w(VDPWA, p & 0x3f00);
+		for (i = 0; i <= (unsigned int)len; i++)
+			cpu_mem_r(VDPRD);
+		fp_put(buf, res);
+		write_bytes(FAC, buf, 8);
+		cpu_mem_w(FAC12, p + len);
+		return cfg.fp_hle;
+	}
+
+	if (entries[e].stack) {
+		u16 sp = cpu_mem_r(VSPTR);
+		// through the ports like the ROM, so the VDP address, latch
+		// and read-ahead are left as it leaves them
+		cpu_mem_w(VDPWA, sp << 8);
+		cpu_mem_w(VDPWA, sp & 0x3f00);
+		for (i = 0; i < 8; i++)
+			buf[i] = cpu_mem_r(VDPRD) >> 8;
+		cpu_mem_w(VSPTR, sp - 8);
+	} else {
+		read_bytes(ARG, buf, 8);
+	}
+	a = fp_get(buf);
+	read_bytes(FAC, buf, 8);
+	b = fp_get(buf);
+
+	switch (entries[e].op) {
+	case OP_SUB: b.neg ^= 1; // fall through
+	case OP_ADD: err = fp_add(&res, a, b); break;
+	case OP_MUL: err = fp_mul(&res, a, b); break;
+	case OP_DIV: err = fp_div(&res, a, b); break;
+	}
+	fp_put(buf, res);
+	write_bytes(FAC, buf, 8);
+	if (err)
+		cpu_mem_w(ERRCOD, (cpu_mem_r(ERRCOD) & 0x00ff) | (err << 8));
+	return cfg.fp_hle;
+}
+
+
+/****************************************
+ * GPL entries                          *
+ ****************************************/
+
+#define CNS_STR 0x835C // where CNS leaves the string, over ARG
+
+// Do GPL entry e on FAC, reading with safe_r so nothing is disturbed.
+// Returns -1 to leave it to the ROM.
+static int gpl_native(unsigned int e, u8 *fac, char *str, int *len)
+{
+	struct fp x, res = {};
+	u8 buf[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		u16 w = safe_r(FAC + i);
+		buf[i] = w >> 8;
+		buf[i+1] = w & 0xff;
+	}
+	x = fp_get(buf);
+	if (gpl_entries[e].op == OP_CNS) {
+		if (safe_r(FAC11 & ~1) & 0xff) // fixed formats are left to the ROM
+			return -1;
+		*len = fp_cns(str, x);
+		return 0;
+	}
+	if (fp_func(gpl_entries[e].op, &res, x) != 0)
+		return -1;
+	fp_put(fac, res);
+	return 0;
+}
+
+// Bytes at an even CPU address, keeping the byte after an odd length
+static void write_string(u16 addr, const char *str, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i += 2)
+		cpu_mem_w(addr + i, (str[i] << 8) |
+			(i + 1 < len ? (u8)str[i+1] : safe_r(addr + i) & 0xff));
+}
+
+// The check lockstep -F runs: the ROM routine runs, and its result is
+// compared with the native one when it returns
+static struct {
+	int e;        // entry called, -1 for none
+	u16 ret;      // GROM address it returns to
+	u8 sp;        // subroutine stack pointer after the call
+	int native;   // the native routine did it, else it declined
+	u8 fac[8];
+	char str[24];
+	int len;
+} pending = {-1};
+static long check_calls[ARRAY_SIZE(gpl_entries)];
+static long check_differ[ARRAY_SIZE(gpl_entries)];
+
+static void gpl_compare(void)
+{
+	unsigned int e = pending.e;
+	u8 fac[8];
+	char str[24];
+	int i, len = 0, differ;
+
+	check_calls[e]++;
+	if (!pending.native)
+		return;
+	if (gpl_entries[e].op == OP_CNS) {
+		u16 p = safe_r(FAC12);
+
+		len = safe_r(FAC11 & ~1) & 0xff;
+		for (i = 0; i < len && i < (int)sizeof(str); i++)
+			str[i] = safe_r((p + i) & ~1) >> ((p + i) & 1 ? 0 : 8);
+		differ = p != CNS_STR || len != pending.len ||
+			memcmp(str, pending.str, len) != 0;
+	} else {
+		read_bytes(FAC, fac, 8);
+		differ = memcmp(fac, pending.fac, 8) != 0;
+	}
+	if (differ && check_differ[e]++ < 10) {
+		printf("%s", gpl_entries[e].name);
+		if (gpl_entries[e].op == OP_CNS) {
+			printf(" ROM \"%.*s\" at %04X native \"%.*s\"\n",
+				len, str, safe_r(FAC12), pending.len, pending.str);
+		} else {
+			printf(" ROM ");
+			for (i = 0; i < 8; i++)
+				printf("%02X", fac[i]);
+			printf(" native ");
+			for (i = 0; i < 8; i++)
+				printf("%02X", pending.fac[i]);
+			printf("\n");
+		}
+	}
+}
+
+// Called by bulwip.c when the GROM address is set to addr, if
+// fp_gpl_active.  Returns the cycles to charge if it did the routine at
+// addr natively, and the interpreter should be handed GPL_RTN, or -1.
+int fp_gpl(u16 addr)
+{
+	unsigned int e;
+	int cyc;
+
+	if (pending.e >= 0) {
+		u8 sp = safe_r(SUBSTK & ~1) & 0xff;
+
+		if (addr == pending.ret)
+			gpl_compare();
+		else if (sp >= pending.sp)
+			return -1; // still in the routine
+		pending.e = -1; // returned, or left by an error
+		return -1;
+	}
+	if (addr >= 0x40 || !grom)
+		return -1;
+	for (e = 0; e < ARRAY_SIZE(gpl_entries); e++)
+		if (gpl_entries[e].vector == addr)
+			break;
+	if (e == ARRAY_SIZE(gpl_entries) || !gpl_target[e])
+		return -1;
+
+	if (checking) {
+		pending.sp = safe_r(SUBSTK & ~1) & 0xff;
+		pending.ret = safe_r(0x8300 + (pending.sp & ~1));
+		pending.native = gpl_native(e, pending.fac, pending.str, &pending.len) == 0;
+		pending.e = e;
+		return -1;
+	}
+	if (!(patched & gpl_entries[e].group) ||
+	    gpl_native(e, pending.fac, pending.str, &pending.len) != 0)
+		return -1;
+	cyc = add_cyc(0); // the writes are free, the routine costs cfg.fp_hle
+	if (gpl_entries[e].op == OP_CNS) {
+		write_string(CNS_STR, pending.str, pending.len);
+		cpu_mem_w(FAC11 & ~1, (safe_r(FAC11 & ~1) & 0xff00) | pending.len);
+		cpu_mem_w(FAC12, CNS_STR);
+	} else {
+		write_bytes(FAC, pending.fac, 8);
+	}
+	add_cyc(cyc - add_cyc(0));
+	return cfg.fp_hle;
+}
+
+// With on, GPL entries are not replaced but checked as the ROM runs them.
+// With off, prints the counts and returns the number that differed.
+long fp_gpl_check(int on)
+{
+	unsigned int e;
+	long bad = 0;
+
+	checking = on;
+	pending.e = -1;
+	fp_patch(cfg.fp_hle != 0);
+	if (on) {
+		memset(check_calls, 0, sizeof(check_calls));
+		memset(check_differ, 0, sizeof(check_differ));
+		return 0;
+	}
+	for (e = 0; e < ARRAY_SIZE(gpl_entries); e++) {
+		printf("%s: %ld of %ld differ\n", gpl_entries[e].name,
+			check_differ[e], check_calls[e]);
+		bad += check_differ[e];
+	}
+	return bad;
+}
@@ -0,0 +1,450 @@
+/*
+ *  rs232.c - RS232 card with two TMS9902 UARTs
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// The TI RS232 card at CRU >1300: bit 0 pages in its DSR ROM (rs232.bin,
+// if found), bits 1-7 are the PIO and LED latches, and the two TMS9902
+// UARTs are at CRU >1340 and >1380.  Their interrupts go to the 9901 INT1.
+//
+// Each port can be backed by the host: BULWIP_RS232=pty opens a pseudo
+// terminal and prints its name, BULWIP_RS232=/tmp/ser.sock listens on a
+// UNIX socket.  A second comma separated entry is for port 2.  Characters
+// move at the programmed rate counted in CPU cycles, so transfers speed up
+// with the emulation.  The host side is flow controlled: a byte is only
+// taken when the receive buffer is empty, so nothing is lost to overruns.
+
+#define CARD_BIT (0x1300 >> 1)
+#define UART_BITS 32
+#define PORTS 2
+#define HOST_BUF 256
+
+struct tms9902 {
+	u8 ctrl;     // RCL in 0-1, CLK4M 3, Podd 4, Penb 5, SBS 6-7
+	u8 interval; // timer, in 64 internal clocks
+	u16 rdr, xdr; // receive and transmit data rates
+	u8 rbr, xbr;
+	u8 ldctrl, ldir, lrdr, lxdr; // which register bits 0-10 load
+	u8 rienb, xbienb, timenb, dscenb;
+	u8 rtson, brkon, tstmd;
+	u8 rbrl, xbre, xsre, rover, timelp, timerr, dsch;
+	u8 connected; // DSR and CTS
+	u64 tx_done;  // cycle the shift register empties
+	u64 rx_next;  // cycle the next character can arrive
+	u64 timer_next;
+
+	int fd, listen_fd; // host side, -1 if none
+	u8 in[HOST_BUF];
+	int in_len, in_pos;
+};
+
+static struct tms9902 uart[PORTS] = {
+	[0 ... PORTS-1] = { .fd = -1, .listen_fd = -1 }
+};
+static u8 card_latch = 0; // CRU bits 0-7
+static u16 *dsr_rom = NULL;
+
+
+/****************************************
+ * Timing                               *
+ ****************************************/
+
+// The card's 3 MHz clock is taken as the CPU clock.  The 9902 divides it
+// by 3, or 4 with CLK4M, for its internal clock.
+static unsigned int internal_clock(struct tms9902 *u)
+{
+	return u->ctrl & 0x08 ? 4 : 3;
+}
+
+// Cycles for one character at a data rate register value, counting the
+// start bit, data bits, parity and stop bits
+static unsigned int char_cycles(struct tms9902 *u, u16 rate)
+{
+	unsigned int bit = 2 * internal_clock(u) * ((rate & 0x3ff) ?: 1) *
+		(rate & 0x400 ? 8 : 1);
+	unsigned int half_bits = 2 * (1 + 5 + (u->ctrl & 3)) +
+		(u->ctrl & 0x20 ? 2 : 0) +
+		(u->ctrl & 0x80 ? 2 : u->ctrl & 0x40 ? 4 : 3);
+
+	return bit * half_bits / 2;
+}
+
+
+/****************************************
+ * Host side                            *
+ ****************************************/
+
+#ifndef _WIN32
+
+static void host_open(struct tms9902 *u, int port, const char *where)
+{
+	if (strcmp(where, "pty") == 0) {
+		struct termios t;
+		int slave;
+
+		u->fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if (u->fd == -1 || grantpt(u->fd) != 0 || unlockpt(u->fd) != 0)
+			goto fail;
+		// raw, and kept open so reads don't fail while nothing else has it
+		slave = open(ptsname(u->fd), O_RDWR | O_NOCTTY);
+		if (slave != -1 && tcgetattr(slave, &t) == 0) {
+			cfmakeraw(&t);
+			tcsetattr(slave, TCSANOW, &t);
+		}
+		fcntl(u->fd, F_SETFL, O_NONBLOCK);
+		u->connected = 1;
+		fprintf(stderr, "RS232 port %d on %s\n", port + 1, ptsname(u->fd));
+	} else {
+		struct sockaddr_un sa = {};
+
+		u->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sa.sun_family = AF_UNIX;
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", where);
+		unlink(where);
+		if (bind(u->listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+		    listen(u->listen_fd, 1) != 0) {
+			close(u->listen_fd);
+			u->listen_fd = -1;
+			goto fail;
+		}
+		fcntl(u->listen_fd, F_SETFL, O_NONBLOCK);
+		fprintf(stderr, "RS232 port %d listening on %s\n", port + 1, where);
+	}
+	return;
+fail:
+	perror("rs232");
+	if (u->fd != -1)
+		close(u->fd);
+	u->fd = -1;
+}
+
+static void host_connect(struct tms9902 *u, int connected)
+{
+	if (u->connected != connected)
+		u->dsch = 1;
+	u->connected = connected;
+}
+
+static void host_close(struct tms9902 *u)
+{
+	close(u->fd);
+	u->fd = -1;
+	u->in_len = u->in_pos = 0;
+	host_connect(u, 0);
+}
+
+// Returns the next byte from the host, or -1 if none yet
+static int host_get(struct tms9902 *u)
+{
+	if (u->fd == -1 && u->listen_fd != -1) {
+		u->fd = accept(u->listen_fd, NULL, NULL);
+		if (u->fd == -1)
+			return -1;
+		fcntl(u->fd, F_SETFL, O_NONBLOCK);
+		host_connect(u, 1);
+	}
+	if (u->fd == -1)
+		return -1;
+	if (u->in_pos == u->in_len) {
+		ssize_t n = read(u->fd, u->in, sizeof(u->in));
+
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			if (u->listen_fd != -1)
+				host_close(u); // the client went away
+			return -1;
+		}
+		if (n < 0)
+			return -1;
+		u->in_len = n;
+		u->in_pos = 0;
+	}
+	return u->in[u->in_pos++];
+}
+
+static void host_put(struct tms9902 *u, u8 c)
+{
+	ssize_t n;
+
+	if (u->fd == -1)
+		return;
+	n = u->listen_fd == -1 ? write(u->fd, &c, 1) :
+		send(u->fd, &c, 1, MSG_NOSIGNAL); // no SIGPIPE
+	if (n < 0 && errno == EPIPE)
+		host_close(u);
+}
+
+#else
+
+static void host_open(struct tms9902 *u, int port, const char *where)
+{
+	fprintf(stderr, "RS232 host ports are not supported here\n");
+}
+static int host_get(struct tms9902 *u) { return -1; }
+static void host_put(struct tms9902 *u, u8 c) { }
+
+#endif
+
+// Set the host side of the ports from a comma separated list of "pty" or
+// a UNIX socket path.  Empty entries leave a port unconnected.
+void rs232_init(const char *where)
+{
+	char *list, *p, *next;
+	int i;
+
+	if (!where || !*where)
+		return;
+	list = strdup(where);
+	for (p = list, i = 0; p && i < PORTS; p = next, i++) {
+		next = strchr(p, ',');
+		if (next)
+			*next++ = 0;
+		if (*p)
+			host_open(&uart[i], i, p);
+	}
+	free(list);
+}
+
+
+/****************************************
+ * TMS9902                              *
+ ****************************************/
+
+static void uart_reset(struct tms9902 *u)
+{
+	u->ctrl = u->interval = 0;
+	u->ldctrl = u->ldir = u->lrdr = u->lxdr = 1;
+	u->rienb = u->xbienb = u->timenb = u->dscenb = 0;
+	u->rtson = u->brkon = u->tstmd = 0;
+	u->rbrl = u->rover = u->timelp = u->timerr = u->dsch = 0;
+	u->xbre = u->xsre = 1;
+}
+
+static void receive(struct tms9902 *u, u8 c)
+{
+	u->rover = u->rbrl; // only in test mode, the host waits
+	u->rbr = c & (0xff >> (3 - (u->ctrl & 3)));
+	u->rbrl = 1;
+}
+
+// Catch up to the cycle count now
+static void uart_run(struct tms9902 *u, u64 now)
+{
+	// the buffer moves to the shift register when that empties
+	while (!u->xsre || !u->xbre) {
+		if (!u->xsre) {
+			if (now < u->tx_done)
+				break;
+			u->xsre = 1;
+		}
+		if (!u->xbre) {
+			u->xsre = 0;
+			u->xbre = 1;
+			u->tx_done += char_cycles(u, u->xdr);
+			if (u->tstmd)
+				receive(u, u->xbr);
+			else if (!u->brkon)
+				host_put(u, u->xbr);
+		}
+	}
+
+	if (now >= u->rx_next && !u->rbrl && !u->tstmd) {
+		int c = host_get(u);
+
+		if (c != -1)
+			receive(u, c);
+		u->rx_next = now + char_cycles(u, u->rdr);
+	}
+
+	if (u->interval && now >= u->timer_next) {
+		u64 period = 64 * internal_clock(u) * u->interval;
+
+		u->timerr = u->timelp; // elapsed again before it was cleared
+		u->timelp = 1;
+		u->timer_next += period;
+		if (u->timer_next <= now)
+			u->timer_next = now + period;
+	}
+}
+
+static int uart_int(struct tms9902 *u)
+{
+	return (u->rbrl && u->rienb) || (u->xbre && u->xbienb) ||
+		(u->timelp && u->timenb) || (u->dsch && u->dscenb);
+}
+
+static u32 uart_r(struct tms9902 *u)
+{
+	u32 in = u->rbr;
+
+	in |= (u->rover << 11) | (u->rover << 9); // ROVER, RCVERR
+	in |= (!u->rbrl) << 15; // RIN, the line idles at mark
+	in |= (u->rbrl && u->rienb) << 16;
+	in |= (u->xbre && u->xbienb) << 17;
+	in |= (u->timelp && u->timenb) << 19;
+	in |= (u->dsch && u->dscenb) << 20;
+	in |= (u->rbrl << 21) | (u->xbre << 22) | (u->xsre << 23);
+	in |= (u->timerr << 24) | (u->timelp << 25) | (u->rtson << 26);
+	in |= (u->connected << 27) | (u->connected << 28) | (u->dsch << 29);
+	in |= (u->ldctrl | u->ldir | u->lrdr | u->lxdr | u->brkon) << 30;
+	in |= (u32)uart_int(u) << 31;
+	return in;
+}
+
+// Bits 0-10 go to the first register selected by the load bits, or to
+// the transmit buffer.  Writing the last bit of a register deselects it,
+// except LXDR which is cleared by writing bit 11.
+static void uart_reg_w(struct tms9902 *u, int bit, int value, u64 now)
+{
+	u16 m = 1 << bit;
+
+	if (u->ldctrl) {
+		u->ctrl = value ? u->ctrl | m : u->ctrl & ~m;
+		if (bit == 7)
+			u->ldctrl = 0;
+	} else if (u->ldir) {
+		u->interval = value ? u->interval | m : u->interval & ~m;
+		if (bit == 7) {
+			u->ldir = 0;
+			u->timer_next = now + 64 * internal_clock(u) * u->interval;
+		}
+	} else if (u->lrdr || u->lxdr) {
+		if (u->lrdr)
+			u->rdr = value ? u->rdr | m : u->rdr & ~m;
+		if (u->lxdr)
+			u->xdr = value ? u->xdr | m : u->xdr & ~m;
+		if (bit == 10)
+			u->lrdr = 0;
+	} else if (bit < 8) {
+		u->xbr = value ? u->xbr | m : u->xbr & ~m;
+		if (bit == 7) {
+			if (u->xsre && u->tx_done < now)
+				u->tx_done = now;
+			u->xbre = 0;
+			uart_run(u, now);
+		}
+	}
+}
+
+static void uart_w(struct tms9902 *u, int bit, int value, u64 now)
+{
+	switch (bit) {
+	case 31: if (value) uart_reset(u); break;
+	case 21: u->dscenb = value; u->dsch = 0; break;
+	case 20: u->timenb = value; u->timelp = u->timerr = 0; break;
+	case 19: u->xbienb = value; break;
+	case 18: u->rienb = value; u->rbrl = 0; break; // clears RBRL
+	case 17: u->brkon = value; break;
+	case 16: u->rtson = value; break;
+	case 15: u->tstmd = value; break;
+	case 14: u->ldctrl = value; break;
+	case 13: u->ldir = value; break;
+	case 12: u->lrdr = value; break;
+	case 11: u->lxdr = value; break;
+	default:
+		if (bit <= 10)
+			uart_reg_w(u, bit, value, now);
+		break;
+	}
+}
+
+
+/****************************************
+ * Card                                 *
+ ****************************************/
+
+void rs232_set_rom(u16 *rom)
+{
+	dsr_rom = rom;
+}
+
+void rs232_reset(void)
+{
+	int i;
+
+	card_latch = 0;
+	dsr_select(NULL);
+	for (i = 0; i < PORTS; i++)
+		uart_reset(&uart[i]);
+}
+
+// CRU handlers, for the card's 3 pages of 32 bits
+u16 rs232_cru_r(u16 bit, int count)
+{
+	int page = (bit - CARD_BIT) / UART_BITS;
+	u64 now = get_total_cpu_cycles();
+	u32 in;
+
+	if (page == 0) {
+		in = card_latch | 0x04 | 0xffffff00; // PIO handshake in is high
+	} else {
+		uart_run(&uart[page - 1], now);
+		in = uart_r(&uart[page - 1]);
+	}
+	return in >> (bit & (UART_BITS-1));
+}
+
+void rs232_cru_w(u16 bit, int count, u16 value)
+{
+	u64 now = get_total_cpu_cycles();
+
+	for (; count > 0; count--, bit++, value >>= 1) {
+		int page = (bit - CARD_BIT) / UART_BITS;
+		int n = bit & (UART_BITS-1);
+
+		if (page > 0) {
+			uart_run(&uart[page - 1], now);
+			uart_w(&uart[page - 1], n, value & 1, now);
+		} else if (n < 8) {
+			card_latch = (card_latch & ~(1 << n)) | ((value & 1) << n);
+			if (n == 0)
+				dsr_select(value & 1 ? dsr_rom : NULL);
+		}
+	}
+}
+
+// Called every scanline, returns the card's interrupt line
+int rs232_run(u64 now)
+{
+	int i, level = 0;
+
+	for (i = 0; i < PORTS; i++) {
+		uart_run(&uart[i], now);
+		level |= uart_int(&uart[i]);
+	}
+	return level;
+}
@@ -0,0 +1,283 @@
+/*
+ *  scale.c - pixel art upscalers
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include "cpu.h"
+
+// Integer upscalers for the screen, on the present thread (sdl.c) so they
+// overlap emulating the next frame.  Pixels are ARGB8888.  The loops use
+// GCC vector extensions on 4 pixels at a time, which compile to SSE2 on
+// x86 and NEON on ARM without any intrinsics.
+
+typedef u32 v4u __attribute__((vector_size(16)));
+typedef int v4i __attribute__((vector_size(16)));
+
+#ifdef __clang__
+#define SHUFFLE(a, b, i, j, k, l) __builtin_shufflevector(a, b, i, j, k, l)
+#else
+#define SHUFFLE(a, b, i, j, k, l) __builtin_shuffle(a, b, (v4u){i, j, k, l})
+#endif
+
+#define MAX_W 640 // 80 column text mode
+#define PAD 4 // keeps the row start aligned
+
+static inline v4u load4(const u32 *p) { v4u v; memcpy(&v, p, sizeof(v)); return v; }
+static inline void store4(u32 *p, v4u v) { memcpy(p, &v, sizeof(v)); }
+static inline v4u eq(v4u a, v4u b) { return (v4u)(a == b); }
+static inline v4u ne(v4u a, v4u b) { return (v4u)(a != b); }
+static inline v4u sel(v4u m, v4u a, v4u b) { return (a & m) | (b & ~m); }
+
+// Rows y-1, y and y+1 with the edge pixels repeated around them, so
+// row[i][-1] and row[i][w] can be read
+struct rows {
+	u32 line[3][PAD + MAX_W + PAD] __attribute__((aligned(16)));
+	const u32 *row[3];
+};
+
+static void get_rows(struct rows *r, const u32 *src, int pitch, int w, int h, int y)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		int sy = y + i - 1;
+		const u32 *s = src + pitch * (sy < 0 ? 0 : sy >= h ? h - 1 : sy);
+		u32 *d = r->line[i] + PAD;
+
+		memcpy(d, s, w * sizeof(u32));
+		d[-1] = s[0];
+		d[w] = s[w-1];
+		r->row[i] = d;
+	}
+}
+
+// Store two vectors as 8 pixels, alternating
+static inline void store_zip(u32 *p, v4u a, v4u b)
+{
+	store4(p, SHUFFLE(a, b, 0, 4, 1, 5));
+	store4(p + 4, SHUFFLE(a, b, 2, 6, 3, 7));
+}
+
+// Store three vectors as 12 pixels, alternating
+static inline void store_zip3(u32 *p, v4u a, v4u b, v4u c)
+{
+	v4u ab = SHUFFLE(a, b, 0, 4, 1, 5);  // a0 b0 a1 b1
+	v4u ba = SHUFFLE(a, b, 5, 2, 6, 0);  // b1 a2 b2 -
+	v4u ab3 = SHUFFLE(a, b, 3, 7, 3, 7); // a3 b3 - -
+
+	store4(p, SHUFFLE(ab, c, 0, 1, 4, 2));
+	store4(p + 4, SHUFFLE(ba, c, 0, 5, 1, 2));
+	store4(p + 8, SHUFFLE(ab3, c, 6, 0, 1, 7));
+}
+
+
+/****************************************
+ * Scale2x and Scale3x                  *
+ ****************************************/
+
+// See https://www.scale2x.it/algorithm  With the neighbours
+//   A B C
+//   D E F
+//   G H I
+// corners of E take the colour of two matching edges, unless the
+// opposite ones also match.
+
+// w must be a multiple of 4
+void scale2x(const u32 *src, int src_pitch, int w, int h, u32 *dst, int dst_pitch)
+{
+	struct rows r;
+	int x, y;
+
+	for (y = 0; y < h; y++, dst += 2 * dst_pitch) {
+		get_rows(&r, src, src_pitch, w, h, y);
+		for (x = 0; x < w; x += 4) {
+			v4u B = load4(r.row[0] + x);
+			v4u D = load4(r.row[1] + x - 1);
+			v4u E = load4(r.row[1] + x);
+			v4u F = load4(r.row[1] + x + 1);
+			v4u H = load4(r.row[2] + x);
+			v4u m = ne(B, H) & ne(D, F);
+
+			store_zip(dst + 2*x,
+				sel(m & eq(D, B), D, E),
+				sel(m & eq(B, F), F, E));
+			store_zip(dst + dst_pitch + 2*x,
+				sel(m & eq(D, H), D, E),
+				sel(m & eq(H, F), F, E));
+		}
+	}
+}
+
+void scale3x(const u32 *src, int src_pitch, int w, int h, u32 *dst, int dst_pitch)
+{
+	struct rows r;
+	int x, y;
+
+	for (y = 0; y < h; y++, dst += 3 * dst_pitch) {
+		get_rows(&r, src, src_pitch, w, h, y);
+		for (x = 0; x < w; x += 4) {
+			v4u A = load4(r.row[0] + x - 1);
+			v4u B = load4(r.row[0] + x);
+			v4u C = load4(r.row[0] + x + 1);
+			v4u D = load4(r.row[1] + x - 1);
+			v4u E = load4(r.row[1] + x);
+			v4u F = load4(r.row[1] + x + 1);
+			v4u G = load4(r.row[2] + x - 1);
+			v4u H = load4(r.row[2] + x);
+			v4u I = load4(r.row[2] + x + 1);
+			v4u m = ne(B, H) & ne(D, F);
+			v4u db = m & eq(D, B), bf = m & eq(B, F);
+			v4u dh = m & eq(D, H), hf = m & eq(H, F);
+
+			store_zip3(dst + 3*x,
+				sel(db, D, E),
+				sel((db & ne(E, C)) | (bf & ne(E, A)), B, E),
+				sel(bf, F, E));
+			store_zip3(dst + dst_pitch + 3*x,
+				sel((db & ne(E, G)) | (dh & ne(E, A)), D, E),
+				E,
+				sel((bf & ne(E, I)) | (hf & ne(E, C)), F, E));
+			store_zip3(dst + 2 * dst_pitch + 3*x,
+				sel(dh, D, E),
+				sel((dh & ne(E, I)) | (hf & ne(E, G)), H, E),
+				sel(hf, F, E));
+		}
+	}
+}
+
+
+/****************************************
+ * xBR-lite                             *
+ ****************************************/
+
+// The 2xBR corner rule with only the 3x3 neighbourhood.  For the bottom
+// right corner, an edge runs along H-F if colours change less along that
+// direction than across it:
+//   d(E,C) + d(E,G) + 4*d(H,F)  <  d(D,H) + d(B,F) + 4*d(E,I)
+// and then the corner is blended half way to F or H, whichever is closer
+// to E.  The other corners are the same rotated.
+
+// Weighted YUV distance, like xBR uses
+static inline v4i dist(v4u a, v4u b)
+{
+	v4i dr = (v4i)((a >> 16) & 0xff) - (v4i)((b >> 16) & 0xff);
+	v4i dg = (v4i)((a >> 8) & 0xff) - (v4i)((b >> 8) & 0xff);
+	v4i db = (v4i)(a & 0xff) - (v4i)(b & 0xff);
+	v4i dy = (77 * dr + 150 * dg + 29 * db) >> 8;
+	v4i du = db - dy, dv = dr - dy;
+
+	// abs() as (x ^ s) - s with s the sign
+	return 48 * ((dy ^ (dy >> 31)) - (dy >> 31)) +
+		7 * ((du ^ (du >> 31)) - (du >> 31)) +
+		6 * ((dv ^ (dv >> 31)) - (dv >> 31));
+}
+
+static inline v4u blend(v4u a, v4u b)
+{
+	return (a & b) + (((a ^ b) & 0xfefefefe) >> 1);
+}
+
+// Corner of E between its neighbours P and Q, with the rest of the sums
+static inline v4u corner(v4u E, v4u P, v4u Q, v4i ep, v4i eq_, v4i along, v4i across)
+{
+	v4u edge = (v4u)(along < across);
+	v4u px = sel((v4u)(ep <= eq_), P, Q);
+
+	return sel(edge, blend(E, px), E);
+}
+
+void xbr2x(const u32 *src, int src_pitch, int w, int h, u32 *dst, int dst_pitch)
+{
+	struct rows r;
+	int x, y;
+
+	for (y = 0; y < h; y++, dst += 2 * dst_pitch) {
+		get_rows(&r, src, src_pitch, w, h, y);
+		for (x = 0; x < w; x += 4) {
+			v4u A = load4(r.row[0] + x - 1);
+			v4u B = load4(r.row[0] + x);
+			v4u C = load4(r.row[0] + x + 1);
+			v4u D = load4(r.row[1] + x - 1);
+			v4u E = load4(r.row[1] + x);
+			v4u F = load4(r.row[1] + x + 1);
+			v4u G = load4(r.row[2] + x - 1);
+			v4u H = load4(r.row[2] + x);
+			v4u I = load4(r.row[2] + x + 1);
+			v4i ea = dist(E, A), ec = dist(E, C), eg = dist(E, G), ei = dist(E, I);
+			v4i eb = dist(E, B), ed = dist(E, D), ef = dist(E, F), eh = dist(E, H);
+			v4i db = dist(D, B), bf = dist(B, F), fh = dist(F, H), hd = dist(H, D);
+
+			store_zip(dst + 2*x,
+				corner(E, D, B, ed, eb, ec + eg + 4 * db, bf + hd + 4 * ea),
+				corner(E, F, B, ef, eb, ea + ei + 4 * bf, fh + db + 4 * ec));
+			store_zip(dst + dst_pitch + 2*x,
+				corner(E, D, H, ed, eh, ea + ei + 4 * hd, db + fh + 4 * eg),
+				corner(E, F, H, ef, eh, ec + eg + 4 * fh, hd + bf + 4 * ei));
+		}
+	}
+}
+
+
+/****************************************
+ * Nearest neighbour                    *
+ ****************************************/
+
+// Scale by integers nx (1-4) and ny.  Scaled up this way first, linear
+// filtering to the window size only blurs the pixel edges: sharp bilinear.
+void scale_nearest(const u32 *src, int src_pitch, int w, int h,
+	u32 *dst, int dst_pitch, int nx, int ny)
+{
+	int x, y, i;
+
+	for (y = 0; y < h; y++, src += src_pitch) {
+		u32 *d = dst;
+
+		for (x = 0; x < w; x += 4) {
+			v4u v = load4(src + x);
+
+			switch (nx) {
+			case 1:
+				store4(d, v);
+				break;
+			case 2:
+				store_zip(d, v, v);
+				break;
+			case 3:
+				store_zip3(d, v, v, v);
+				break;
+			default:
+				store4(d, SHUFFLE(v, v, 0, 0, 0, 0));
+				store4(d + 4, SHUFFLE(v, v, 1, 1, 1, 1));
+				store4(d + 8, SHUFFLE(v, v, 2, 2, 2, 2));
+				store4(d + 12, SHUFFLE(v, v, 3, 3, 3, 3));
+				break;
+			}
+			d += 4 * nx;
+		}
+		for (i = 1; i < ny; i++)
+			memcpy(dst + i * dst_pitch, dst, w * nx * sizeof(u32));
+		dst += ny * dst_pitch;
+	}
+}
@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,9 +30,14 @@
 
 #include "cpu.h"
 
-// audio player
-#include "player.h"
-
+#ifdef ENABLE_REALTIME
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
 
 // enabled in Makefile
 #ifdef ENABLE_CRT
@@ -42,139 +48,396 @@
 
 
 
+/****************************************
+ * Real-time mode                       *
+ ****************************************/
+
+// Opt in with BULWIP_RT, a comma separated list of
+//   on         lock and prefault memory, pace frames with clock_nanosleep
+//   fifo[:n]   also run the emulation and audio threads SCHED_FIFO, at
+//   rr[:n]     priority n and n+1, or SCHED_RR.  Falls back to rtkit.
+//   cpu:n      pin the emulation thread to CPU n
+//   audiocpu:n pin the audio thread to CPU n
+// Any option implies "on".  Frames that finish after their deadline, and
+// sleeps that overshoot it, are counted and reported on stderr.
+
+#ifdef ENABLE_REALTIME
+#define RT_PRIO 20 // default priority
+#define RT_SPIN_NS 200000 // sleep until this close to the deadline, then spin
+#define RT_STACK (256 << 10) // stack to prefault
 
-void snd_w(unsigned char byte)
+static int rt_on = 0;
+static int rt_policy = -1; // SCHED_FIFO or SCHED_RR
+static int rt_prio = RT_PRIO;
+static int rt_audio_cpu = -1;
+static int rt_audio_pending = 0; // audio thread not set up yet
+static u64 rt_deadline = 0; // ns, CLOCK_MONOTONIC
+static unsigned int rt_frames = 0, rt_misses = 0, rt_reported = 0;
+static u64 rt_worst = 0; // ns late, since last report
+static u64 rt_report_time = 0;
+
+static u64 rt_now(void)
 {
-	// FIXME sound bytes should be written to a buffer with cpu clock counts,
-	// so that the register changes can simulated as the audio is generated,
-	// TODO isn't there also a CRU bit that controls audio (cassette tape?)
-	//fprintf(stderr, "sound %02x\n", byte);
-	//snd(byte);
-	snd_fifo(byte, 0, get_total_cpu_cycles());
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+// Set the calling thread's priority and affinity
+static void rt_thread(const char *name, int prio, int cpu)
+{
+	if (rt_policy >= 0) {
+		struct sched_param sp = { .sched_priority = prio };
+		int err = pthread_setschedparam(pthread_self(), rt_policy, &sp);
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		// without CAP_SYS_NICE or an rtprio limit, SDL asks rtkit
+		if (err == EPERM) {
+			SDL_SetHint(SDL_HINT_THREAD_PRIORITY_POLICY,
+				rt_policy == SCHED_FIFO ? "fifo" : "rr");
+			SDL_SetHint(SDL_HINT_THREAD_FORCE_REALTIME_TIME_CRITICAL, "1");
+			if (SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL) == 0) {
+				fprintf(stderr, "realtime: %s thread priority from rtkit\n", name);
+				err = -1;
+			}
+		}
+#endif
+		if (err > 0)
+			fprintf(stderr, "realtime: %s thread priority %d: %s\n",
+				name, prio, strerror(err));
+	}
+	if (cpu >= 0) {
+		cpu_set_t set;
+		int err;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err)
+			fprintf(stderr, "realtime: %s thread on CPU %d: %s\n",
+				name, cpu, strerror(err));
+	}
+}
 
+// Touch the stack so it is mapped before mlockall()
+static __attribute__((noinline)) void rt_prefault_stack(void)
+{
+	volatile char stack[RT_STACK];
 
-static Uint64 next_time = 0; // from SDL_GetPerformanceCounter()
-static int audio_max_delay = 0;    // 50ms, in terms of SDL_GetPerformanceFrequency()
-static int muted = 0;
+	memset((char*)stack, 0, sizeof(stack));
+}
 
-void mute(int en)
+// Called on the emulation thread
+void vdp_realtime(const char *spec)
 {
-	muted = en;
+	char *list, *p, *next;
+	int cpu = -1, flags = MCL_CURRENT;
+	struct rlimit rl;
+
+	if (!spec || !*spec)
+		return;
+	list = strdup(spec);
+	for (p = list; p; p = next) {
+		char *arg;
+
+		next = strchr(p, ',');
+		if (next)
+			*next++ = 0;
+		arg = strchr(p, ':');
+		if (arg)
+			*arg++ = 0;
+		if (!strcmp(p, "fifo") || !strcmp(p, "rr")) {
+			rt_policy = p[0] == 'f' ? SCHED_FIFO : SCHED_RR;
+			if (arg) rt_prio = atoi(arg);
+		} else if (!strcmp(p, "cpu") && arg) {
+			cpu = atoi(arg);
+		} else if (!strcmp(p, "audiocpu") && arg) {
+			rt_audio_cpu = atoi(arg);
+		} else if (strcmp(p, "on") && strcmp(p, "1")) {
+			fprintf(stderr, "realtime: unknown option %s\n", p);
+		}
+	}
+	free(list);
+
+	// Locking future mappings too makes them fail past RLIMIT_MEMLOCK,
+	// so only do it without a limit
+	rt_prefault_stack();
+	if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur == RLIM_INFINITY)
+		flags |= MCL_FUTURE;
+	if (mlockall(flags) != 0)
+		fprintf(stderr, "realtime: mlockall: %s\n", strerror(errno));
+
+	rt_thread("emulation", rt_prio, cpu);
+	__atomic_store_n(&rt_audio_pending, 1, __ATOMIC_RELEASE);
+	rt_on = 1;
 }
 
-static void my_audio_callback(void *userdata, Uint8 *stream, int len)
+static void rt_report(int done)
+{
+	if (rt_misses != rt_reported) {
+		fprintf(stderr, "realtime: %u deadline misses, worst %llu us late\n",
+			rt_misses - rt_reported, rt_worst / 1000);
+		rt_reported = rt_misses;
+		rt_worst = 0;
+	}
+	if (done)
+		fprintf(stderr, "realtime: %u of %u frames missed their deadline\n",
+			rt_misses, rt_frames);
+}
+
+static void rt_miss(u64 late)
 {
-	Uint64 now = SDL_GetPerformanceCounter();
-	int time_since_update = now - next_time;
+	rt_misses++;
+	if (late > rt_worst)
+		rt_worst = late;
+}
 
-	if (time_since_update > audio_max_delay || muted) {
-		// render loop is paused or window being moved/resized
-		memset(stream, 128, len); // silence AUDIO_U8
+// Wait for the end of the frame, period ns long
+static void rt_wait(u64 period)
+{
+	u64 now = rt_now();
+
+	if (rt_deadline == 0 || now > rt_deadline + 1000000000) {
+		// first frame, or back from a menu or the debugger
+		rt_deadline = now;
+	} else if (now > rt_deadline) {
+		// emulating the frame took too long, drop behind if by a whole one
+		rt_miss(now - rt_deadline);
+		if (now > rt_deadline + period)
+			rt_deadline = now;
 	} else {
-		static unsigned int rclk = 0; // regen cpu clock but don't overshoot it!
-
-		#define CLKS 32
-		static unsigned int cpu_clks[CLKS] = {0};
-		static unsigned int rel = 0;
-		unsigned int
-			cpu = get_total_cpu_cycles(),
-			clocks = cpu - cpu_clks[0];
-		int i, sum = 0;
-		for (i = 1; i < CLKS; i++) {
-			sum += cpu_clks[i] - cpu_clks[i-1];
+		if (rt_deadline - now > RT_SPIN_NS) {
+			struct timespec ts = {
+				.tv_sec = (rt_deadline - RT_SPIN_NS) / 1000000000,
+				.tv_nsec = (rt_deadline - RT_SPIN_NS) % 1000000000,
+			};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
 		}
+		while ((now = rt_now()) < rt_deadline)
+			;
+		// woken up too late to spin
+		if (now > rt_deadline + RT_SPIN_NS)
+			rt_miss(now - rt_deadline);
+	}
+	rt_deadline += period;
+	rt_frames++;
+	if (now > rt_report_time + 1000000000) {
+		rt_report(0);
+		rt_report_time = now;
+	}
+}
+#else
+void vdp_realtime(const char *spec)
+{
+	if (spec && *spec)
+		fprintf(stderr, "realtime: not supported on this platform\n");
+}
+#endif
 
-		rclk += rel;
 
-		if ((int)(rclk - cpu) > 0) {
-			// overshot available data
-			//printf("overshoot %d\n", (rclk - cpu));
-			rclk = cpu;
-		} else {
-			// adjust closer to prevent drifting too far behind
-			//rclk += (int)(cpu - rclk) / 64;  // 63/64 rclk + 1/64 cpu
-			rel = (rel*(128-CLKS) + (cpu - rclk)) >> 7;
-		}
-		//if (clocks < 400000 || clocks > 1000000) {
-		//	printf("clocks=%d %u-%u\n", clocks, cpu, cpu_clks[0]);
-		//}
-		if (0) {
-			static unsigned int last = 0;
-			printf("cpu clks %u / samples %u, N=%u %u rel=%d  cpu=%u\n", clocks, CLKS,
-				clocks / CLKS, sum/(CLKS-1),
-				 (int)(rclk - last), cpu);
-			last = rclk;
-		}
+/****************************************
+ * Audio ring                           *
+ ****************************************/
 
-		memmove(cpu_clks, cpu_clks+1, sizeof(cpu_clks)-sizeof(cpu_clks[0]));
-		cpu_clks[CLKS-1] = cpu;
+// The emulation thread renders the sound of each frame with snd_render()
+// and queues it here, and the audio callback only copies it out.  The
+// ring is all the two threads share.
+#define RING_SIZE 8192 // samples, a power of 2
+#define RING_MAX (SAMPLE_FREQUENCY / 15) // at most 4 frames queued
+#define RING_PRIME (SAMPLE_FREQUENCY / 60) // a frame queued before playing
+static u8 ring[RING_SIZE];
+static unsigned int ring_head = 0; // written by the emulation thread
+static unsigned int ring_tail = 0; // written by the audio callback
+static int muted = 0;
+static int audio_open = 0;
 
-		// For AUDIO_U8, len is number of samples to generate
-		update(stream, 0, len, rclk);
-	}
+void mute(int en)
+{
+	muted = en;
+	if (audio_open)
+		SDL_PauseAudio(en); // stop the audio callback too
 }
 
-
-// This is the screen texture
-// Normally render 320x240, 80-col text mode 640x240, CRT mode 640x480
-static const int texture_width = 640, texture_height = 480;
-static SDL_Texture *texture = NULL;
-static int texture_len = 0; // will be 320 for normal, 640 for 80-col text mode
-#ifdef ENABLE_CRT
-static void *crt_src = NULL;
-static void *crt_dest = NULL;
+static void my_audio_callback(void *userdata, Uint8 *stream, int len)
+{
+	static int primed = 0;
+	static u8 last = 128; // held on underrun, so it doesn't click
+	unsigned int tail = ring_tail;
+	unsigned int avail = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) - tail;
+	unsigned int i;
+
+#ifdef ENABLE_REALTIME
+	if (__atomic_exchange_n(&rt_audio_pending, 0, __ATOMIC_ACQ_REL))
+		rt_thread("audio", rt_prio + 1, rt_audio_cpu);
 #endif
+	// after running dry, wait for a frame so it doesn't stutter
+	if (!primed && avail < RING_PRIME)
+		avail = 0;
+	if (avail > (unsigned int)len)
+		avail = len;
+	// For AUDIO_U8, len is number of samples
+	for (i = 0; i < avail; i++)
+		stream[i] = ring[(tail + i) & (RING_SIZE-1)];
+	if (avail)
+		last = stream[avail-1];
+	memset(stream + avail, last, len - avail);
+	primed = avail == (unsigned int)len;
+	__atomic_store_n(&ring_tail, tail + avail, __ATOMIC_RELEASE);
+}
+
+// Called on the emulation thread after each frame
+static void audio_push(void)
+{
+	u8 buf[SAMPLE_FREQUENCY / 25];
+	unsigned int head = ring_head, used, i;
+	int n = snd_render(buf, sizeof(buf));
+
+	if (!audio_open || muted)
+		return;
+	// running faster than the audio device, or it stopped
+	used = head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+	if (used + n > RING_MAX)
+		n = used < RING_MAX ? RING_MAX - used : 0;
+	for (i = 0; i < (unsigned int)n; i++)
+		ring[(head + i) & (RING_SIZE-1)] = buf[i];
+	__atomic_store_n(&ring_head, head + n, __ATOMIC_RELEASE);
+}
+
+
+/****************************************
+ * Frame triple buffer                  *
+ ****************************************/
+
+// The emulation thread draws scanlines into fb[fb_back] and publishes it
+// by swapping it with fb_ready.  The present thread swaps fb_ready with
+// fb_front to take the newest frame.  Neither side ever waits on the other.
+#define FB_NEW 4 // set in fb_ready until the present thread takes it
+struct frame {
+	u32 pixels[640*240]; // 320 wide, 640 for 80-col text mode
+	int len;  // will be 320 for normal, 640 for 80-col text mode
+	u8 debug; // debugger visible
+	u8 menu;  // menu overlay visible
+	int beam; // debugger stopped before drawing this line, or -1
+};
+static struct frame fb[3];
+static int fb_back = 0, fb_ready = 1, fb_front = 2;
+static int fb_last = -1; // last published, read-only until it comes back as fb_back
+static int fb_dirty = 0; // something was drawn since the last publish
+static int fb_drawn = 0; // lines above this were drawn since the last publish
+
+// Debugger and menu overlay, drawn by ui.c and uploaded when dirty
+static u32 debug_pixels[640*480];
+static int debug_dirty = 1;
 
 // NOTE: pixels is write-only
 void vdp_lock_texture(int line, int len, void**pixels)
 {
-	texture_len = len; // determines the display width of the texture 
-#ifdef ENABLE_CRT
-	if (cfg.crt_filter == 2 && crt_src != NULL) {
-		*pixels = crt_src + texture_width * 4 * line;
-	} else
-#endif
-	if (texture) {
-		int pitch;
-		SDL_Rect rect = {0, line, len, 1};
-		SDL_LockTexture(texture, &rect, pixels, &pitch);
-	}
+	fb[fb_back].len = len; // determines the display width of the texture 
+	fb_dirty = 1;
+	if (line >= fb_drawn)
+		fb_drawn = line + 1;
+	*pixels = fb[fb_back].pixels + 640 * line;
 }
 
 void vdp_unlock_texture(void)
 {
-#ifdef ENABLE_CRT
-	if (cfg.crt_filter == 2 && crt_src != NULL) {
-		// nothing to do, but don't unlock texture we haven't locked
-	} else
-#endif
-	if (texture) {
-		SDL_UnlockTexture(texture);
-	}
 }
 
-
-static SDL_Texture *debug_texture = NULL;
-
 // NOTE: pixels is write-only
 void vdp_lock_debug_texture(int line, int len, void **pixels)
 {
-	if (debug_texture) {
-		int pitch;
-		SDL_Rect rect = {0, line, len, 1};
-		SDL_LockTexture(debug_texture, &rect, pixels, &pitch);
-	}
+	*pixels = debug_pixels + 640 * line;
 }
 
 void vdp_unlock_debug_texture(void)
 {
-	if (debug_texture) {
-		SDL_UnlockTexture(debug_texture);
+	__atomic_store_n(&debug_dirty, 1, __ATOMIC_RELEASE);
+	fb_dirty = 1;
+}
+
+// Called by the emulation thread when a frame is done.  If keep is set,
+// or the frame is only partly drawn, the next frame starts as a copy.
+static void frame_publish(int keep)
+{
+	extern int menu_active; // ui.c
+	struct frame *f = &fb[fb_back];
+
+	if (vdp.y > 0 && vdp.y < 240 && fb_drawn < 240 && fb_last >= 0) {
+		// stopped mid-frame, lines from vdp.y down come from the last
+		// frame, unless vdp_redraw() drew them all
+		memcpy(f->pixels + 640 * vdp.y, fb[fb_last].pixels + 640 * vdp.y,
+			sizeof(f->pixels[0]) * 640 * (240 - vdp.y));
+	}
+	f->beam = -1;
+#ifdef ENABLE_DEBUGGER
+	f->debug = debug_en;
+	if (debug_en && vdp.y > 0 && vdp.y < 240)
+		f->beam = vdp.y;
+#endif
+	f->menu = menu_active;
+	fb_last = fb_back;
+	fb_back = __atomic_exchange_n(&fb_ready, fb_back | FB_NEW, __ATOMIC_ACQ_REL) & 3;
+	fb_dirty = 0;
+	fb_drawn = 0;
+	if (keep || vdp.y != 0) {
+		// menu or debugger, or stopped mid-frame: keep the lines not redrawn
+		memcpy(fb[fb_back].pixels, f->pixels, sizeof(f->pixels));
+		fb[fb_back].len = f->len;
 	}
 }
 
+// Called by the present thread, returns NULL if no new frame
+static struct frame *frame_take(void)
+{
+	if (!(__atomic_load_n(&fb_ready, __ATOMIC_ACQUIRE) & FB_NEW))
+		return NULL;
+	fb_front = __atomic_exchange_n(&fb_ready, fb_front, __ATOMIC_ACQ_REL) & 3;
+	return &fb[fb_front];
+}
+
+
+/****************************************
+ * Input queue                          *
+ ****************************************/
+
+// Events are polled on the present thread, which owns the window, and
+// handled on the emulation thread in vdp_update()
+#define EVENT_QUEUE_SIZE 256 // power of 2
+static SDL_Event event_queue[EVENT_QUEUE_SIZE];
+static unsigned int event_head = 0, event_tail = 0;
+
+enum {
+	EVENT_PASTE = SDL_USEREVENT, // user.data1 is clipboard text, SDL_free it
+	EVENT_FRAME,  // wakes up the present thread
+};
+
+static int event_push(const SDL_Event *event)
+{
+	unsigned int head = event_head;
+	if (head - __atomic_load_n(&event_tail, __ATOMIC_ACQUIRE) >= EVENT_QUEUE_SIZE)
+		return 0; // emulation stalled, drop it
+	event_queue[head & (EVENT_QUEUE_SIZE-1)] = *event;
+	__atomic_store_n(&event_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int event_pending(void)
+{
+	return event_tail != __atomic_load_n(&event_head, __ATOMIC_ACQUIRE);
+}
+
+static int event_pop(SDL_Event *event)
+{
+	unsigned int tail = event_tail;
+	if (tail == __atomic_load_n(&event_head, __ATOMIC_ACQUIRE))
+		return 0;
+	*event = event_queue[tail & (EVENT_QUEUE_SIZE-1)];
+	__atomic_store_n(&event_tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
 
 static unsigned char *text_pat;
 
@@ -198,18 +461,9 @@ void vdp_text_window(const char *line, int w, int h, int x, int y, int highlight
 	char bg_color = 14; //4;
 	uint32_t bg = palette[highlight_line == 0 ? fg_color : bg_color] | AMSK;
 	uint32_t fg = palette[highlight_line == 0 ? bg_color : fg_color] | AMSK;
-	uint32_t *pixels;
-	int pitch = 0;
+	uint32_t *pixels = debug_pixels + x + y * 640;
+	int pitch = 640 * 4;
 	const char *start = line;
-	struct SDL_Rect rect = {
-		.x = x,
-		.y = y,
-		.w = w * 6,
-		.h = h * 8,
-	};
-
-	if (!debug_texture) return;
-	SDL_LockTexture(debug_texture, &rect, (void**)&pixels, &pitch);
 
 	//pixels += x + y * (pitch/4);
 	for (unsigned int j = 0; j < h*8; j++) {
@@ -304,7 +558,7 @@ void vdp_text_window(const char *line, int w, int h, int x, int y, int highlight
 			}
 		}
 	}
-	SDL_UnlockTexture(debug_texture);
+	vdp_unlock_debug_texture();
 }
 
 void vdp_text_clear(int x, int y, int w, int h, unsigned int color)
@@ -316,18 +570,16 @@ void vdp_text_clear(int x, int y, int w, int h, unsigned int color)
 		.w = w * 6,
 		.h = h * 8,
 	};
-	void *pixels;
-	int pitch;
 
-	if (!debug_texture) return;
-	//SDL_LockTextureToSurface(debug_texture, &rect, &surface); // requires SDL 2.0.12
-	SDL_LockTexture(debug_texture, &rect, &pixels, &pitch);
-	surface = SDL_CreateRGBSurfaceFrom(pixels, rect.w, rect.h, 32, pitch, RMSK, GMSK, BMSK, AMSK);
+	if (rect.x + rect.w > 640) rect.w = 640 - rect.x;
+	if (rect.y + rect.h > 480) rect.h = 480 - rect.y;
+	surface = SDL_CreateRGBSurfaceFrom(debug_pixels + rect.x + rect.y * 640,
+		rect.w, rect.h, 32, 640 * 4, RMSK, GMSK, BMSK, AMSK);
 	if (surface) {
 		SDL_FillRect(surface, NULL, color);
 		SDL_FreeSurface(surface);
 	}
-	SDL_UnlockTexture(debug_texture);
+	vdp_unlock_debug_texture();
 }
 
 void vdp_draw_graph(double *array)
@@ -335,13 +587,8 @@ void vdp_draw_graph(double *array)
 	SDL_Surface *surface;
 	int i, pk = -1;
 	unsigned int color;
-	void *pixels;
-	int pitch;
 
-	if (!debug_texture) return;
-	//SDL_LockTextureToSurface(debug_texture, NULL, &surface); // requires SDL 2.0.12
-	SDL_LockTexture(debug_texture, NULL, &pixels, &pitch);
-	surface = SDL_CreateRGBSurfaceFrom(pixels, 640, 480, 32, pitch, RMSK, GMSK, BMSK, AMSK);
+	surface = SDL_CreateRGBSurfaceFrom(debug_pixels, 640, 480, 32, 640 * 4, RMSK, GMSK, BMSK, AMSK);
 	if (surface) {
 		SDL_FillRect(surface, NULL, AMSK);
 		for (i = 0; i < 640; i++) {
@@ -364,7 +611,7 @@ void vdp_draw_graph(double *array)
 		}
 		SDL_FreeSurface(surface);
 	}
-	SDL_UnlockTexture(debug_texture);
+	vdp_unlock_debug_texture();
 }
 
 static void set_window_icon(SDL_Window *window)
@@ -414,12 +661,21 @@ static void set_window_icon(SDL_Window *window)
 
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
+// This is the screen texture
+// Normally render 320x240, 80-col text mode 640x240, CRT mode 640x480,
+// the upscalers up to 3x that
+static int texture_width = 640, texture_height = 480;
+static int texture_filter = 0; // cfg.crt_filter the texture was made for
+static SDL_Texture *texture = NULL;
+static SDL_Texture *debug_texture = NULL;
 #ifdef ENABLE_CRT
 static struct CRT crt;
+static void *crt_dest = NULL;
 #define CRT_W ((640)*1)
 #define CRT_H ((480)*1)
 #endif
 
+static Uint64 next_time = 0; // from SDL_GetPerformanceCounter()
 static Uint64 performance_freq = 0; // value returned from SDL_GetPerformanceFrequency()
 static Uint64 ticks_per_frame = 0; // ticks per frame relative to performance_freq
 static int first_tick = 0;
@@ -429,6 +685,17 @@ static unsigned int config_fullscreen = 0;
 int menu_active = 0;
 int current_mfps = 0;
 
+#ifndef __APPLE__
+// The present thread owns the window and renderer, so a slow compositor or
+// vsync never stalls emulation.  macOS only allows them on the main thread.
+#define PRESENT_THREAD
+static SDL_Thread *present_thread = NULL;
+static int present_quit = 0;
+static SDL_sem *input_sem = NULL; // posted when input is queued
+#endif
+static int present_resize = 0; // set by vdp_window_scale()
+static int present_filter = 0; // set by vdp_set_filter()
+
 void vdp_set_fps(int mfps /* fps*1000 */)
 {
 	current_mfps = mfps;
@@ -447,22 +714,283 @@ void vdp_window_scale(int scale)
 {
 	scale_w = 320 * scale;
 	scale_h = 240 * scale;
-	if (window)
-		SDL_SetWindowSize(window, scale_w, scale_h);
+	__atomic_store_n(&present_resize, 1, __ATOMIC_RELEASE);
 }
 
-void vdp_set_filter(void)
+// (re)create the screen texture, on the present thread
+static void create_texture(void)
 {
 	if (texture) SDL_DestroyTexture(texture);
-	if (cfg.crt_filter == 0) {
-		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
-	} else {
+	// the menu may change cfg.crt_filter at any time, presenting
+	// only looks at the copy that matches the texture
+	texture_filter = cfg.crt_filter;
+	if (texture_filter == FILTER_PIXELATED || texture_filter == FILTER_CRT) {
 		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+	} else {
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+	}
+	switch (texture_filter) {
+	case FILTER_SCALE2X: case FILTER_XBR: texture_width = 1280; texture_height = 480; break;
+	case FILTER_SCALE3X: texture_width = 1920; texture_height = 720; break;
+	case FILTER_SHARP: texture_width = 1280; texture_height = 960; break;
+	default: texture_width = 640; texture_height = 480; break;
 	}
 	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
 			SDL_TEXTUREACCESS_STREAMING, texture_width, texture_height);
+}
+
+void vdp_set_filter(void)
+{
+	// the frame is kept in fb[], so no need to redraw
+	__atomic_store_n(&present_filter, 1, __ATOMIC_RELEASE);
+}
+
 
-	vdp_redraw(); // redraw the screen texture
+/****************************************
+ * Present thread                       *
+ ****************************************/
+
+static void video_init(void)
+{
+	window = SDL_CreateWindow("BuLWiP TI-99/4A - Esc for menu",
+			SDL_WINDOWPOS_UNDEFINED,
+			SDL_WINDOWPOS_UNDEFINED,
+			scale_w,
+			scale_h,
+			SDL_WINDOW_RESIZABLE);
+	set_window_icon(window);
+
+#ifdef PRESENT_THREAD
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+#else
+	renderer = SDL_CreateRenderer(window, -1, 0);
+#endif
+	create_texture();
+
+	debug_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+			SDL_TEXTUREACCESS_STREAMING, 640, 480);
+	SDL_SetTextureBlendMode(debug_texture, SDL_BLENDMODE_BLEND);
+#ifdef ENABLE_CRT
+	crt_dest = calloc(CRT_W * CRT_H, 4);
+	crt_init(&crt, CRT_W, CRT_H, crt_dest);
+#endif
+}
+
+static void video_done(void)
+{
+	if (texture) SDL_DestroyTexture(texture);
+	if (debug_texture) SDL_DestroyTexture(debug_texture);
+#ifdef ENABLE_CRT
+	free(crt_dest);
+#endif
+	if (renderer) SDL_DestroyRenderer(renderer);
+	if (window) SDL_DestroyWindow(window);
+}
+
+// Handle window events here and queue the rest for vdp_update()
+// Returns 1 if the window needs to be repainted
+static int queue_event(SDL_Event *event)
+{
+	if (event->type == EVENT_FRAME) {
+		return 0;
+	} else if (event->type == SDL_WINDOWEVENT) {
+		if (event->window.event == SDL_WINDOWEVENT_RESIZED) {
+			printf("window event %d %d\n", event->window.data1, event->window.data2);
+			scale_w = event->window.data1;
+			scale_h = event->window.data2;
+		}
+		return 1;
+	} else if ((event->type == SDL_KEYDOWN || event->type == SDL_KEYUP) &&
+			event->key.keysym.sym == SDLK_F11) {
+		if (event->type == SDL_KEYDOWN)
+			SDL_SetWindowFullscreen(window, (config_fullscreen ^= SDL_WINDOW_FULLSCREEN));
+		return 1;
+	} else if (event->type == SDL_KEYDOWN &&
+			event->key.keysym.sym == SDLK_INSERT &&
+			(event->key.keysym.mod & KMOD_SHIFT)) {
+		// the clipboard belongs to the window thread
+		SDL_Event paste = { .user = {
+			.type = EVENT_PASTE,
+			.data1 = SDL_GetClipboardText(),
+		} };
+		if (!event_push(&paste))
+			SDL_free(paste.user.data1);
+	} else {
+		event_push(event);
+	}
+#ifdef PRESENT_THREAD
+	SDL_SemPost(input_sem);
+#endif
+	return 0;
+}
+
+// Upscale the frame into the texture, and src to the scaled size.
+// This runs on the present thread while the next frame is emulated.
+static void scale_frame(struct frame *f, SDL_Rect *src)
+{
+	int nx = 2, ny = 2, pitch;
+	u32 *pixels;
+
+	if (texture_filter == FILTER_SCALE3X) {
+		nx = ny = 3;
+	} else if (texture_filter == FILTER_SHARP) {
+		// sharp bilinear: the largest integer scale that fits the
+		// window, then the linear filter does the rest
+		nx = scale_w / src->w;
+		ny = scale_h / src->h;
+		if (nx > texture_width / src->w) nx = texture_width / src->w;
+		if (ny > texture_height / src->h) ny = texture_height / src->h;
+		if (nx < 1) nx = 1;
+		if (ny < 1) ny = 1;
+	}
+	src->w *= nx;
+	src->h *= ny;
+	if (SDL_LockTexture(texture, src, (void**)&pixels, &pitch) < 0)
+		return;
+	switch (texture_filter) {
+	case FILTER_SCALE2X: scale2x(f->pixels, 640, f->len, 240, pixels, pitch/4); break;
+	case FILTER_SCALE3X: scale3x(f->pixels, 640, f->len, 240, pixels, pitch/4); break;
+	case FILTER_XBR: xbr2x(f->pixels, 640, f->len, 240, pixels, pitch/4); break;
+	default: scale_nearest(f->pixels, 640, f->len, 240, pixels, pitch/4, nx, ny); break;
+	}
+	SDL_UnlockTexture(texture);
+}
+
+static void present_frame(struct frame *f)
+{
+	SDL_Rect src = {.x = 0, .y = 0, .w = f->len, .h = 240};
+
+	if (__atomic_exchange_n(&present_resize, 0, __ATOMIC_ACQ_REL))
+		SDL_SetWindowSize(window, scale_w, scale_h);
+	if (__atomic_exchange_n(&present_filter, 0, __ATOMIC_ACQ_REL))
+		create_texture();
+	if ((f->debug || f->menu) &&
+	    __atomic_exchange_n(&debug_dirty, 0, __ATOMIC_ACQ_REL))
+		SDL_UpdateTexture(debug_texture, NULL, debug_pixels, 640 * 4);
+
+#ifdef ENABLE_CRT
+	if (texture_filter == 2) {
+		struct NTSC_SETTINGS ntsc = {
+			.w = src.w,
+			.h = src.h - 4,  // FIXME: why does this fix blurry lines?
+			.raw = 0, // scale image to fit monitor
+			.as_color = 1, // full color
+			.field = 0, //(frames & 1), // 0 = even, 1 = odd
+#if !defined(CRT_MAJOR) || CRT_MAJOR < 2
+			.cc = { 0, 1, 0, -1 },
+			.ccs = 1,
+#endif
+		};
+		int noise = 4;
+		int pitch = 640*4;
+		void *pixels;
+
+		ntsc.rgb = (void*)f->pixels;
+#if defined(CRT_MAJOR) && CRT_MAJOR == 2
+		crt_modulate(&crt, &ntsc);
+#else
+		ntsc.pitch = pitch/4;
+		crt_2ntsc(&crt, &ntsc);
+#endif
+
+		src.w = CRT_W;
+		src.h = CRT_H;
+		crt.outh = CRT_H;
+
+		SDL_LockTexture(texture, &src, (void**)&pixels, &pitch);
+
+		crt.out = crt_dest;
+#if defined(CRT_MAJOR) && CRT_MAJOR == 2
+		crt_demodulate(&crt, noise);
+#else
+		crt.outpitch = pitch/4;
+		crt_draw(&crt, noise);
+#endif
+		memcpy(pixels, crt.out, src.h * pitch);
+		SDL_UnlockTexture(texture);
+	} else
+#endif
+	if (texture_filter >= FILTER_SCALE2X) {
+		scale_frame(f, &src);
+	} else {
+		SDL_UpdateTexture(texture, &src, f->pixels, 640 * 4);
+	}
+	if (f->debug) {
+		SDL_Rect rect = {.x = 0, .y = 0, .w = scale_w/2, .h = scale_h/2};
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, debug_texture, NULL, NULL);
+		SDL_RenderCopy(renderer, texture, &src, &rect);
+		if (f->beam >= 0) {
+			// stopped mid-frame, dim the lines from the last frame
+			SDL_Rect rest = {.x = 0, .y = rect.h * f->beam / 240, .w = rect.w};
+
+			rest.h = rect.h - rest.y;
+			SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+			SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+			SDL_RenderFillRect(renderer, &rest);
+			SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+			SDL_RenderDrawLine(renderer, 0, rest.y, rect.w - 1, rest.y);
+			SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+		}
+	} else {
+		SDL_RenderCopy(renderer, texture, &src, NULL);
+	}
+	if (f->menu) {
+		// menu overlay
+		SDL_Rect src = {.x = 0, .y = 0, .w = 320, .h = 240};
+		SDL_RenderCopy(renderer, debug_texture, &src, NULL);
+	}
+
+
+	// TODO use SDL_GetTicks() to determine actual framerate and 
+	// dupe/drop frames to achieve desired VDP freq
+	SDL_RenderPresent(renderer);
+}
+
+#ifdef PRESENT_THREAD
+static int present_main(void *arg)
+{
+	video_init();
+	SDL_SemPost(arg); // window is ready
+
+	while (!__atomic_load_n(&present_quit, __ATOMIC_ACQUIRE)) {
+		SDL_Event event;
+		struct frame *f;
+		int repaint = 0;
+
+		// sleep until input, a window event or EVENT_FRAME
+		if (SDL_WaitEventTimeout(&event, 1000)) {
+			do {
+				repaint |= queue_event(&event);
+			} while (SDL_PollEvent(&event));
+		}
+		f = frame_take();
+		if (!f && repaint)
+			f = &fb[fb_front];
+		if (f && renderer)
+			present_frame(f);
+	}
+	video_done();
+	return 0;
+}
+#endif
+
+// Show the last published frame
+static void present_wake(void)
+{
+#ifdef PRESENT_THREAD
+	SDL_Event event = { .type = EVENT_FRAME };
+	if (present_thread) SDL_PushEvent(&event);
+#else
+	if (renderer) {
+		SDL_Event event;
+		struct frame *f;
+		while (SDL_PollEvent(&event))
+			queue_event(&event);
+		f = frame_take();
+		if (f) present_frame(f);
+	}
+#endif
 }
 
 void vdp_init(void)
@@ -488,30 +1016,21 @@ void vdp_init(void)
 
 		if (SDL_OpenAudio(&audio, NULL) < 0) {
 			SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't open SDL audio: %s", SDL_GetError());
+		} else {
+			audio_open = 1;
 		}
 	}
 
 	if (video) {
-		window = SDL_CreateWindow("BuLWiP TI-99/4A - Esc for menu",
-				SDL_WINDOWPOS_UNDEFINED,
-				SDL_WINDOWPOS_UNDEFINED,
-				scale_w,
-				scale_h,
-				SDL_WINDOW_RESIZABLE);
-		set_window_icon(window);
-
-		renderer = SDL_CreateRenderer(window, -1, 0);
-
 		cfg.crt_filter = 0;
-		vdp_set_filter(); // this creates the "texture" texture
-
-		debug_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-				SDL_TEXTUREACCESS_STREAMING, 640, 480);
-		SDL_SetTextureBlendMode(debug_texture, SDL_BLENDMODE_BLEND);
-#ifdef ENABLE_CRT
-		crt_src = calloc(texture_width * 240, 4);
-		crt_dest = calloc(CRT_W * CRT_H, 4);
-		crt_init(&crt, CRT_W, CRT_H, crt_dest);
+#ifdef PRESENT_THREAD
+		SDL_sem *ready = SDL_CreateSemaphore(0);
+		input_sem = SDL_CreateSemaphore(0);
+		present_thread = SDL_CreateThread(present_main, "present", ready);
+		SDL_SemWait(ready); // wait for the window
+		SDL_DestroySemaphore(ready);
+#else
+		video_init();
 #endif
 	}
 
@@ -524,12 +1043,11 @@ void vdp_init(void)
 	}
 	first_tick = SDL_GetTicks();
 	performance_freq = SDL_GetPerformanceFrequency();
-	audio_max_delay = 50/*ms*/ * performance_freq / 1000;
 
 	vdp_set_fps(NTSC_FPS);
 	vdp_text_clear(0, 0, 640/6+1, 480/8, AMSK); // clear debug window
 
-	if (window) {
+	if (window && audio_open) {
 		SDL_PauseAudio(0); // start playing
 	}
 
@@ -538,35 +1056,52 @@ void vdp_init(void)
 void vdp_done(void)
 {
 	fprintf(stderr, "SDL_QUIT %f fps\n", frames*1000.0/(SDL_GetTicks()-first_tick));
-	if (texture) SDL_DestroyTexture(texture);
-#ifdef ENABLE_CRT
-	free(crt_src);
-	free(crt_dest);
+#ifdef ENABLE_REALTIME
+	if (rt_on)
+		rt_report(1);
+#endif
+#ifdef PRESENT_THREAD
+	if (present_thread) {
+		__atomic_store_n(&present_quit, 1, __ATOMIC_RELEASE);
+		present_wake();
+		SDL_WaitThread(present_thread, NULL);
+		SDL_DestroySemaphore(input_sem);
+	}
+#else
+	video_done();
 #endif
-	if (renderer) SDL_DestroyRenderer(renderer);
 	if (window) SDL_CloseAudio();
 	SDL_Quit();
 }
 
+// Handle queued input on the emulation thread
 // returns -1 if the SDL window is closed, otherwise 0
-int vdp_update(void)
+static int handle_events(void)
 {
 	SDL_Event event;
-	while (SDL_PollEvent(&event)) {
+
+	while (event_pop(&event)) {
 		if (event.type == SDL_QUIT) {
 			return -1;
-		//} else if (event.type == SDL_KEY) {
-		} else if (event.type == SDL_WINDOWEVENT) {
-			if (event.window.event == SDL_WINDOWEVENT_RESIZED ||
-			    event.window.event == SDL_WINDOWEVENT_RESIZED) {
-				printf("window event %d %d\n", event.window.data1, event.window.data2);
-				scale_w = event.window.data1;
-				scale_h = event.window.data2;
-			}
 		} else if (event.type == SDL_DROPFILE) {
-			set_cart_name(event.drop.file);
-			reset();
+			// BASIC programs go into VDP RAM, anything else is a cartridge
+			switch (basic_load(event.drop.file)) {
+			case 1:
+				set_cart_name(event.drop.file);
+				reset();
+				break;
+			case -1: // basic_load says why
+				fprintf(stderr, "%s: not loaded\n", event.drop.file);
+				break;
+			}
+			SDL_free(event.drop.file);
 
+		} else if (event.type == EVENT_PASTE) {
+			char *text = event.user.data1;
+#ifdef ENABLE_DEBUGGER
+			if (text && text[0]) paste_text(text, current_mfps);
+#endif
+			SDL_free(text);
 		} else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
 			SDL_KeyboardEvent *key = &event.key;
 			Uint16 mod = key->keysym.mod;
@@ -641,17 +1176,7 @@ int vdp_update(void)
 
 			case SDLK_BACKSPACE: k = TI_S | TI_ADDFCTN; break;
 			case SDLK_DELETE: k = TI_1 | TI_ADDFCTN; break;
-			case SDLK_INSERT:
-				if ((mod & KMOD_SHIFT) && kdn) {
-					char *text = SDL_GetClipboardText();
-#ifdef ENABLE_DEBUGGER
-					if (text && text[0]) paste_text(text, current_mfps);
-#endif
-					SDL_free(text);
-				} else {
-					k = TI_2 | TI_ADDFCTN;
-				}
-				break;
+			case SDLK_INSERT: k = TI_2 | TI_ADDFCTN; break; // Shift-Insert is EVENT_PASTE
 			case SDLK_BACKQUOTE: k = (mod & KMOD_SHIFT ? TI_W : TI_C) | TI_ADDFCTN; break;
 			case SDLK_LEFTBRACKET: k = (mod & KMOD_SHIFT ? TI_G : TI_R) | TI_ADDFCTN; break;
 			case SDLK_RIGHTBRACKET: k = (mod & KMOD_SHIFT ? TI_F : TI_T) | TI_ADDFCTN; break;
@@ -731,7 +1256,7 @@ int vdp_update(void)
 			case SDLK_F10: k = TI_0+TI_ADDFCTN; break;
 
 
-			case SDLK_F11: if (kdn) SDL_SetWindowFullscreen(window, (config_fullscreen ^= SDL_WINDOW_FULLSCREEN)); break;
+			// F11 full-screen is handled in queue_event()
 			case SDLK_F12: if (!kdn) break;
 				if (mod & KMOD_CTRL) reset();
 #ifdef ENABLE_DEBUGGER
@@ -785,74 +1310,24 @@ int vdp_update(void)
 		}
 	}
 
-	if (renderer) {
-		SDL_Rect src = {.x = 0, .y = 0, .w = texture_len, .h = 240};
-		SDL_Rect dst = {.x = 0, .y = 0, .w = scale_w, .h = scale_h};
-
-#ifdef ENABLE_CRT
-		if (cfg.crt_filter == 2) {
-			struct NTSC_SETTINGS ntsc = {
-				.w = src.w,
-				.h = src.h - 4,  // FIXME: why does this fix blurry lines?
-				.raw = 0, // scale image to fit monitor
-				.as_color = 1, // full color
-				.field = 0, //(frames & 1), // 0 = even, 1 = odd
-#if !defined(CRT_MAJOR) || CRT_MAJOR < 2
-				.cc = { 0, 1, 0, -1 },
-				.ccs = 1,
-#endif
-			};
-			int noise = 4;
-			int pitch = 640*4;
-			void *pixels;
-
-			ntsc.rgb = crt_src;
-#if defined(CRT_MAJOR) && CRT_MAJOR == 2
-			crt_modulate(&crt, &ntsc);
-#else
-			ntsc.pitch = pitch/4;
-			crt_2ntsc(&crt, &ntsc);
-#endif
-
-			src.w = CRT_W;
-			src.h = CRT_H;
-			crt.outh = CRT_H;
+	return 0;
+}
 
-			SDL_LockTexture(texture, &src, (void**)&pixels, &pitch);
+// returns -1 if the SDL window is closed, otherwise 0
+int vdp_update(void)
+{
+	frame_publish(0);
+	present_wake();
+	audio_push();
+	if (handle_events() == -1)
+		return -1;
 
-			crt.out = crt_dest;
-#if defined(CRT_MAJOR) && CRT_MAJOR == 2
-			crt_demodulate(&crt, noise);
-#else
-			crt.outpitch = pitch/4;
-			crt_draw(&crt, noise);
-#endif
-			memcpy(pixels, crt.out, src.h * pitch);
-			SDL_UnlockTexture(texture);
-		}
-#endif
-#ifdef ENABLE_DEBUGGER
-		if (debug_en) {
-			SDL_Rect rect = {.x = 0, .y = 0, .w = scale_w/2, .h = scale_h/2};
-			SDL_RenderClear(renderer);
-			SDL_RenderCopy(renderer, debug_texture, NULL, NULL);
-			SDL_RenderCopy(renderer, texture, &src, &rect);
+	if (renderer) {
+#ifdef ENABLE_REALTIME
+		if (rt_on && current_mfps != 0) {
+			rt_wait(1000000000000ULL / current_mfps);
 		} else
 #endif
-		{
-			SDL_RenderCopy(renderer, texture, &src, NULL);
-		}
-		if (menu_active) {
-			// menu overlay
-			SDL_Rect src = {.x = 0, .y = 0, .w = 320, .h = 240};
-			SDL_RenderCopy(renderer, debug_texture, &src, NULL);
-		}
-
-
-		// TODO use SDL_GetTicks() to determine actual framerate and 
-		// dupe/drop frames to achieve desired VDP freq
-		SDL_RenderPresent(renderer);
-
 		if (ticks_per_frame != 0) { // cap frame rate, approximately
 			Uint64 now = SDL_GetPerformanceCounter();
 			Uint64 time_left = (int)(next_time - now);
@@ -876,4 +1351,25 @@ int vdp_update(void)
 	return 0;
 }
 
-
+// For menus and the debugger: show the frame only if something was drawn,
+// then sleep until there is input instead of running at the frame rate.
+// returns -1 if the SDL window is closed, otherwise 0
+int vdp_update_idle(int timeout_ms)
+{
+	if (fb_dirty) {
+		frame_publish(1);
+		present_wake();
+	}
+	if (!event_pending()) {
+#ifdef PRESENT_THREAD
+		if (input_sem) SDL_SemWaitTimeout(input_sem, timeout_ms);
+#else
+		SDL_Event event;
+		if (renderer && SDL_WaitEventTimeout(&event, timeout_ms)) {
+			if (queue_event(&event))
+				present_frame(&fb[fb_front]);
+		}
+#endif
+	}
+	return handle_events();
+}
@@ -0,0 +1,424 @@
+/*
+ *  speech.c - TMS 5220 speech synthesizer
+ *
+ * Copyright (c) 2023 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+
+// The CPU side (speech_read/speech_write/speech_run) follows the chip
+// commands, VSM address and FIFO, and parses each LPC frame when the chip
+// would, so the status bits are exact.  Parsed frames are timestamped in
+// CPU cycles and passed through a ring to the audio thread, which does the
+// interpolation and lattice filter synthesis in speech_mix().
+
+#define SPEECH_CPU_CLK 3000000
+#define SPEECH_RATE 8000
+#define FRAME_SAMPLES 200 // 25ms
+#define FRAME_CYCLES (SPEECH_CPU_CLK / SPEECH_RATE * FRAME_SAMPLES)
+#define SPEECH_FIFO_SIZE 16
+#define RING_SIZE 64 // power of two
+
+#define STATUS_TS 0x80 // talk status
+#define STATUS_BL 0x40 // buffer low, FIFO has 8 bytes or less
+#define STATUS_BE 0x20 // buffer empty
+
+/****************************************
+ * TMS 5220 coefficient tables          *
+ ****************************************/
+
+static const u8 energy_table[16] = {
+	0, 1, 2, 3, 4, 6, 8, 11, 16, 23, 33, 47, 63, 85, 114, 0 };
+
+static const u8 pitch_table[64] = {
+	0, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
+	30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 44, 46, 48,
+	50, 52, 53, 56, 58, 60, 62, 65, 68, 70, 72, 76, 78, 80, 84, 86,
+	91, 94, 98, 101, 105, 109, 114, 118, 122, 127, 132, 137, 142, 148, 153, 159 };
+
+static const s16 k1_table[32] = {
+	-501, -498, -497, -495, -493, -491, -488, -482,
+	-478, -474, -469, -464, -459, -452, -445, -437,
+	-412, -380, -339, -288, -227, -158, -81, -1,
+	80, 157, 226, 287, 337, 379, 411, 436 };
+static const s16 k2_table[32] = {
+	-328, -303, -274, -244, -211, -175, -138, -99,
+	-59, -18, 24, 64, 105, 143, 180, 215,
+	248, 278, 306, 331, 354, 374, 392, 408,
+	422, 435, 445, 455, 463, 470, 476, 506 };
+static const s16 k3_table[16] = {
+	-441, -387, -333, -279, -225, -171, -117, -63,
+	-9, 45, 98, 152, 206, 260, 314, 368 };
+static const s16 k4_table[16] = {
+	-328, -273, -217, -161, -106, -50, 5, 61,
+	116, 172, 228, 283, 339, 394, 450, 506 };
+static const s16 k5_table[16] = {
+	-328, -282, -235, -189, -142, -96, -50, -3,
+	43, 90, 136, 182, 229, 275, 322, 368 };
+static const s16 k6_table[16] = {
+	-256, -212, -168, -123, -79, -35, 10, 54,
+	98, 143, 187, 232, 276, 320, 365, 409 };
+static const s16 k7_table[16] = {
+	-308, -260, -212, -164, -117, -69, -21, 27,
+	75, 122, 170, 218, 266, 314, 361, 409 };
+static const s16 k8_table[8] = { -256, -161, -66, 29, 124, 219, 314, 410 };
+static const s16 k9_table[8] = { -256, -176, -96, -15, 65, 146, 226, 307 };
+static const s16 k10_table[8] = { -205, -132, -59, 14, 87, 160, 234, 307 };
+
+static const s16 *k_table[10] = {
+	k1_table, k2_table, k3_table, k4_table, k5_table,
+	k6_table, k7_table, k8_table, k9_table, k10_table };
+static const u8 k_bits[10] = { 5, 5, 4, 4, 4, 4, 4, 3, 3, 3 };
+
+static const s8 chirp_table[] = {
+	0x00, 0x03, 0x0f, 0x28, 0x4c, 0x6c, 0x71, 0x50,
+	0x25, 0x26, 0x4c, 0x44, 0x1a, 0x32, 0x3b, 0x13,
+	0x37, 0x1a, 0x25, 0x1f, 0x1d, 0x00 };
+
+// interpolation shift for each of the 8 sub-periods of a frame
+static const u8 interp_shift[8] = { 0, 3, 3, 3, 2, 2, 1, 1 };
+
+
+/****************************************
+ * Frame ring (CPU thread -> audio)     *
+ ****************************************/
+
+struct speech_frame {
+	u64 timestamp; // in cpu cycles
+	u8 energy, pitch;  // table values, pitch 0 is unvoiced
+	u8 silent, stop;   // silent frames keep the previous pitch and K
+	s16 k[10];
+};
+
+static struct speech_frame ring[RING_SIZE];
+static unsigned int ring_head = 0, ring_tail = 0; // written by CPU, audio thread
+
+static void ring_push(const struct speech_frame *f)
+{
+	unsigned int head = ring_head;
+	if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= RING_SIZE)
+		return; // audio not running, drop it
+	ring[head & (RING_SIZE-1)] = *f;
+	__atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/****************************************
+ * VSM and FIFO (CPU thread)            *
+ ****************************************/
+
+static const u8 *vsm = NULL; // speech ROM, 2 x 16K VSM chips
+static unsigned int vsm_size = 0;
+static u32 vsm_addr = 0;
+static u8 vsm_bit = 0;     // next bit in the current VSM byte
+static u8 vsm_nibbles = 0; // number of load address nibbles received
+
+static u8 fifo[SPEECH_FIFO_SIZE];
+static u8 fifo_head = 0, fifo_count = 0, fifo_bit = 0;
+
+static u8 data_reg = 0;       // result of read byte command
+static u8 data_ready = 0;     // next read returns data_reg instead of status
+static u8 speak_external = 0; // data writes go to FIFO
+static u8 talk = 0;
+static u64 next_frame = 0; // cpu cycle of next frame parse
+static struct speech_frame last; // previous frame for repeats
+
+void speech_init(const u8 *rom, unsigned int size)
+{
+	vsm = rom;
+	vsm_size = size;
+}
+
+static u8 vsm_byte(u32 addr)
+{
+	addr &= 0x3ffff; // 14 address bits + 4 chip selects
+	return addr < vsm_size ? vsm[addr] : 0;
+}
+
+// Read count bits from the VSM or FIFO.  Bytes are shifted out LSB first,
+// and the first bit received is the MSB of the result.
+// Returns -1 if the FIFO ran dry during speak external.
+static int read_bits(int count)
+{
+	int val = 0;
+
+	while (count--) {
+		u8 bit;
+		if (speak_external) {
+			if (fifo_count == 0)
+				return -1;
+			bit = (fifo[fifo_head] >> fifo_bit) & 1;
+			if (++fifo_bit == 8) {
+				fifo_bit = 0;
+				fifo_head = (fifo_head + 1) & (SPEECH_FIFO_SIZE-1);
+				fifo_count--;
+			}
+		} else {
+			bit = (vsm_byte(vsm_addr) >> vsm_bit) & 1;
+			if (++vsm_bit == 8) {
+				vsm_bit = 0;
+				vsm_addr++;
+			}
+		}
+		val = (val << 1) | bit;
+	}
+	return val;
+}
+
+static void stop_talking(u64 timestamp)
+{
+	struct speech_frame f = { .timestamp = timestamp, .stop = 1, .silent = 1 };
+
+	talk = 0;
+	speak_external = 0;
+	fifo_head = fifo_count = fifo_bit = 0;
+	ring_push(&f);
+}
+
+// Parse one LPC frame at cpu cycle timestamp
+static void parse_frame(u64 timestamp)
+{
+	struct speech_frame f = last;
+	int i, e, repeat, pitch;
+
+	f.timestamp = timestamp;
+	f.silent = 0;
+	e = read_bits(4);
+	if (e < 0) goto empty;
+	if (e == 0 || e == 15) {
+		// silent frame, or stop frame
+		if (e == 15) {
+			stop_talking(timestamp);
+			return;
+		}
+		f.energy = 0;
+		f.silent = 1;
+		ring_push(&f);
+		return;
+	}
+	f.energy = energy_table[e];
+	repeat = read_bits(1);
+	pitch = read_bits(6);
+	if (repeat < 0 || pitch < 0) goto empty;
+	f.pitch = pitch_table[pitch];
+	if (!repeat) {
+		// unvoiced frames have only 4 reflection coefficients
+		for (i = 0; i < (pitch ? 10 : 4); i++) {
+			int k = read_bits(k_bits[i]);
+			if (k < 0) goto empty;
+			f.k[i] = k_table[i][k];
+		}
+		for (; i < 10; i++)
+			f.k[i] = 0;
+	}
+	last = f;
+	ring_push(&f);
+	return;
+empty:
+	// buffer empty during speak external stops speech
+	stop_talking(timestamp);
+}
+
+// Catch up on frame parsing until cpu cycle now
+void speech_run(u64 now)
+{
+	while (talk && (s64)(now - next_frame) >= 0) {
+		parse_frame(next_frame);
+		next_frame += FRAME_CYCLES;
+	}
+}
+
+static void start_talking(u64 now)
+{
+	talk = 1;
+	next_frame = now;
+	memset(&last, 0, sizeof(last));
+	speech_run(now);
+}
+
+// Read from >9000
+u8 speech_read(void)
+{
+	speech_run(get_total_cpu_cycles());
+	if (data_ready) {
+		data_ready = 0;
+		return data_reg;
+	}
+	return (talk ? STATUS_TS : 0) |
+		(fifo_count <= 8 ? STATUS_BL : 0) |
+		(fifo_count == 0 ? STATUS_BE : 0);
+}
+
+// Write to >9400
+void speech_write(u8 value)
+{
+	u64 now = get_total_cpu_cycles();
+
+	speech_run(now);
+	if (speak_external) {
+		if (fifo_count < SPEECH_FIFO_SIZE) {
+			fifo[(fifo_head + fifo_count) & (SPEECH_FIFO_SIZE-1)] = value;
+			fifo_count++;
+		}
+		// speech begins when the buffer is no longer low
+		if (!talk && fifo_count > 8)
+			start_talking(now);
+		return;
+	}
+
+	if ((value & 0x70) != 0x40)
+		vsm_nibbles = 0;
+
+	switch (value & 0x70) {
+	case 0x10: // read byte
+		data_reg = vsm_byte(vsm_addr++);
+		vsm_bit = 0;
+		data_ready = 1;
+		break;
+	case 0x30: // read and branch
+		vsm_addr = (vsm_addr & ~0x3fff) |
+			(((vsm_byte(vsm_addr) << 8) | vsm_byte(vsm_addr + 1)) & 0x3fff);
+		vsm_bit = 0;
+		break;
+	case 0x40: // load address, 5 nibbles low to high, extras ignored
+		if (vsm_nibbles < 5) {
+			vsm_addr &= ~(0xf << (vsm_nibbles * 4));
+			vsm_addr |= (value & 0xf) << (vsm_nibbles * 4);
+			vsm_nibbles++;
+		}
+		vsm_bit = 0;
+		break;
+	case 0x50: // speak
+		speak_external = 0;
+		start_talking(now);
+		break;
+	case 0x60: // speak external
+		fifo_head = fifo_count = fifo_bit = 0;
+		speak_external = 1;
+		talk = 0;
+		break;
+	case 0x70: // reset
+		data_ready = 0;
+		stop_talking(now);
+		break;
+	}
+}
+
+
+/****************************************
+ * LPC synthesis (audio thread)         *
+ ****************************************/
+
+static int cur_energy = 0, cur_pitch = 0, cur_k[10] = {0};
+static int tgt_energy = 0, tgt_pitch = 0, tgt_k[10] = {0};
+static int lattice_x[10] = {0};
+static int pitch_count = 0, sample_count = FRAME_SAMPLES;
+static int rng = 0x1fff;
+static int rate_acc = 0, out = 0;
+
+static void load_frame(const struct speech_frame *f)
+{
+	int i;
+	// interpolation is inhibited coming out of silence or when voicing changes
+	int inhibit = tgt_energy == 0 || (!f->silent && !tgt_pitch != !f->pitch);
+
+	tgt_energy = f->energy;
+	if (!f->silent) {
+		tgt_pitch = f->pitch;
+		for (i = 0; i < 10; i++)
+			tgt_k[i] = f->k[i];
+	}
+	if (inhibit) {
+		cur_energy = tgt_energy;
+		cur_pitch = tgt_pitch;
+		for (i = 0; i < 10; i++)
+			cur_k[i] = tgt_k[i];
+	}
+	sample_count = 0;
+}
+
+static int synth_sample(void)
+{
+	int i, exc, u[11];
+
+	if (sample_count < FRAME_SAMPLES) {
+		if (sample_count > 0 && sample_count % (FRAME_SAMPLES/8) == 0) {
+			int shift = interp_shift[sample_count / (FRAME_SAMPLES/8)];
+			cur_energy += (tgt_energy - cur_energy) >> shift;
+			cur_pitch += (tgt_pitch - cur_pitch) >> shift;
+			for (i = 0; i < 10; i++)
+				cur_k[i] += (tgt_k[i] - cur_k[i]) >> shift;
+		}
+		sample_count++;
+	}
+
+	if (cur_pitch == 0) {
+		// unvoiced, 13-bit LFSR noise
+		int bit = ((rng >> 12) ^ (rng >> 3) ^ (rng >> 2) ^ rng) & 1;
+		rng = ((rng << 1) | bit) & 0x1fff;
+		exc = (rng & 1) ? -64 : 64;
+	} else {
+		exc = pitch_count < (int)ARRAY_SIZE(chirp_table) ? chirp_table[pitch_count] : 0;
+		if (++pitch_count >= cur_pitch)
+			pitch_count = 0;
+	}
+
+	// 10-stage lattice filter, K values are 9-bit fractions
+	u[10] = (cur_energy * exc) >> 3;
+	for (i = 9; i >= 0; i--)
+		u[i] = u[i+1] - ((cur_k[i] * lattice_x[i]) >> 9);
+	for (i = 9; i >= 1; i--)
+		lattice_x[i] = lattice_x[i-1] + ((cur_k[i-1] * u[i-1]) >> 9);
+	if (u[0] > 2047) u[0] = 2047;
+	else if (u[0] < -2048) u[0] = -2048;
+	lattice_x[0] = u[0];
+	return u[0];
+}
+
+// Mix speech into len AUDIO_U8 samples at freq Hz, ending at cpu cycle current_cpu_cycles
+void speech_mix(unsigned char *buffer, int len, int freq, u64 current_cpu_cycles)
+{
+	u64 t = current_cpu_cycles - (u64)(SPEECH_CPU_CLK / freq * len);
+	unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = ring_tail;
+	int i;
+
+	if (head == tail && cur_energy == 0 && tgt_energy == 0)
+		return; // idle
+
+	for (i = 0; i < len; i++, t += SPEECH_CPU_CLK / freq) {
+		rate_acc += SPEECH_RATE;
+		if (rate_acc >= freq) {
+			rate_acc -= freq;
+			while (tail != head && (s64)(t - ring[tail & (RING_SIZE-1)].timestamp) >= 0) {
+				load_frame(&ring[tail & (RING_SIZE-1)]);
+				tail++;
+			}
+			out = synth_sample() >> 6;
+		}
+		int v = buffer[i] + out;
+		buffer[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+	__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,220 @@
+/*
+ *  timeline.c - VDP port access timeline
+ *
+ * Copyright (c) 2024 Pete Eberlein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "cpu.h"
+
+// When cfg.vdp_timeline is set, every CPU access to the VDP ports is
+// recorded with its CPU cycle in the frame, scanline and VRAM address, and
+// counted per scanline by which table the address falls in.  At the end of
+// a frame the recording becomes the one shown in the debug window (key T)
+// and written by vdp_timeline_save().  This shows which programs change
+// registers mid-frame or write the sprite attribute table during active
+// display, and where the VRAM bandwidth goes.
+//
+// Tables are found from the base address registers when the access
+// happens, ignoring the bitmap mode address masks.  Sprite patterns that
+// share the pattern table count as patterns.
+//
+// The saved file is, in host byte order:
+//	char magic[4] "VDPT", u32 version 1, u32 lines, u32 columns,
+//	u32 events, u32 dropped,
+//	u16 counts[lines][columns] (columns are enum timeline_column),
+//	struct timeline_event events[events]
+
+#define LINES 262
+#define TOPBORD 24 // first line of active display, as in gpu.c
+#define MAX_EVENTS 8192 // about 40 per scanline
+
+struct timeline_event {
+	u32 cycle; // CPU cycles since the start of the frame
+	u16 y;     // vdp.y
+	u16 addr;  // VRAM address, or register number
+	u8 kind;   // enum timeline_kind
+	u8 value;
+	u8 column; // enum timeline_column
+	u8 pad;
+};
+
+struct timeline {
+	u32 events, dropped;
+	u16 counts[LINES][TL_COLUMNS];
+	struct timeline_event event[MAX_EVENTS];
+};
+
+static struct timeline rec, last; // recording, and the last whole frame
+static u64 frame_start = 0;
+
+
+static int vram_table(u16 a)
+{
+	const u8 *r = vdp.reg;
+	int text = r[1] & 0x10;
+	u16 nt = (r[2] & 0xf) << 10, sat = (r[5] & 0x7f) << 7, spt = (r[6] & 7) << 11;
+	u16 ct = r[3] << 6, pt = (r[4] & 7) << 11;
+	unsigned int ct_len = 32, pt_len = 0x800;
+
+	if (r[0] & 2) { // bitmap
+		ct = (r[3] & 0x80) << 6;
+		pt = (r[4] & 4) << 11;
+		ct_len = pt_len = 0x1800;
+	}
+	// text mode has no sprites or color table
+	if (!text && (u16)(a - sat) < 128)
+		return TL_SAT;
+	if ((u16)(a - nt) < (text ? 960 : 768))
+		return TL_NAME;
+	if (!text && (u16)(a - ct) < ct_len)
+		return TL_COLOR;
+	if ((u16)(a - pt) < pt_len)
+		return TL_PATTERN;
+	if (!text && (u16)(a - spt) < 0x800)
+		return TL_SPRITE;
+	return TL_OTHER;
+}
+
+// Called by the port handlers before the access is done
+void vdp_timeline_record(int kind, u16 addr, u8 value)
+{
+	struct timeline_event *e;
+	int col = kind == TL_REG_W ? TL_REG : kind == TL_STATUS_R ? TL_STATUS :
+		vram_table(addr);
+	u16 y = vdp.y < LINES ? vdp.y : LINES-1;
+
+	rec.counts[y][col]++;
+	if (rec.events == MAX_EVENTS) {
+		rec.dropped++;
+		return;
+	}
+	e = &rec.event[rec.events++];
+	e->cycle = get_total_cpu_cycles() - frame_start;
+	e->y = y;
+	e->addr = addr;
+	e->kind = kind;
+	e->value = value;
+	e->column = col;
+	e->pad = 0;
+}
+
+// Called at the start of each frame
+void vdp_timeline_frame(void)
+{
+	frame_start = get_total_cpu_cycles();
+	if (!cfg.vdp_timeline)
+		return;
+	memcpy(&last, &rec, offsetof(struct timeline, event) +
+		rec.events * sizeof(rec.event[0]));
+	memset(&rec, 0, offsetof(struct timeline, event));
+}
+
+// Write the last whole frame, returns 0 on success or -1
+int vdp_timeline_save(const char *filename)
+{
+	u32 hdr[6] = { 0, 1, LINES, TL_COLUMNS, last.events, last.dropped };
+	FILE *f = fopen(filename, "wb");
+	int ret = 0;
+
+	if (!f)
+		return -1;
+	memcpy(hdr, "VDPT", 4);
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(last.counts, sizeof(last.counts), 1, f) != 1 ||
+	    fwrite(last.event, sizeof(last.event[0]), last.events, f) != last.events)
+		ret = -1;
+	if (fclose(f) != 0)
+		ret = -1;
+	return ret;
+}
+
+
+#ifdef ENABLE_DEBUGGER
+
+static const u32 column_rgb[TL_COLUMNS] = {
+	[TL_NAME] = 0xffe0e040,    // yellow
+	[TL_PATTERN] = 0xff40c040, // green
+	[TL_COLOR] = 0xffc040c0,   // magenta
+	[TL_SAT] = 0xffff4040,     // red
+	[TL_SPRITE] = 0xff40c0e0,  // cyan
+	[TL_OTHER] = 0xff808080,   // gray
+	[TL_REG] = 0xffffffff,     // white
+	[TL_STATUS] = 0xff4060ff,  // blue
+};
+
+// Draw the last frame in the debug texture at x,y, one column per
+// scanline, 64 pixels high.  VRAM accesses stack up from the bottom,
+// 4 pixels each, with register writes and status reads marked at the top.
+// Active display has a dark background, so mid-frame changes stand out.
+void vdp_timeline_draw(int x, int y)
+{
+	char text[43];
+	u32 vram = 0, sat_active = 0, regs = 0, mid_regs = 0;
+	int i, j, c;
+
+	for (j = 0; j < 64; j++) {
+		u32 *pixels;
+
+		vdp_lock_debug_texture(y + j, 640, (void**)&pixels);
+		for (i = 0; i < LINES; i++) {
+			const u16 *n = last.counts[i];
+			int h = 63 - j, active = i >= TOPBORD && i < TOPBORD+192;
+			u32 rgb = active ? 0xff202020 : 0xff000000;
+
+			if (j < 2 && n[TL_REG])
+				rgb = column_rgb[TL_REG];
+			else if (j >= 3 && j < 5 && n[TL_STATUS])
+				rgb = column_rgb[TL_STATUS];
+			else
+				for (c = 0; c < TL_REG; c++) {
+					h -= 4 * n[c];
+					if (h < 0) {
+						rgb = column_rgb[c];
+						break;
+					}
+				}
+			pixels[x + i] = rgb;
+		}
+		vdp_unlock_debug_texture();
+	}
+
+	for (i = 0; i < LINES; i++) {
+		int active = i >= TOPBORD && i < TOPBORD+192;
+
+		for (c = 0; c < TL_REG; c++)
+			vram += last.counts[i][c];
+		regs += last.counts[i][TL_REG];
+		if (active) {
+			sat_active += last.counts[i][TL_SAT];
+			mid_regs += last.counts[i][TL_REG];
+		}
+	}
+	snprintf(text, sizeof(text), "VRAM %-4u REG %-3u ACTIVE:REG %-3u SAT %-3u",
+		vram, regs, mid_regs, sat_active);
+	vdp_text_window(text, 42, 1, x, y + 64, -1);
+}
+
+#endif
@@ -77,7 +77,7 @@ static int wait_key(void)
 			ui_key = 0;
 			return i;
 		}
-		i = vdp_update();
+		i = vdp_update_idle(1000);
 #ifdef ENABLE_DEBUGGER
 		if (menu_active == 0 && debug_en && debug_break != DEBUG_STOP)
 			return 0;
@@ -620,12 +620,16 @@ static int crt_filter_menu(void)
 		"= SMOOTHED          =\n"
 		"= PIXELATED         =\n"
 		"= CRT               =\n"
+		"= SCALE2X           =\n"
+		"= SCALE3X           =\n"
+		"= XBR               =\n"
+		"= SHARP BILINEAR    =\n"
 		"=                   =\n"
 		"= THX2 GITHUB.COM/  =\n"
 		"= LMP88959/NTSC-CRT =\n"
 		"=====================\n";
 	int sel = cfg.crt_filter+1;
-	int w = 21, h = 8;
+	int w = 21, h = 12;
 
 	while (1) {
 		vdp_text_clear(MENU_X+8,MENU_Y+8, w,h, SHADOW);
@@ -634,7 +638,7 @@ static int crt_filter_menu(void)
 		switch (wait_key()) {
 		case TI_MENU: vdp_text_clear(MENU_X,MENU_Y, w+2,h+1,CLEAR); return 0;
 		case TI_UP1: if (sel > 1) sel--; break;
-		case TI_DOWN1: if (sel < 3) sel++; break;
+		case TI_DOWN1: if (sel < 7) sel++; break;
 		case TI_ENTER: case TI_FIRE1: case TI_SPACE:
 			vdp_text_clear(MENU_X,MENU_Y, w+2,h+1, CLEAR);
 			cfg.crt_filter = sel-1;
@@ -652,19 +656,44 @@ static int settings_menu(void)
 		"= FRAME RATE       =\n"
 		"= WINDOW SCALE     =\n"
 		"= VIDEO FILTER     =\n"
+		"= VDP TIMING   OFF =\n"
+		"= SPRITES/LINE   4 =\n"
+		"= FAST MATH    OFF =\n"
+		"= GPU IDLE SKIP OFF=\n"
 		"====================\n";
 	int sel = 1;
-	int w = 20, h = 5;
+	int w = 20, h = 9;
 
 	while (1) {
+		memcpy(menu + 21*4 + 15, cfg.vdp_timing ? "ON " : "OFF", 3);
+		memcpy(menu + 21*5 + 16, cfg.unlimited_sprites ? "32" : " 4", 2);
+		memcpy(menu + 21*6 + 15, cfg.fp_hle ? "ON " : "OFF", 3);
+		memcpy(menu + 21*7 + 16, cfg.gpu_idle_skip ? "ON " : "OFF", 3);
 		vdp_text_clear(MENU_X+8,MENU_Y+8, w,h, SHADOW);
 		vdp_text_window(menu, w,h, MENU_X,MENU_Y, sel);
 
 		switch (wait_key()) {
 		case TI_MENU: vdp_text_clear(MENU_X,MENU_Y, w+2,h+1, CLEAR); return 0;
 		case TI_UP1: if (sel > 1) sel--; break;
-		case TI_DOWN1: if (sel < 3) sel++; break;
+		case TI_DOWN1: if (sel < 7) sel++; break;
 		case TI_ENTER: case TI_FIRE1: case TI_SPACE:
+			if (sel == 4) { // toggle in place
+				cfg.vdp_timing ^= 1;
+				break;
+			}
+			if (sel == 5) {
+				cfg.unlimited_sprites ^= 1;
+				break;
+			}
+			if (sel == 6) {
+				cfg.fp_hle = cfg.fp_hle ? 0 : FP_HLE_CYCLES;
+				fp_hle_update();
+				break;
+			}
+			if (sel == 7) {
+				cfg.gpu_idle_skip ^= 1;
+				break;
+			}
 			vdp_text_clear(MENU_X,MENU_Y, w+2,h+1, CLEAR);
 			switch (sel) {
 			case 1: if (fps_menu() == -1) return -1; break;
@@ -1080,6 +1109,7 @@ refresh:
 
 
 char *find_stack = NULL;  // array of string pointers, NULL terminated
+static char *step_stack = NULL; // scanlines and cycles to run
 
 static void string_stack_push(char **stack, char *text)
 {
@@ -1443,8 +1473,10 @@ debug_redraw:
 			debug_break = DEBUG_STOP;
 			return 0; // return to draw one whole frame, then come back here
 		}
-		// single stepping or paused will redraw whole frame
-		vdp_redraw();
+		if (debug_break == DEBUG_SCANLINE_STEP || debug_break == DEBUG_CYCLE_STEP)
+			return 0; // run_frame() stops when done, then back here
+		// the frontend keeps showing the last frame, with any lines
+		// already drawn this frame, so no need to redraw here
 
 		if (debug_break == DEBUG_SINGLE_STEP) {
 			extern int trace; // cpu.c
@@ -1468,10 +1500,37 @@ debug_redraw:
 		case TI_2: debug_pattern_type = 1; goto debug_refresh_window;
 		case TI_3: debug_pattern_type = 2; goto debug_refresh_window;
 		case TI_S: debug_pattern_type = 3; goto debug_refresh_window;
+		case TI_T: // last frame's VDP accesses, recorded from now on
+			debug_pattern_type = 4;
+			cfg.vdp_timeline = 1;
+			goto debug_refresh_window;
 			}
+		case TI_T+TI_ADDCTRL:
+			if (vdp_timeline_save("bulwip_vdp.bin") == 0)
+				printf("VDP timeline saved to bulwip_vdp.bin\n");
+			break;
 		case TI_R:
 			if (reg_menu(&addr, &bank) == -1) return -1;
+			vdp_redraw(); // registers or memory may have changed
 			goto debug_refresh_window;
+		case TI_L: // run to a scanline, or the next one
+		case TI_C: { // run cycles
+			char *end;
+			long n;
+			int ret = text_entry(k == TI_L ? "SCANLINE" : "CYCLES", &step_stack);
+
+			if (ret == -1) return -1;
+			if (ret == 0) break;
+			n = strtol(step_stack, &end, 10);
+			if (k == TI_C && n > 0)
+				debug_run_cycles(n);
+			else if (k == TI_L)
+				debug_run_line(end == step_stack || n < 0 ? -1 : n & 0xff); // vdp.y is a u8
+			break;
+		}
+		case TI_V: // run to the vblank interrupt
+			debug_run_line(246);
+			break;
 		}
 
 		if (seg) {
@@ -1558,9 +1617,11 @@ debug_redraw:
 			do {
 				if (undo_pop()) break;
 			} while (get_pc() >= a);
+			vdp_redraw(); // show the VRAM undo put back
 			goto debug_refresh;
 		} else if (k == TI_Z) {
 			if (undo_pop() == 0) {
+				vdp_redraw();
 				goto debug_refresh;
 			}
 #endif